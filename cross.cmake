@@ -47,29 +47,43 @@ add_executable(pkgj
   ${assets}
   src/aes128.cpp
   src/bgdl.cpp
+  src/cachinghttp.cpp
+  src/catalogdb.cpp
+  src/chunktuner.cpp
   src/comppackdb.cpp
   src/config.cpp
   src/db.cpp
   src/dialog.cpp
   src/download.cpp
+  src/downloadscheduler.cpp
   src/downloader.cpp
   src/extractzip.cpp
+  src/fetchservice.cpp
   src/filedownload.cpp
   src/gameview.cpp
   src/patchinfo.cpp
   src/patchinfofetcher.cpp
   src/imagefetcher.cpp
   src/imgui.cpp
+  src/inflatinghttp.cpp
   src/install.cpp
+  src/lockstats.cpp
   src/menu.cpp
+  src/multisourcehttp.cpp
   src/pkgi.cpp
   src/puff.c
+  src/queuejournal.cpp
+  src/resuminghttp.cpp
+  src/searchkey.cpp
   src/sfo.cpp
   src/sha256.cpp
+  src/taskpool.cpp
   src/update.cpp
+  src/updatesview.cpp
   src/vita.cpp
   src/vitafile.cpp
   src/vitahttp.cpp
+  src/vitathread.cpp
   src/zrif.cpp
 )
 
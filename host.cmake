@@ -1,15 +1,30 @@
 add_executable(pkgj_cli
+  src/cachinghttp.cpp
+  src/catalogdb.cpp
+  src/chunktuner.cpp
   src/comppackdb.cpp
   src/db.cpp
   src/download.cpp
+  src/downloadscheduler.cpp
   src/extractzip.cpp
+  src/fetchservice.cpp
   src/filedownload.cpp
+  src/inflatinghttp.cpp
+  src/lockstats.cpp
+  src/multisourcehttp.cpp
   src/patchinfo.cpp
+  src/patchinfofetcher.cpp
+  src/queuejournal.cpp
+  src/resuminghttp.cpp
+  src/searchkey.cpp
   src/simulator.cpp
+  src/stdthread.cpp
+  src/taskpool.cpp
   src/aes128.cpp
   src/sfo.cpp
   src/sha256.cpp
   src/filehttp.cpp
+  src/sockethttp.cpp
   src/zrif.cpp
   src/puff.c
   src/cli.cpp
@@ -22,4 +37,5 @@ target_link_libraries(pkgj_cli
   CONAN_PKG::sqlite3
   CONAN_PKG::cereal
   zip
+  z
 )
@@ -0,0 +1,511 @@
+#include "cachinghttp.hpp"
+
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <strings.h>
+
+namespace
+{
+std::atomic<uint32_t> g_hits{0};
+std::atomic<uint32_t> g_revalidated{0};
+std::atomic<uint32_t> g_misses{0};
+
+// several fetchers may write at the same time
+constexpr int BUSY_TIMEOUT_MS = 2000;
+
+int64_t now()
+{
+    return std::time(nullptr);
+}
+
+std::string column_text(sqlite3_stmt* stmt, int column)
+{
+    const auto text =
+            reinterpret_cast<const char*>(sqlite3_column_text(stmt, column));
+    return text ? text : "";
+}
+}
+
+std::string pkgi_http_cache_path()
+{
+    return fmt::format("{}/httpcache.db", pkgi_get_config_folder());
+}
+
+CachingHttp::CachingHttp(
+        std::unique_ptr<Http> http,
+        const std::string& dbPath,
+        uint32_t ttl,
+        uint64_t max_size)
+    : _http(std::move(http)), _dbPath(dbPath), _ttl(ttl), _max_size(max_size)
+{
+}
+
+CachingHttp::~CachingHttp()
+{
+    close();
+}
+
+CachingHttp::Stats CachingHttp::stats()
+{
+    return Stats{g_hits, g_revalidated, g_misses};
+}
+
+void CachingHttp::open()
+{
+    if (_sqliteDb)
+        return;
+
+    sqlite3* db;
+    const auto open_result = sqlite3_open(_dbPath.c_str(), &db);
+    // sqlite3_open allocates a handle even on failure, it must be closed
+    _sqliteDb.reset(db);
+    SQLITE_CHECK(open_result, "can't open http cache");
+
+    sqlite3_busy_timeout(_sqliteDb.get(), BUSY_TIMEOUT_MS);
+    // losing the cache on a crash is fine
+    SQLITE_EXEC(
+            _sqliteDb, "PRAGMA synchronous = OFF", "can't set synchronous");
+    SQLITE_EXEC(
+            _sqliteDb,
+            R"(
+        CREATE TABLE IF NOT EXISTS responses (
+            key TEXT PRIMARY KEY NOT NULL,
+            status INTEGER NOT NULL,
+            etag TEXT NOT NULL,
+            last_modified TEXT NOT NULL,
+            stored INTEGER NOT NULL,
+            last_used INTEGER NOT NULL,
+            length INTEGER NOT NULL,
+            body BLOB
+        );
+        CREATE INDEX IF NOT EXISTS responses_last_used
+            ON responses (last_used))",
+            "can't create http cache table");
+}
+
+std::optional<CachingHttp::Entry> CachingHttp::lookup()
+{
+    sqlite3_stmt* stmt;
+    SQLITE_CHECK(
+            sqlite3_prepare_v2(
+                    _sqliteDb.get(),
+                    R"(
+                    SELECT status, etag, last_modified, stored, length, body
+                    FROM responses
+                    WHERE key = ?)",
+                    -1,
+                    &stmt,
+                    nullptr),
+            "can't prepare http cache lookup");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        sqlite3_finalize(stmt);
+    };
+
+    SQLITE_CHECK(
+            sqlite3_bind_text(
+                    stmt, 1, _key.c_str(), _key.size(), SQLITE_STATIC),
+            "can't bind http cache key");
+
+    const auto step = sqlite3_step(stmt);
+    if (step == SQLITE_DONE)
+        return std::nullopt;
+    if (step != SQLITE_ROW)
+        throw std::runtime_error(fmt::format(
+                "can't read http cache:\n{}", sqlite3_errmsg(_sqliteDb.get())));
+
+    Entry entry;
+    entry.status = sqlite3_column_int(stmt, 0);
+    entry.etag = column_text(stmt, 1);
+    entry.last_modified = column_text(stmt, 2);
+    entry.stored = sqlite3_column_int64(stmt, 3);
+    entry.length = sqlite3_column_int64(stmt, 4);
+    const auto body = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 5));
+    entry.body.assign(body, body + sqlite3_column_bytes(stmt, 5));
+    return entry;
+}
+
+void CachingHttp::touch()
+{
+    sqlite3_stmt* stmt;
+    SQLITE_CHECK(
+            sqlite3_prepare_v2(
+                    _sqliteDb.get(),
+                    R"(
+                    UPDATE responses
+                    SET stored = ?, last_used = ?, etag = ?, last_modified = ?
+                    WHERE key = ?)",
+                    -1,
+                    &stmt,
+                    nullptr),
+            "can't prepare http cache update");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        sqlite3_finalize(stmt);
+    };
+
+    sqlite3_bind_int64(stmt, 1, _entry.stored);
+    sqlite3_bind_int64(stmt, 2, now());
+    sqlite3_bind_text(
+            stmt, 3, _entry.etag.c_str(), _entry.etag.size(), SQLITE_STATIC);
+    sqlite3_bind_text(
+            stmt,
+            4,
+            _entry.last_modified.c_str(),
+            _entry.last_modified.size(),
+            SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, _key.c_str(), _key.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        throw std::runtime_error(fmt::format(
+                "can't update http cache:\n{}",
+                sqlite3_errmsg(_sqliteDb.get())));
+}
+
+void CachingHttp::store()
+{
+    sqlite3_stmt* stmt;
+    SQLITE_CHECK(
+            sqlite3_prepare_v2(
+                    _sqliteDb.get(),
+                    R"(
+                    INSERT OR REPLACE INTO responses
+                    (key, status, etag, last_modified, stored, last_used,
+                        length, body)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?))",
+                    -1,
+                    &stmt,
+                    nullptr),
+            "can't prepare http cache insert");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        sqlite3_finalize(stmt);
+    };
+
+    sqlite3_bind_text(stmt, 1, _key.c_str(), _key.size(), SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, _entry.status);
+    sqlite3_bind_text(
+            stmt, 3, _entry.etag.c_str(), _entry.etag.size(), SQLITE_STATIC);
+    sqlite3_bind_text(
+            stmt,
+            4,
+            _entry.last_modified.c_str(),
+            _entry.last_modified.size(),
+            SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, _entry.stored);
+    sqlite3_bind_int64(stmt, 6, _entry.stored);
+    sqlite3_bind_int64(stmt, 7, _entry.length);
+    sqlite3_bind_blob(
+            stmt, 8, _entry.body.data(), _entry.body.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        throw std::runtime_error(fmt::format(
+                "can't write http cache:\n{}",
+                sqlite3_errmsg(_sqliteDb.get())));
+
+    evict();
+}
+
+void CachingHttp::evict()
+{
+    sqlite3_stmt* stmt;
+    SQLITE_CHECK(
+            sqlite3_prepare_v2(
+                    _sqliteDb.get(),
+                    R"(
+                    SELECT key, LENGTH(body)
+                    FROM responses
+                    ORDER BY last_used DESC)",
+                    -1,
+                    &stmt,
+                    nullptr),
+            "can't prepare http cache eviction");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        sqlite3_finalize(stmt);
+    };
+
+    // keep the most recently used bodies that fit in the budget
+    uint64_t total = 0;
+    std::vector<std::string> evicted;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        total += sqlite3_column_int64(stmt, 1);
+        if (total > _max_size)
+            evicted.push_back(column_text(stmt, 0));
+    }
+    if (evicted.empty())
+        return;
+
+    LOGF("evicting {} responses from http cache", evicted.size());
+    sqlite3_stmt* del;
+    SQLITE_CHECK(
+            sqlite3_prepare_v2(
+                    _sqliteDb.get(),
+                    "DELETE FROM responses WHERE key = ?",
+                    -1,
+                    &del,
+                    nullptr),
+            "can't prepare http cache delete");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        sqlite3_finalize(del);
+    };
+    for (const auto& key : evicted)
+    {
+        sqlite3_reset(del);
+        sqlite3_bind_text(del, 1, key.c_str(), key.size(), SQLITE_STATIC);
+        sqlite3_step(del);
+    }
+}
+
+void CachingHttp::serve(Entry entry)
+{
+    _entry = std::move(entry);
+    _cached = true;
+    _body_pos = 0;
+}
+
+void CachingHttp::start(const std::string& url, uint64_t offset, bool head)
+{
+    _cached = false;
+    _storing = false;
+    _aborted = false;
+    _entry = Entry{};
+
+    // the headers only go to _http when a request is made, a hit must not
+    // leave them for the next one
+    auto headers = std::move(_request_headers);
+    _request_headers.clear();
+    const auto add_headers = [&] {
+        for (const auto& header : headers)
+            _http->add_request_header(header.first, header.second);
+    };
+
+    // only whole responses are cached
+    if (offset != 0)
+    {
+        add_headers();
+        _http->start(url, offset, head);
+        return;
+    }
+
+    _key = head ? "HEAD " + url : url;
+
+    // the cache must never make a request fail, errors only disable it
+    std::optional<Entry> entry;
+    try
+    {
+        open();
+        entry = lookup();
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("http cache unavailable: {}", e.what());
+        _sqliteDb.reset();
+    }
+
+    const auto age = entry ? now() - entry->stored : 0;
+    if (entry && age >= 0 && age < _ttl)
+    {
+        LOGF("http cache hit for {}", _key);
+        ++g_hits;
+        serve(std::move(*entry));
+        try
+        {
+            touch();
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("can't update http cache: {}", e.what());
+        }
+        return;
+    }
+
+    add_headers();
+    if (entry && !entry->etag.empty())
+        _http->add_request_header("If-None-Match", entry->etag);
+    if (entry && !entry->last_modified.empty())
+        _http->add_request_header("If-Modified-Since", entry->last_modified);
+
+    try
+    {
+        _http->start(url, 0, head);
+    }
+    catch (const HttpError& e)
+    {
+        if (!entry)
+            throw;
+        LOGF("serving stale {} from http cache: {}", _key, e.what());
+        ++g_hits;
+        serve(std::move(*entry));
+        return;
+    }
+
+    const auto status = _http->get_status();
+    if (entry && status == 304)
+    {
+        LOGF("http cache revalidated {}", _key);
+        ++g_revalidated;
+        const auto etag = _http->get_response_header("ETag");
+        const auto last_modified = _http->get_response_header("Last-Modified");
+        _http->close();
+
+        serve(std::move(*entry));
+        _entry.stored = now();
+        if (!etag.empty())
+            _entry.etag = etag;
+        if (!last_modified.empty())
+            _entry.last_modified = last_modified;
+        try
+        {
+            if (_sqliteDb)
+                touch();
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("can't update http cache: {}", e.what());
+        }
+        return;
+    }
+
+    ++g_misses;
+    if (_sqliteDb && (status == 200 || status == 404))
+        store_response(status, head);
+}
+
+void CachingHttp::store_response(int status, bool head)
+{
+    _entry.status = status;
+    _entry.etag = _http->get_response_header("ETag");
+    _entry.last_modified = _http->get_response_header("Last-Modified");
+    _entry.stored = now();
+    _entry.length = status == 200 ? _http->get_length() : 0;
+
+    if (!head && status == 200)
+    {
+        if (static_cast<uint64_t>(_entry.length) > MAX_ENTRY_SIZE)
+            return;
+        // the body is stored once it was read entirely
+        _storing = true;
+        return;
+    }
+
+    try
+    {
+        store();
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("can't write http cache: {}", e.what());
+    }
+}
+
+int64_t CachingHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (_cached)
+    {
+        if (_entry.status != 200 && _entry.status != 206)
+            throw HttpError(fmt::format("HTTP状态异常: {}", _entry.status));
+        const auto count =
+                std::min<uint64_t>(size, _entry.body.size() - _body_pos);
+        memcpy(buffer, _entry.body.data() + _body_pos, count);
+        _body_pos += count;
+        return count;
+    }
+
+    const auto read = _http->read(buffer, size);
+    if (!_storing)
+        return read;
+
+    if (_entry.body.size() + read > MAX_ENTRY_SIZE)
+    {
+        _storing = false;
+        _entry.body = {};
+        return read;
+    }
+    _entry.body.insert(_entry.body.end(), buffer, buffer + read);
+
+    const bool done =
+            (read == 0 && size != 0) ||
+            (_entry.length > 0 &&
+             _entry.body.size() == static_cast<uint64_t>(_entry.length));
+    if (done && !_aborted)
+    {
+        _storing = false;
+        _entry.length = _entry.body.size();
+        try
+        {
+            store();
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("can't write http cache: {}", e.what());
+        }
+    }
+    return read;
+}
+
+void CachingHttp::abort()
+{
+    // called from another thread, the partial body must not be stored
+    _aborted = true;
+    if (!_cached)
+        _http->abort();
+}
+
+void CachingHttp::close()
+{
+    _cached = false;
+    _storing = false;
+    _entry = Entry{};
+    _http->close();
+}
+
+int CachingHttp::get_status()
+{
+    if (_cached)
+        return _entry.status;
+    return _http->get_status();
+}
+
+int64_t CachingHttp::get_length()
+{
+    if (_cached)
+    {
+        if (_entry.status != 200 && _entry.status != 206)
+            throw HttpError(fmt::format("HTTP状态异常: {}", _entry.status));
+        return _entry.length;
+    }
+    return _http->get_length();
+}
+
+void CachingHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _request_headers.emplace_back(name, value);
+}
+
+std::string CachingHttp::get_response_header(const std::string& name)
+{
+    if (!_cached)
+        return _http->get_response_header(name);
+    if (strcasecmp(name.c_str(), "ETag") == 0)
+        return _entry.etag;
+    if (strcasecmp(name.c_str(), "Last-Modified") == 0)
+        return _entry.last_modified;
+    return {};
+}
+
+CachingHttp::operator bool() const
+{
+    return _cached || static_cast<bool>(*_http);
+}
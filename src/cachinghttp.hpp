@@ -0,0 +1,100 @@
+#pragma once
+
+#include "http.hpp"
+#include "sqlite.hpp"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+std::string pkgi_http_cache_path();
+
+// Keeps small responses of the wrapped Http in a SQLite database. A fresh
+// response is served without any network access, a stale one is revalidated
+// with a conditional request and served again on 304 or when the network
+// fails. Ranged requests and bodies bigger than MAX_ENTRY_SIZE are passed
+// through untouched. The least recently used responses are dropped once the
+// bodies take more than max_size.
+class CachingHttp : public Http
+{
+public:
+    static constexpr uint32_t DEFAULT_TTL = 24 * 60 * 60;
+    static constexpr uint64_t DEFAULT_MAX_SIZE = 4 * 1024 * 1024;
+    static constexpr size_t MAX_ENTRY_SIZE = 256 * 1024;
+
+    struct Stats
+    {
+        uint32_t hits;
+        // stale responses confirmed by a 304
+        uint32_t revalidated;
+        uint32_t misses;
+    };
+
+    // ttl is in seconds
+    CachingHttp(
+            std::unique_ptr<Http> http,
+            const std::string& dbPath,
+            uint32_t ttl = DEFAULT_TTL,
+            uint64_t max_size = DEFAULT_MAX_SIZE);
+    ~CachingHttp();
+
+    void start(const std::string& url, uint64_t offset, bool head = false) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+    void close() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
+    explicit operator bool() const override;
+
+    // counted over all instances
+    static Stats stats();
+
+private:
+    struct Entry
+    {
+        int status = 0;
+        std::string etag;
+        std::string last_modified;
+        int64_t stored = 0;
+        int64_t length = 0;
+        std::vector<uint8_t> body;
+    };
+
+    std::unique_ptr<Http> _http;
+    std::string _dbPath;
+    uint32_t _ttl;
+    uint64_t _max_size;
+
+    SqlitePtr _sqliteDb = nullptr;
+
+    // sent with the next request _http makes
+    std::vector<std::pair<std::string, std::string>> _request_headers;
+
+    std::string _key;
+    // the response is served from _entry instead of _http
+    bool _cached = false;
+    // the response of _http is copied in _entry as it is read
+    bool _storing = false;
+    std::atomic<bool> _aborted{false};
+    Entry _entry;
+    size_t _body_pos = 0;
+
+    void open();
+    std::optional<Entry> lookup();
+    void serve(Entry entry);
+    void store();
+    void touch();
+    void evict();
+    void store_response(int status, bool head);
+};
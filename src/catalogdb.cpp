@@ -0,0 +1,709 @@
+#include "catalogdb.hpp"
+
+#include "file.hpp"
+#include "pkgi.hpp"
+#include "searchkey.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+// Titles of all modes. game_region is pkgi_get_region() of the title id,
+// search_key holds the search keys of the name and original name separated by
+// a new line.
+constexpr auto CATALOG_SCHEMA = R"(
+    CREATE TABLE IF NOT EXISTS titles (
+        mode INTEGER NOT NULL,
+        titleid TEXT NOT NULL,
+        content TEXT NOT NULL,
+        region INTEGER NOT NULL,
+        game_region INTEGER NOT NULL,
+        name TEXT NOT NULL,
+        name_org TEXT NOT NULL,
+        zrif TEXT NOT NULL,
+        url TEXT NOT NULL,
+        digest BLOB,
+        size INTEGER NOT NULL,
+        date TEXT NOT NULL,
+        app_version TEXT NOT NULL,
+        fw_version TEXT NOT NULL,
+        search_key TEXT NOT NULL
+    );
+    CREATE INDEX IF NOT EXISTS titles_content ON titles (mode, content);
+    CREATE INDEX IF NOT EXISTS titles_titleid ON titles (mode, titleid);
+    CREATE INDEX IF NOT EXISTS titles_region ON titles (mode, region);
+    CREATE INDEX IF NOT EXISTS titles_game_region
+        ON titles (mode, game_region, titleid);
+    CREATE INDEX IF NOT EXISTS titles_name
+        ON titles (mode, name COLLATE NOCASE, titleid);
+    CREATE INDEX IF NOT EXISTS titles_size ON titles (mode, size, titleid);
+    CREATE INDEX IF NOT EXISTS titles_date ON titles (mode, date, titleid);
+
+    -- title list each mode was ingested from
+    CREATE TABLE IF NOT EXISTS sources (
+        mode INTEGER PRIMARY KEY,
+        size INTEGER NOT NULL,
+        search_flags INTEGER NOT NULL
+    );
+)";
+
+constexpr auto ITEM_COLUMNS =
+        "titleid, content, name, name_org, zrif, url, digest, size, date, "
+        "app_version, fw_version";
+
+// the refresh thread ingests on its own connection while the main loop reads
+// the view and the comp pack lists share the file
+constexpr int BUSY_TIMEOUT_MS = 5000;
+
+// the trigram tokenizer matches any substring of at least 3 characters, like
+// the plain search does
+constexpr auto FTS_MIN_CHARS = 3;
+
+size_t utf8_length(const std::string& str)
+{
+    size_t length = 0;
+    for (const auto c : str)
+        if ((c & 0xc0) != 0x80)
+            ++length;
+    return length;
+}
+
+std::string fts_phrase(const std::string& key)
+{
+    std::string phrase = "\"";
+    for (const auto c : key)
+    {
+        if (c == '"')
+            phrase += '"';
+        phrase += c;
+    }
+    phrase += '"';
+    return phrase;
+}
+
+const char* column_text(sqlite3_stmt* stmt, int column)
+{
+    const auto text = sqlite3_column_text(stmt, column);
+    return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+// not cached, for the statements that may run on another thread than the
+// one of the view
+SqliteStmtPtr prepare_once(const SqlitePtr& db, const char* sql)
+{
+    sqlite3_stmt* raw;
+    if (sqlite3_prepare_v2(db.get(), sql, -1, &raw, nullptr) != SQLITE_OK)
+        throw formatEx<std::runtime_error>(
+                "can't prepare SQL statement:\n{}", sqlite3_errmsg(db.get()));
+    return SqliteStmtPtr(raw);
+}
+
+// FTS5 and its trigram tokenizer depend on how sqlite was built, the plain
+// substring search is used without them
+bool create_fts(const SqlitePtr& db)
+{
+    char* errmsg;
+    if (sqlite3_exec(
+                db.get(),
+                "CREATE VIRTUAL TABLE IF NOT EXISTS titles_fts "
+                "USING fts5(search_key, tokenize = 'trigram')",
+                nullptr,
+                nullptr,
+                &errmsg) == SQLITE_OK)
+        return true;
+    LOG("full text search unavailable: %s", errmsg);
+    sqlite3_free(errmsg);
+    return false;
+}
+}
+
+CatalogTitleDatabase::CatalogTitleDatabase(
+        const std::string& dbPath, uint32_t search_flags)
+    : _dbPath(dbPath), _search_flags(search_flags)
+{
+    _resume_count = pkgi_resume_count();
+    reopen();
+}
+
+SqlitePtr CatalogTitleDatabase::open_connection() const
+{
+    const auto path = fmt::format("{}/{}", _dbPath, FILE_NAME);
+    LOG("opening catalog %s", path.c_str());
+
+    sqlite3* raw;
+    const auto open_result = sqlite3_open(path.c_str(), &raw);
+    // sqlite3_open allocates a handle even on failure, it must be closed
+    SqlitePtr db(raw);
+    if (open_result != SQLITE_OK)
+        throw formatEx<std::runtime_error>(
+                "can't open database:\n{}", sqlite3_errmsg(db.get()));
+    sqlite3_busy_timeout(db.get(), BUSY_TIMEOUT_MS);
+    return db;
+}
+
+void CatalogTitleDatabase::reopen()
+{
+    _statements.clear();
+    _sqliteDb.reset();
+    _sqliteDb = open_connection();
+
+    int version = 0;
+    SQLITE_EXEC_RESULT(
+            _sqliteDb,
+            "PRAGMA user_version",
+            "can't read schema version",
+            [](void* data, int, char** values, char**) {
+                *static_cast<int*>(data) = values[0] ? atoi(values[0]) : 0;
+                return 0;
+            },
+            &version);
+    if (version != SCHEMA_VERSION)
+    {
+        LOGF("catalog schema {} is outdated, recreating", version);
+        SQLITE_EXEC(
+                _sqliteDb,
+                "DROP TABLE IF EXISTS titles; "
+                "DROP TABLE IF EXISTS titles_fts; "
+                "DROP TABLE IF EXISTS sources",
+                "drop table failed");
+    }
+
+    SQLITE_EXEC(_sqliteDb, CATALOG_SCHEMA, "can't create catalog tables");
+    SQLITE_EXEC(
+            _sqliteDb,
+            fmt::format("PRAGMA user_version = {}", SCHEMA_VERSION).c_str(),
+            "can't set schema version");
+    SQLITE_EXEC(
+            _sqliteDb,
+            "CREATE TEMP TABLE IF NOT EXISTS installed (titleid TEXT PRIMARY "
+            "KEY)",
+            "can't create installed table");
+    fill_installed();
+
+    _has_fts = create_fts(_sqliteDb);
+}
+
+void CatalogTitleDatabase::ensure_connection()
+{
+    // queries on a connection opened before a suspend fail with disk I/O
+    // errors
+    const auto resume_count = pkgi_resume_count();
+    if (_sqliteDb && resume_count == _resume_count)
+        return;
+
+    LOG("reconnecting to the catalog after resume");
+    _resume_count = resume_count;
+    reopen();
+}
+
+sqlite3_stmt* CatalogTitleDatabase::prepare(const std::string& sql)
+{
+    auto& stmt = _statements[sql];
+    if (!stmt)
+    {
+        sqlite3_stmt* raw;
+        SQLITE_CHECK(
+                sqlite3_prepare_v2(
+                        _sqliteDb.get(), sql.c_str(), -1, &raw, nullptr),
+                "can't prepare SQL statement");
+        stmt.reset(raw);
+    }
+    else
+    {
+        sqlite3_reset(stmt.get());
+        sqlite3_clear_bindings(stmt.get());
+    }
+    return stmt.get();
+}
+
+void CatalogTitleDatabase::bind_view(sqlite3_stmt* stmt)
+{
+    // a parameter that doesn't appear in the statement has index 0 and the
+    // bind is a no-op
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":mode"), _mode);
+    sqlite3_bind_int(
+            stmt,
+            sqlite3_bind_parameter_index(stmt, ":regions"),
+            _region_filter & DbFilterAllRegions);
+    sqlite3_bind_text(
+            stmt,
+            sqlite3_bind_parameter_index(stmt, ":search"),
+            _search.data(),
+            _search.size(),
+            SQLITE_STATIC);
+}
+
+uint32_t CatalogTitleDatabase::query_count(const std::string& sql)
+{
+    auto stmt = prepare(sql);
+    bind_view(stmt);
+    const auto err = sqlite3_step(stmt);
+    if (err != SQLITE_ROW)
+        throw formatEx<std::runtime_error>(
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get()));
+    const auto count = static_cast<uint32_t>(sqlite3_column_int64(stmt, 0));
+    sqlite3_reset(stmt);
+    return count;
+}
+
+bool CatalogTitleDatabase::is_ingested(const SqlitePtr& db, Mode mode) const
+{
+    const auto path =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    if (!pkgi_file_exists(path))
+        return true;
+
+    const auto stmt = prepare_once(
+            db, "SELECT size, search_flags FROM sources WHERE mode = :mode");
+    sqlite3_bind_int(stmt.get(), 1, mode);
+    const auto err = sqlite3_step(stmt.get());
+    if (err == SQLITE_DONE)
+        return false;
+    if (err != SQLITE_ROW)
+        throw formatEx<std::runtime_error>(
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(db.get()));
+
+    return sqlite3_column_int64(stmt.get(), 0) ==
+                   pkgi_get_size(path.c_str()) &&
+           static_cast<uint32_t>(sqlite3_column_int64(stmt.get(), 1)) ==
+                   _search_flags;
+}
+
+void CatalogTitleDatabase::ingest(const SqlitePtr& db, Mode mode) const
+{
+    const auto path =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+
+    LOGF("ingesting {} into the catalog", path);
+
+    const bool fts = create_fts(db);
+
+    // the catalog can be rebuilt from the title lists if the app dies in the
+    // middle of the ingest. It is committed every INGEST_BATCH_ROWS rows,
+    // a single transaction would lock the other connections out of the file
+    // once its pages spill to it. The source is removed first and written
+    // last, so that a cut ingest is done again.
+    SQLITE_EXEC(db, "PRAGMA synchronous = OFF", "can't set pragma");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        char* errmsg;
+        auto err = sqlite3_exec(
+                db.get(),
+                "PRAGMA synchronous = FULL",
+                nullptr,
+                nullptr,
+                &errmsg);
+        if (err != SQLITE_OK)
+            LOG("sqlite error: %s", errmsg);
+    };
+
+    SQLITE_EXEC(db, "BEGIN", "can't begin transaction");
+
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        if (std::uncaught_exceptions() == 0)
+            SQLITE_EXEC(db, "END", "can't end transaction");
+        else
+        {
+            char* errmsg;
+            auto err = sqlite3_exec(
+                    db.get(), "ROLLBACK", nullptr, nullptr, &errmsg);
+            if (err != SQLITE_OK)
+                LOG("sqlite error: %s", errmsg);
+        }
+    };
+
+    const auto step = [&](sqlite3_stmt* stmt) {
+        const auto err = sqlite3_step(stmt);
+        if (err != SQLITE_DONE)
+            throw formatEx<std::runtime_error>(
+                    "无法执行SQL语句:\n{}", sqlite3_errmsg(db.get()));
+    };
+
+    {
+        const auto stmt =
+                prepare_once(db, "DELETE FROM sources WHERE mode = ?");
+        sqlite3_bind_int(stmt.get(), 1, mode);
+        step(stmt.get());
+    }
+    if (fts)
+    {
+        const auto stmt = prepare_once(
+                db,
+                "DELETE FROM titles_fts WHERE rowid IN "
+                "(SELECT rowid FROM titles WHERE mode = ?)");
+        sqlite3_bind_int(stmt.get(), 1, mode);
+        step(stmt.get());
+    }
+    {
+        const auto stmt =
+                prepare_once(db, "DELETE FROM titles WHERE mode = ?");
+        sqlite3_bind_int(stmt.get(), 1, mode);
+        step(stmt.get());
+    }
+
+    const auto insert_stmt = prepare_once(
+            db,
+            "INSERT INTO titles (mode, titleid, content, region, "
+            "game_region, name, name_org, zrif, url, digest, size, date, "
+            "app_version, fw_version, search_key) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    const auto insert_fts_stmt =
+            fts ? prepare_once(
+                          db,
+                          "INSERT INTO titles_fts (rowid, search_key) "
+                          "VALUES (?, ?)")
+                : nullptr;
+    const auto insert = insert_stmt.get();
+    const auto insert_fts = insert_fts_stmt.get();
+
+    uint32_t rows = 0;
+    std::string search_key;
+    pkgi_parse_title_list(path, mode, [&](const DbTitleRow& row) {
+        const auto& item = row.item;
+        search_key = pkgi_search_key(row.raw_name, _search_flags);
+        search_key += '\n';
+        search_key += pkgi_search_key(item.name_org.c_str(), _search_flags);
+
+        const auto text = [&](int index, const std::string& str) {
+            sqlite3_bind_text(
+                    insert, index, str.data(), str.size(), SQLITE_STATIC);
+        };
+        sqlite3_reset(insert);
+        sqlite3_bind_int(insert, 1, mode);
+        text(2, item.titleid);
+        text(3, item.content);
+        sqlite3_bind_int(insert, 4, row.region);
+        sqlite3_bind_int(insert, 5, pkgi_get_region(item.titleid));
+        text(6, item.name);
+        text(7, item.name_org);
+        text(8, item.zrif);
+        text(9, item.url);
+        if (item.has_digest)
+            sqlite3_bind_blob(
+                    insert,
+                    10,
+                    item.digest.data(),
+                    item.digest.size(),
+                    SQLITE_STATIC);
+        else
+            sqlite3_bind_null(insert, 10);
+        sqlite3_bind_int64(insert, 11, item.size);
+        text(12, item.date);
+        text(13, item.app_version);
+        text(14, item.fw_version);
+        text(15, search_key);
+        step(insert);
+
+        if (insert_fts)
+        {
+            sqlite3_reset(insert_fts);
+            sqlite3_bind_int64(
+                    insert_fts, 1, sqlite3_last_insert_rowid(db.get()));
+            sqlite3_bind_text(
+                    insert_fts,
+                    2,
+                    search_key.data(),
+                    search_key.size(),
+                    SQLITE_STATIC);
+            step(insert_fts);
+        }
+        if (++rows % INGEST_BATCH_ROWS == 0)
+        {
+            SQLITE_EXEC(db, "END", "can't end transaction");
+            SQLITE_EXEC(db, "BEGIN", "can't begin transaction");
+        }
+    });
+
+    const auto source = prepare_once(
+            db,
+            "INSERT OR REPLACE INTO sources (mode, size, search_flags) "
+            "VALUES (?, ?, ?)");
+    sqlite3_bind_int(source.get(), 1, mode);
+    sqlite3_bind_int64(source.get(), 2, pkgi_get_size(path.c_str()));
+    sqlite3_bind_int64(source.get(), 3, _search_flags);
+    step(source.get());
+
+    LOGF("ingested {} rows", rows);
+}
+
+void CatalogTitleDatabase::update(
+        Mode mode, Http* http, const std::string& update_url)
+{
+    const auto tmppath = _dbPath + "/dbtmp.tsv";
+    const auto filepath =
+            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+
+    const auto downloaded = pkgi_download_title_list(
+            tmppath, filepath, http, update_url, &db_size, &db_total);
+    if (downloaded)
+        pkgi_rename(tmppath, filepath);
+
+    // the main thread keeps reading the view on its own connection, it
+    // sees the new rows once it reloads after apply_update()
+    const auto db = open_connection();
+    if (downloaded || !is_ingested(db, mode))
+        ingest(db, mode);
+}
+
+void CatalogTitleDatabase::apply_update()
+{
+    // the view must be reloaded to see the new rows
+    clear_windows();
+    _mode = -1;
+    _count = 0;
+    _total = 0;
+}
+
+void CatalogTitleDatabase::set_installed(
+        const std::set<std::string>& installed_games)
+{
+    _installed = installed_games;
+    fill_installed();
+}
+
+void CatalogTitleDatabase::fill_installed()
+{
+    SQLITE_EXEC(
+            _sqliteDb,
+            "DELETE FROM temp.installed",
+            "can't clear installed table");
+    auto stmt = prepare("INSERT OR IGNORE INTO temp.installed VALUES (?)");
+    for (const auto& titleid : _installed)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(
+                stmt, 1, titleid.data(), titleid.size(), SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            throw formatEx<std::runtime_error>(
+                    "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get()));
+    }
+}
+
+void CatalogTitleDatabase::reload(
+        Mode mode,
+        uint32_t region_filter,
+        DbSort sort_by,
+        DbSortOrder sort_order,
+        const std::string& partition,
+        const std::string& search,
+        const std::set<std::string>& installed_games)
+{
+    ensure_connection();
+
+    clear_windows();
+    if (!is_ingested(_sqliteDb, mode))
+        ingest(_sqliteDb, mode);
+
+    _mode = mode;
+    _region_filter = region_filter;
+    _partition = partition;
+    _search.clear();
+
+    _where = "mode = :mode";
+    if ((region_filter & DbFilterAllRegions) != DbFilterAllRegions)
+        _where += " AND (region & :regions) != 0";
+    if (!search.empty())
+    {
+        const auto key = pkgi_search_key(search.c_str(), _search_flags);
+        if (_has_fts && utf8_length(key) >= FTS_MIN_CHARS)
+        {
+            _search = fts_phrase(key);
+            _where += " AND rowid IN (SELECT rowid FROM titles_fts WHERE "
+                      "titles_fts MATCH :search)";
+        }
+        else
+        {
+            _search = key;
+            _where += " AND instr(search_key, :search) > 0";
+        }
+    }
+    if (region_filter & DbFilterInstalled)
+    {
+        set_installed(installed_games);
+        _where += " AND titleid IN (SELECT titleid FROM temp.installed)";
+    }
+
+    const char* column;
+    switch (sort_by)
+    {
+    case SortByTitle:
+        column = nullptr;
+        break;
+    case SortByRegion:
+        column = "game_region";
+        break;
+    case SortByName:
+        column = "name COLLATE NOCASE";
+        break;
+    case SortBySize:
+        column = "size";
+        break;
+    case SortByDate:
+        column = "date";
+        break;
+    default:
+        throw std::runtime_error(
+                fmt::format("未知排序顺序 {}", static_cast<int>(sort_by)));
+    }
+    const auto direction = sort_order == SortDescending ? " DESC" : "";
+    _order = column ? fmt::format("{}{}, titleid{}", column, direction, direction)
+                    : fmt::format("titleid{}", direction);
+
+    _count = query_count(
+            fmt::format("SELECT COUNT(*) FROM titles WHERE {}", _where));
+    _total = query_count("SELECT COUNT(*) FROM titles WHERE mode = :mode");
+
+    LOGF("reloaded {}/{} items", _count, _total);
+}
+
+std::unique_ptr<DbItem> CatalogTitleDatabase::read_item(sqlite3_stmt* stmt)
+{
+    std::array<uint8_t, 32> digest{};
+    const auto digest_blob = sqlite3_column_blob(stmt, 6);
+    const bool has_digest = digest_blob &&
+                            sqlite3_column_bytes(stmt, 6) == (int)digest.size();
+    if (has_digest)
+        memcpy(digest.data(), digest_blob, digest.size());
+
+    return std::make_unique<DbItem>(DbItem{
+            PresenceUnknown,
+            _partition,
+            column_text(stmt, 0),
+            column_text(stmt, 1),
+            0,
+            column_text(stmt, 2),
+            column_text(stmt, 3),
+            column_text(stmt, 4),
+            column_text(stmt, 5),
+            has_digest,
+            digest,
+            sqlite3_column_int64(stmt, 7),
+            column_text(stmt, 8),
+            column_text(stmt, 9),
+            column_text(stmt, 10),
+    });
+}
+
+void CatalogTitleDatabase::clear_windows()
+{
+    _windows.clear();
+    _lookup.reset();
+}
+
+void CatalogTitleDatabase::get_update_status(uint32_t* updated, uint32_t* total)
+{
+    *updated = db_size;
+    *total = db_total;
+}
+
+uint32_t CatalogTitleDatabase::count()
+{
+    return _count;
+}
+
+uint32_t CatalogTitleDatabase::total()
+{
+    return _total;
+}
+
+DbItem* CatalogTitleDatabase::get(uint32_t index)
+{
+    if (_mode < 0 || index >= _count)
+        return NULL;
+
+    const auto first = index / WINDOW_SIZE * WINDOW_SIZE;
+    for (auto it = _windows.begin(); it != _windows.end(); ++it)
+    {
+        if (it->first != first)
+            continue;
+        _windows.splice(_windows.begin(), _windows, it);
+        const auto offset = index - first;
+        return offset < it->items.size() ? it->items[offset].get() : NULL;
+    }
+
+    ensure_connection();
+
+    auto stmt = prepare(fmt::format(
+            "SELECT {} FROM titles WHERE {} ORDER BY {} LIMIT :limit OFFSET "
+            ":offset",
+            ITEM_COLUMNS,
+            _where,
+            _order));
+    bind_view(stmt);
+    sqlite3_bind_int(
+            stmt, sqlite3_bind_parameter_index(stmt, ":limit"), WINDOW_SIZE);
+    sqlite3_bind_int(
+            stmt, sqlite3_bind_parameter_index(stmt, ":offset"), first);
+
+    Window window{first, {}};
+    window.items.reserve(WINDOW_SIZE);
+    int err;
+    while ((err = sqlite3_step(stmt)) == SQLITE_ROW)
+        window.items.push_back(read_item(stmt));
+    sqlite3_reset(stmt);
+    if (err != SQLITE_DONE)
+        throw formatEx<std::runtime_error>(
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get()));
+
+    _windows.push_front(std::move(window));
+    if (_windows.size() > MAX_WINDOWS)
+        _windows.pop_back();
+
+    const auto& items = _windows.front().items;
+    return index - first < items.size() ? items[index - first].get() : NULL;
+}
+
+DbItem* CatalogTitleDatabase::get_by_content(const char* content)
+{
+    if (_mode < 0)
+        return NULL;
+
+    // prefer the instance the list is displaying
+    for (const auto& window : _windows)
+        for (const auto& item : window.items)
+            if (item->content == content)
+                return item.get();
+
+    ensure_connection();
+
+    auto stmt = prepare(fmt::format(
+            "SELECT {} FROM titles WHERE {} AND content = :content LIMIT 1",
+            ITEM_COLUMNS,
+            _where));
+    bind_view(stmt);
+    sqlite3_bind_text(
+            stmt,
+            sqlite3_bind_parameter_index(stmt, ":content"),
+            content,
+            -1,
+            SQLITE_STATIC);
+
+    const auto err = sqlite3_step(stmt);
+    if (err == SQLITE_ROW)
+        _lookup = read_item(stmt);
+    sqlite3_reset(stmt);
+    if (err == SQLITE_DONE)
+        return NULL;
+    if (err != SQLITE_ROW)
+        throw formatEx<std::runtime_error>(
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get()));
+    return _lookup.get();
+}
+
+size_t CatalogTitleDatabase::memory_usage() const
+{
+    size_t bytes = 0;
+    for (const auto& window : _windows)
+        for (const auto& item : window.items)
+            bytes += sizeof(DbItem) + item->name.capacity() +
+                     item->name_org.capacity() + item->url.capacity() +
+                     item->zrif.capacity() + item->content.capacity();
+    return bytes;
+}
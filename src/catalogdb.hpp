@@ -0,0 +1,106 @@
+#pragma once
+
+#include "db.hpp"
+#include "sqlite.hpp"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// Keeps the title lists of every mode in one SQLite database, next to the comp
+// pack lists. Filtering, sorting and searching are indexed queries and only
+// the rows around what is displayed are kept in memory.
+class CatalogTitleDatabase : public TitleDatabase
+{
+public:
+    static constexpr auto FILE_NAME = "catalog.db";
+
+    CatalogTitleDatabase(const std::string& dbPath, uint32_t search_flags = 0);
+
+    void reload(
+            Mode mode,
+            uint32_t region_filter,
+            DbSort sort_by,
+            DbSortOrder sort_order,
+            const std::string& partition,
+            const std::string& search,
+            const std::set<std::string>& installed_games) override;
+
+    void update(Mode mode, Http* http, const std::string& update_url) override;
+    void apply_update() override;
+    void get_update_status(uint32_t* updated, uint32_t* total) override;
+
+    uint32_t count() override;
+    uint32_t total() override;
+    DbItem* get(uint32_t index) override;
+    DbItem* get_by_content(const char* content) override;
+
+    // items held in the windows, sqlite's own memory is not included
+    size_t memory_usage() const override;
+
+    bool has_fts() const
+    {
+        return _has_fts;
+    }
+
+private:
+    static constexpr int SCHEMA_VERSION = 1;
+    // rows fetched by a single query of get()
+    static constexpr uint32_t WINDOW_SIZE = 32;
+    // rows ingested by one transaction
+    static constexpr uint32_t INGEST_BATCH_ROWS = 2000;
+    static constexpr size_t MAX_WINDOWS = MIN_VALID_ITEMS / WINDOW_SIZE + 2;
+
+    std::string _dbPath;
+    uint32_t _search_flags;
+    // written by update() on the refresh thread, read by the main one
+    std::atomic<uint32_t> db_total{0};
+    std::atomic<uint32_t> db_size{0};
+
+    SqlitePtr _sqliteDb = nullptr;
+    // keyed by SQL text, must be finalized before _sqliteDb is closed
+    std::unordered_map<std::string, SqliteStmtPtr> _statements;
+    uint32_t _resume_count = 0;
+    bool _has_fts = false;
+
+    // current view, the parameters are bound by name
+    int _mode = -1;
+    uint32_t _region_filter = 0;
+    std::string _search;
+    std::string _partition;
+    std::string _where;
+    std::string _order;
+    // temp.installed is per connection, filled again after a reconnection
+    std::set<std::string> _installed;
+    uint32_t _count = 0;
+    uint32_t _total = 0;
+
+    struct Window
+    {
+        uint32_t first;
+        std::vector<std::unique_ptr<DbItem>> items;
+    };
+    std::list<Window> _windows; // most recently used first
+    std::unique_ptr<DbItem> _lookup;
+
+    // a new connection to the catalog, without the temp tables
+    SqlitePtr open_connection() const;
+    void reopen();
+    void ensure_connection();
+    sqlite3_stmt* prepare(const std::string& sql);
+    void bind_view(sqlite3_stmt* stmt);
+    uint32_t query_count(const std::string& sql);
+    std::unique_ptr<DbItem> read_item(sqlite3_stmt* stmt);
+
+    // also used on the refresh thread with its own connection
+    bool is_ingested(const SqlitePtr& db, Mode mode) const;
+    void ingest(const SqlitePtr& db, Mode mode) const;
+    void set_installed(const std::set<std::string>& installed_games);
+    void fill_installed();
+    void clear_windows();
+};
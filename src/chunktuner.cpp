@@ -0,0 +1,184 @@
+#include "chunktuner.hpp"
+
+#include "connectionpool.hpp"
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+#include "thread.hpp"
+
+#include <fmt/format.h>
+
+#include <cereal/archives/binary.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+namespace
+{
+constexpr uint8_t FILE_VERSION = 1;
+
+struct Settings
+{
+    uint32_t chunk;
+    uint32_t connections;
+};
+
+using SettingsMap = std::map<std::string, Settings>;
+
+// tuners of different threads save to the same file, created on first use
+// so that the kernel mutex doesn't depend on the order of static
+// initialization
+Mutex& file_mutex()
+{
+    static Mutex mutex("chunk_tuner_file_mutex");
+    return mutex;
+}
+
+SettingsMap load_settings(const std::string& path)
+{
+    SettingsMap settings;
+    if (!pkgi_file_exists(path))
+        return settings;
+
+    std::ifstream ss(path, std::ios::binary);
+    cereal::BinaryInputArchive iarchive(ss);
+
+    uint8_t version;
+    iarchive(version);
+    if (version != FILE_VERSION)
+        throw formatEx<std::runtime_error>(
+                "unsupported chunk tuner file version {}", version);
+    uint32_t count;
+    iarchive(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t key_size;
+        iarchive(key_size);
+        std::string key(key_size, '\0');
+        iarchive.loadBinary(&key[0], key_size);
+        Settings& entry = settings[key];
+        iarchive(entry.chunk, entry.connections);
+    }
+    return settings;
+}
+}
+
+std::string pkgi_chunk_tuner_path()
+{
+    return fmt::format("{}/chunktuner.bin", pkgi_get_config_folder());
+}
+
+ChunkTuner::ChunkTuner(
+        const std::string& stage,
+        const std::string& url,
+        const Limits& limits,
+        std::string path)
+    : _key(url.empty() ? stage : stage + ":" + pkgi_http_origin(url))
+    , _limits(limits)
+    , _path(std::move(path))
+    , _chunk(limits.initial_chunk)
+{
+    try
+    {
+        std::lock_guard<Mutex> _(file_mutex());
+        const auto settings = load_settings(_path);
+        const auto it = settings.find(_key);
+        if (it != settings.end())
+        {
+            _chunk = std::clamp(
+                    it->second.chunk, _limits.min_chunk, _limits.max_chunk);
+            _connections = std::clamp<unsigned>(
+                    it->second.connections, 1, _limits.max_connections);
+            LOGF("chunk tuner {}: starting at {} KiB, {} connections",
+                 _key,
+                 _chunk / 1024,
+                 _connections);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to load chunk tuner settings: {}", e.what());
+    }
+}
+
+uint64_t ChunkTuner::now_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+void ChunkTuner::record(uint64_t bytes, uint64_t usec)
+{
+    _window_bytes += bytes;
+    _window_usec += usec;
+    ++_window_records;
+    if (_window_usec < WINDOW_USEC || _window_records < WINDOW_RECORDS)
+        return;
+
+    const double throughput = _window_bytes * 1e6 / _window_usec;
+    _window_bytes = 0;
+    _window_usec = 0;
+    _window_records = 0;
+
+    if (throughput > _best.throughput)
+        _best = Best{_chunk, _connections, throughput};
+
+    if (throughput < _last_throughput * (1 - DECREASE_THRESHOLD))
+    {
+        _chunk = std::max(_limits.min_chunk, _chunk / 2);
+        _connections = std::max(1u, _connections / 2);
+    }
+    else if (_chunk < _limits.max_chunk)
+        _chunk = std::min(_limits.max_chunk, _chunk + _limits.chunk_step);
+    else if (_connections < _limits.max_connections)
+        ++_connections;
+
+    _last_throughput = throughput;
+}
+
+void ChunkTuner::save() const
+{
+    // not a single full window, nothing was learned
+    if (_best.chunk == 0)
+        return;
+
+    try
+    {
+        std::lock_guard<Mutex> _(file_mutex());
+        SettingsMap settings;
+        try
+        {
+            settings = load_settings(_path);
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("dropping chunk tuner settings: {}", e.what());
+        }
+        settings[_key] = Settings{_best.chunk, _best.connections};
+
+        std::ofstream ss(_path, std::ios::binary | std::ios::trunc);
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(FILE_VERSION);
+        oarchive(static_cast<uint32_t>(settings.size()));
+        for (const auto& entry : settings)
+        {
+            oarchive(static_cast<uint32_t>(entry.first.size()));
+            oarchive.saveBinary(entry.first.data(), entry.first.size());
+            oarchive(entry.second.chunk, entry.second.connections);
+        }
+
+        LOGF("chunk tuner {}: best {} KiB, {} connections at {:.0f} KiB/s",
+             _key,
+             _best.chunk / 1024,
+             _best.connections,
+             _best.throughput / 1024);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to save chunk tuner settings: {}", e.what());
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+
+std::string pkgi_chunk_tuner_path();
+
+// Picks the read size of a transfer, and the number of connections where a
+// transfer is split in segments, from the throughput it measures. Every
+// WINDOW_USEC of transfer, the read size grows by a step while throughput
+// holds, then the connections once reads are as big as allowed. When
+// throughput drops by more than DECREASE_THRESHOLD both are halved.
+//
+// The best settings seen are saved per stage and host, the next transfer
+// starts from them.
+class ChunkTuner
+{
+public:
+    struct Limits
+    {
+        uint32_t initial_chunk;
+        uint32_t min_chunk;
+        uint32_t max_chunk;
+        uint32_t chunk_step;
+        unsigned max_connections;
+    };
+
+    static constexpr Limits NETWORK{
+            64 * 1024, 16 * 1024, 1024 * 1024, 64 * 1024, 4};
+    static constexpr Limits LOCAL{
+            256 * 1024, 64 * 1024, 2 * 1024 * 1024, 256 * 1024, 1};
+
+    static constexpr uint64_t WINDOW_USEC = 500 * 1000;
+    static constexpr unsigned WINDOW_RECORDS = 4;
+    static constexpr double DECREASE_THRESHOLD = 0.15;
+
+    // stage names what is transferred, url is empty for local transfers
+    ChunkTuner(
+            const std::string& stage,
+            const std::string& url,
+            const Limits& limits = NETWORK,
+            std::string path = pkgi_chunk_tuner_path());
+
+    uint32_t chunk_size() const
+    {
+        return _chunk;
+    }
+    unsigned connections() const
+    {
+        return _connections;
+    }
+    // bytes per second of the best window so far
+    double best_throughput() const
+    {
+        return _best.throughput;
+    }
+
+    // bytes were transferred in usec with the current settings
+    void record(uint64_t bytes, uint64_t usec);
+
+    template <typename F>
+    void measure(uint64_t bytes, F&& f)
+    {
+        const auto start = now_usec();
+        f();
+        record(bytes, now_usec() - start);
+    }
+
+    // errors are only logged, a transfer never fails because of the tuner
+    void save() const;
+
+    static uint64_t now_usec();
+
+private:
+    struct Best
+    {
+        uint32_t chunk = 0;
+        unsigned connections = 0;
+        double throughput = 0;
+    };
+
+    std::string _key;
+    Limits _limits;
+    std::string _path;
+
+    uint32_t _chunk;
+    unsigned _connections = 1;
+    Best _best;
+
+    uint64_t _window_bytes = 0;
+    uint64_t _window_usec = 0;
+    unsigned _window_records = 0;
+    double _last_throughput = 0;
+};
@@ -1,22 +1,85 @@
+#include "cachinghttp.hpp"
+#include "chunktuner.hpp"
+#include "catalogdb.hpp"
 #include "comppackdb.hpp"
 #include "db.hpp"
 #include "download.hpp"
+#include "downloadscheduler.hpp"
 #include "extractzip.hpp"
+#include "file.hpp"
 #include "filedownload.hpp"
 #include "filehttp.hpp"
+#include "inflatinghttp.hpp"
+#include "lockstats.hpp"
+#include "multisourcehttp.hpp"
 #include "patchinfo.hpp"
+#include "queuejournal.hpp"
+#include "resuminghttp.hpp"
+#include "ringbuffer.hpp"
+#include "sha256.hpp"
+#include "sockethttp.hpp"
+#include "taskpool.hpp"
+#include "thread.hpp"
 #include "zrif.hpp"
 
 #include <boost/algorithm/hex.hpp>
 
 #include <fmt/format.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <memory>
+#include <regex>
+#include <sstream>
+#include <thread>
+
+#include <sys/resource.h>
 
 static constexpr auto USAGE =
         "Usage: %s [extract <filename> <zrif> <sha256>] [refreshlist PSV "
-        "path] [refreshcomppack path] [filedownload path] [extractzip path] "
-        "[patchinfo xmlfile titleid]\n";
+        "path] [refreshcomppack path] [filedownload path [mirror...]] "
+        "[extractzip path] "
+        "[patchinfo xmlfile titleid] [benchdb rows [sqlite]] [benchcomppack rows] "
+        "[benchhttp url count] [benchcache url count [ttl]] "
+        "[checkupdates titlesfile base_url [workers]] "
+        "[benchpatchinfo packages count] "
+        "[benchtuner bandwidth_kbps latency_ms megabytes] "
+        "[benchthreads threads iterations] [benchpool workers tasks] "
+        "[benchring messages] [benchscheduler slots link_kbps stream_kbps "
+        "free_mb [prefetch_ms]] [benchjournal items]\n\n"
+        "titlesfile has one \"TITLEID installed_version\" per line, base_url "
+        "replaces https://gs-sec.ww.np.dl.playstation.net\n"
+        "paths starting with http:// are fetched over the network\n";
+
+std::unique_ptr<Http> make_http(const std::string& url)
+{
+    if (url.compare(0, 7, "http://") == 0)
+        return std::make_unique<SocketHttp>();
+    return std::make_unique<FileHttp>();
+}
+
+template <typename F>
+double time_ms(F&& f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+}
+
+void print_inflate_stats()
+{
+    const auto stats = InflatingHttp::stats();
+    if (stats.received != 0)
+        fmt::print(
+                "received {} compressed bytes for {}\n",
+                stats.received,
+                stats.inflated);
+}
 
 int extract(int argc, char* argv[])
 {
@@ -34,7 +97,7 @@ int extract(int argc, char* argv[])
     if (argv[3][0] && !pkgi_zrif_decode(argv[3], rif, message, sizeof(message)))
         throw std::runtime_error(fmt::format("can't decode zrif: {}", message));
 
-    Download d(std::make_unique<FileHttp>());
+    Download d(std::make_unique<ResumingHttp>(make_http(argv[2])));
 
     d.save_as_iso = false;
     d.update_progress_cb = [](uint64_t, uint64_t) {};
@@ -63,16 +126,18 @@ int refreshlist(int argc, char* argv[])
         return 1;
     }
 
-    const auto http = std::make_unique<FileHttp>();
+    const auto http = std::make_unique<InflatingHttp>(make_http(argv[3]));
 
     const auto mode = arg_to_mode(argv[2]);
 
-    const auto db = std::make_unique<TitleDatabase>(".");
+    const auto db = std::make_unique<TsvTitleDatabase>(".");
     db->update(mode, http.get(), argv[3]);
+    db->apply_update();
     db->reload(mode, DbFilterAllRegions, SortBySize, SortDescending, "", "the", {});
     for (unsigned int i = 0; i < db->count(); ++i)
         fmt::print("{}: {}\n", db->get(i)->name, db->get(i)->size);
     fmt::print("{}/{}\n", db->count(), db->total());
+    print_inflate_stats();
 
     return 0;
 }
@@ -85,27 +150,40 @@ int refreshcomppack(int argc, char* argv[])
         return 1;
     }
 
-    const auto http = std::make_unique<FileHttp>();
+    const auto http = std::make_unique<InflatingHttp>(make_http(argv[2]));
 
     const auto db = std::make_unique<CompPackDatabase>("comppack.db");
     db->update(http.get(), argv[2]);
     const auto item = db->get("PCSA00134").value();
     fmt::print("got {} {}\n", item.path, item.app_version);
+    print_inflate_stats();
 
     return 0;
 }
 
 int filedownload(int argc, char* argv[])
 {
-    if (argc != 3)
+    if (argc < 3)
     {
         printf(USAGE, argv[0]);
         return 1;
     }
 
-    FileDownload d(std::make_unique<FileHttp>());
+    const std::string url = argv[2];
+    auto multi = std::make_unique<MultiSourceHttp>(
+            [url] { return make_http(url); },
+            std::vector<std::string>(argv + 3, argv + argc),
+            &SocketHttp::spare_connections);
+    const auto sources = multi.get();
+    FileDownload d(std::make_unique<ResumingHttp>(std::move(multi)));
+    d.update_progress_cb = [](uint64_t, uint64_t) {};
+    d.is_canceled = [] { return false; };
+
+    const auto elapsed = time_ms([&] { d.download("tmp", "id", false, url); });
 
-    d.download("tmp", "id", argv[2]);
+    fmt::print("downloaded in {:.1f} ms\n", elapsed);
+    for (const auto& source : sources->source_stats())
+        fmt::print("{}: {} bytes\n", source.first, source.second);
 
     return 0;
 }
@@ -143,6 +221,1267 @@ int patchinfo(int argc, char* argv[])
     return 0;
 }
 
+long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+int benchdb(int argc, char* argv[])
+{
+    if (argc != 3 && !(argc == 4 && std::string(argv[3]) == "sqlite"))
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto rows = std::stoul(argv[2]);
+
+    {
+        static const char* const names[] = {
+                "The Legend of Heroes",
+                "ペルソナ４ ザ・ゴールデン",
+                "討鬼伝 極",
+                "Ｄｒａｇｏｎ Ｑｕｅｓｔ Builders",
+                "Pokémon Café",
+        };
+        static const char* const regions[] = {"US", "EU", "JP", "ASIA"};
+        auto f = fopen("titles_psvgames.tsv", "w");
+        fputs("Title ID\tRegion\tName\tPKG direct link\tzRIF\tContent "
+              "ID\tLast Modification Date\tOriginal Name\tFile Size\t"
+              "SHA256\tRequired FW\r\n",
+              f);
+        for (unsigned long i = 0; i < rows; ++i)
+            fmt::print(
+                    f,
+                    "PCSE{0:05}\t{1}\t{2} {0}\thttp://example.com/"
+                    "{0}.pkg\tKO5ifR1dQ+eHBlOOSTSNfDlKF30Be0d0AvaJ+Pz\t"
+                    "EP0000-PCSE{0:05}_00-0000000000000000\t"
+                    "2018-{3:02}-01 10:00:00\t{2}\t{4}\t"
+                    "{5:064x}\t3.60\r\n",
+                    i % 100000,
+                    regions[i % 4],
+                    names[i % 5],
+                    i % 12 + 1,
+                    i * 7919 % 4000000000,
+                    i);
+        fclose(f);
+    }
+
+    fmt::print("generated {} rows, peak RSS {} KiB\n", rows, peak_rss_kb());
+
+    std::unique_ptr<TitleDatabase> db;
+    if (argc == 4)
+    {
+        std::remove(CatalogTitleDatabase::FILE_NAME);
+        auto catalog = std::make_unique<CatalogTitleDatabase>(".");
+        fmt::print("full text search: {}\n", catalog->has_fts());
+        db = std::move(catalog);
+    }
+    else
+        db = std::make_unique<TsvTitleDatabase>(".");
+
+    const auto ingest = time_ms([&] {
+        db->reload(
+                ModeGames, DbFilterAll, SortByName, SortAscending, "", "", {});
+    });
+    fmt::print("ingest + sort by name: {:.1f} ms\n", ingest);
+
+    const auto resort = time_ms([&] {
+        db->reload(
+                ModeGames, DbFilterAll, SortBySize, SortDescending, "", "", {});
+    });
+    fmt::print("resort by size: {:.1f} ms\n", resort);
+
+    const auto search = time_ms([&] {
+        db->reload(
+                ModeGames,
+                DbFilterRegionJPN,
+                SortByDate,
+                SortAscending,
+                "",
+                "heroes",
+                {});
+    });
+    fmt::print("filter + search: {:.1f} ms, {} items\n", search, db->count());
+
+    const auto search_cjk = time_ms([&] {
+        db->reload(
+                ModeGames,
+                DbFilterAll,
+                SortByName,
+                SortAscending,
+                "",
+                "ﾍﾟﾙｿﾅ4",
+                {});
+    });
+    fmt::print(
+            "half-width search: {:.1f} ms, {} items\n",
+            search_cjk,
+            db->count());
+
+    db->reload(ModeGames, DbFilterAll, SortByName, SortAscending, "", "", {});
+    const auto scrolled = std::min<uint32_t>(db->count(), 10000);
+    const auto scroll = time_ms([&] {
+        for (uint32_t i = 0; i < scrolled; ++i)
+            db->get(i);
+    });
+    const auto jump = time_ms([&] {
+        if (db->count())
+            db->get(db->count() - 1);
+    });
+    fmt::print(
+            "scroll {} items: {:.1f} ms, jump to last: {:.1f} ms\n"
+            "{}/{} items, store+cache {} KiB, peak RSS {} KiB\n",
+            scrolled,
+            scroll,
+            jump,
+            db->count(),
+            db->total(),
+            db->memory_usage() / 1024,
+            peak_rss_kb());
+
+    return 0;
+}
+
+// the comp pack ingest as it was done before streaming: whole list in memory,
+// one regex search and one INSERT per line
+void legacy_comppack_ingest(const char* list, const char* dbpath)
+{
+    std::ifstream f(list, std::ios::binary);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    const std::string data = ss.str();
+
+    std::remove(dbpath);
+    sqlite3* db;
+    sqlite3_open(dbpath, &db);
+    sqlite3_exec(
+            db,
+            "CREATE TABLE entries (titleid TEXT NOT NULL, app_version TEXT "
+            "NOT NULL, path TEXT NOT NULL, PRIMARY KEY (titleid, "
+            "app_version)); BEGIN; DELETE FROM entries",
+            nullptr,
+            nullptr,
+            nullptr);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(
+            db,
+            "INSERT INTO entries (titleid, path, app_version) VALUES (?, ?, ?)",
+            -1,
+            &stmt,
+            nullptr);
+
+    const auto regex = std::regex(
+            R"(([A-Z]{4}\d{5})-(\d{2}_\d{3})-(\d{2}_\d{2})-(\d{2}_\d{2}).ppk)");
+    std::istringstream lines(data);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        const auto path = line.substr(0, line.find('='));
+        std::smatch matches;
+        if (!std::regex_search(path, matches, regex))
+            throw std::runtime_error("bad line: " + line);
+        const auto titleid = matches.str(1);
+        const auto app_version = matches.str(3);
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
+        sqlite3_bind_text(stmt, 2, path.data(), path.size(), nullptr);
+        sqlite3_bind_text(
+                stmt, 3, app_version.data(), app_version.size(), nullptr);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            throw std::runtime_error(sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "END", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+}
+
+int benchcomppack(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto rows = std::stoul(argv[2]);
+
+    {
+        auto f = fopen("comppack_bench.txt", "w");
+        for (unsigned long i = 0; i < rows; ++i)
+            fmt::print(
+                    f,
+                    "{0}/PCSE{1:05}-00_000-{2:02}_{3:02}-01_05.ppk="
+                    "PCSE{1:05}\n",
+                    i % 2 ? "updates" : "base",
+                    i % 100000,
+                    i / 100000 % 100,
+                    i % 97);
+        fclose(f);
+    }
+
+    const auto legacy = time_ms([&] {
+        legacy_comppack_ingest("comppack_bench.txt", "comppack_legacy.db");
+    });
+    fmt::print(
+            "regex + single-row inserts: {:.1f} ms, peak RSS {} KiB\n",
+            legacy,
+            peak_rss_kb());
+
+    std::remove("comppack_bench.db");
+    const auto db = std::make_unique<CompPackDatabase>("comppack_bench.db");
+    const auto http = std::make_unique<FileHttp>();
+    const auto streaming = time_ms(
+            [&] { db->update(http.get(), "comppack_bench.txt"); });
+    fmt::print(
+            "streaming scanner + batched inserts: {:.1f} ms ({:.1f}x), peak "
+            "RSS {} KiB\n",
+            streaming,
+            legacy / streaming,
+            peak_rss_kb());
+
+    const auto mirror = time_ms([&] { db->get("PCSE00000"); });
+    fmt::print("first lookup (loads mirror): {:.1f} ms\n", mirror);
+
+    size_t found = 0;
+    const auto lookups = time_ms([&] {
+        for (unsigned long i = 0; i < rows; ++i)
+            found += db->get(fmt::format("PCSE{:05}", i % 100000)).has_value();
+    });
+    fmt::print("{} lookups: {:.1f} ms, {} found\n", rows, lookups, found);
+
+    return 0;
+}
+
+int benchhttp(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto count = std::stoul(argv[3]);
+    std::vector<uint8_t> buffer(64 * 1024);
+    uint64_t total = 0;
+
+    const auto elapsed = time_ms([&] {
+        for (unsigned long i = 0; i < count; ++i)
+        {
+            SocketHttp http;
+            http.start(argv[2], 0);
+            http.get_length();
+            while (const auto read = http.read(buffer.data(), buffer.size()))
+                total += read;
+            http.close();
+        }
+    });
+    fmt::print(
+            "{} requests, {} bytes in {:.1f} ms ({:.1f} MiB/s), {} on reused "
+            "connections\n",
+            count,
+            total,
+            elapsed,
+            total / 1024.0 / 1024.0 / (elapsed / 1000.0),
+            SocketHttp::reused_connections());
+
+    return 0;
+}
+
+int benchcache(int argc, char* argv[])
+{
+    if (argc != 4 && argc != 5)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto count = std::stoul(argv[3]);
+    const uint32_t ttl =
+            argc == 5 ? std::stoul(argv[4]) : CachingHttp::DEFAULT_TTL;
+    std::vector<uint8_t> buffer(4 * 1024);
+    uint64_t total = 0;
+
+    const auto elapsed = time_ms([&] {
+        for (unsigned long i = 0; i < count; ++i)
+        {
+            CachingHttp http(make_http(argv[2]), "httpcache.db", ttl);
+            http.start(argv[2], 0);
+            if (http.get_status() == 404)
+                continue;
+            while (const auto read = http.read(buffer.data(), buffer.size()))
+                total += read;
+        }
+    });
+    const auto stats = CachingHttp::stats();
+    fmt::print(
+            "{} requests, {} bytes in {:.1f} ms: {} hits, {} revalidated, {} "
+            "misses\n",
+            count,
+            total,
+            elapsed,
+            stats.hits,
+            stats.revalidated,
+            stats.misses);
+
+    return 0;
+}
+
+int benchpatchinfo(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const auto packages = std::stoul(argv[2]);
+    const auto count = std::stoul(argv[3]);
+
+    // a -ver.xml with as many packages as asked, the last one is the answer
+    std::string xml =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<titlepatch titleid=\"PCSE00000\">\n<tag name=\"PCSE00000_00\" "
+            "popup=\"true\" signoff=\"true\">\n";
+    for (unsigned long i = 1; i <= packages; ++i)
+        xml += fmt::format(
+                "<package version=\"{:02}.{:02}\" type=\"cumulative\" "
+                "size=\"{}\" digest=\"{:040x}\" "
+                "manifest_url=\"http://gs.ww.np.dl.playstation.net/ppkg/np/"
+                "PCSE00000/PCSE00000_T{}_{:040x}/manifest.xml\" "
+                "url=\"http://gs.ww.np.dl.playstation.net/ppkg/np/PCSE00000/"
+                "PCSE00000_T{}/{:016x}/UP0000-PCSE00000_00-0000000000000000-A"
+                "{:02}{:02}-V0100-{:040x}-PE.pkg\" "
+                "psp2_system_ver=\"{}\" content_id=\"UP0000-PCSE00000_00-"
+                "0000000000000000\">\n"
+                "<paramsfo><title>Game</title></paramsfo>\n"
+                "{}</package>\n",
+                i / 100,
+                i % 100,
+                i * 1000000,
+                i,
+                i,
+                i,
+                i,
+                i,
+                i / 100,
+                i % 100,
+                i,
+                0x03600000,
+                i == packages ? fmt::format(
+                                        "<hybrid_package size=\"{}\" "
+                                        "url=\"http://gs.ww.np.dl.playstation."
+                                        "net/ppkg/np/PCSE00000/hybrid-{}.pkg\"/>"
+                                        "\n",
+                                        i * 1000,
+                                        i)
+                              : std::string());
+    xml += "</tag>\n</titlepatch>\n";
+
+    std::optional<PatchInfo> patch;
+    const auto elapsed = time_ms([&] {
+        for (unsigned long i = 0; i < count; ++i)
+        {
+            PatchInfoScanner scanner;
+            // fed as it would come from the network
+            for (size_t pos = 0; pos < xml.size(); pos += 4096)
+                scanner.feed(
+                        reinterpret_cast<const uint8_t*>(xml.data()) + pos,
+                        std::min<size_t>(4096, xml.size() - pos));
+            patch = scanner.result();
+        }
+    });
+
+    if (!patch)
+    {
+        puts("No patch found");
+        return 1;
+    }
+    fmt::print(
+            "{} documents of {} bytes in {:.1f} ms, {:.1f} MiB/s\n"
+            "Version: {}\nFirmware: {}\nUrl: {}\n",
+            count,
+            xml.size(),
+            elapsed,
+            xml.size() * count / 1024.0 / 1024.0 / (elapsed / 1000.0),
+            patch->version,
+            patch->fw_version,
+            patch->url);
+
+    return 0;
+}
+
+int benchtuner(int argc, char* argv[])
+{
+    if (argc != 5)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const double bandwidth = std::stod(argv[2]) * 1024;
+    const double latency_usec = std::stod(argv[3]) * 1000;
+    const uint64_t size = std::stoull(argv[4]) * 1024 * 1024;
+
+    // Simulated link: every read costs a round trip, connections share the
+    // bandwidth, and a burst bigger than what the link can queue (four
+    // bandwidth-delay products) loses packets and pays two more round trips.
+    const double queue =
+            std::max(64.0 * 1024, 4 * bandwidth * latency_usec / 1e6);
+    const auto transfer_usec = [&](uint64_t bytes) {
+        auto usec = latency_usec + bytes / bandwidth * 1e6;
+        if (bytes > queue)
+            usec += 2 * latency_usec;
+        return usec;
+    };
+
+    // returns the simulated transfer time in ms
+    const auto simulate = [&](auto&& next_read) {
+        double elapsed_usec = 0;
+        for (uint64_t done = 0; done < size;)
+        {
+            const auto bytes = std::min<uint64_t>(next_read(), size - done);
+            const auto usec = transfer_usec(bytes);
+            elapsed_usec += usec;
+            done += bytes;
+            next_read.record(bytes, usec);
+        }
+        return elapsed_usec / 1000;
+    };
+
+    struct Fixed
+    {
+        uint64_t operator()()
+        {
+            return 64 * 1024;
+        }
+        void record(uint64_t, double)
+        {
+        }
+    };
+    struct Tuned
+    {
+        ChunkTuner tuner{
+                "bench",
+                "http://simulated",
+                ChunkTuner::NETWORK,
+                "chunktuner-bench.bin"};
+        uint64_t operator()()
+        {
+            return uint64_t(tuner.chunk_size()) * tuner.connections();
+        }
+        void record(uint64_t bytes, double usec)
+        {
+            tuner.record(bytes, usec);
+        }
+    };
+
+    const auto run = [&](const char* name, auto& reads) {
+        const auto ms = simulate(reads);
+        const auto chunk = reads();
+        fmt::print(
+                "{:<12} {:8.0f} ms {:8.0f} KiB/s, ends at {} KiB per round "
+                "trip\n",
+                name,
+                ms,
+                size / 1024.0 / (ms / 1000),
+                chunk / 1024);
+    };
+
+    std::remove("chunktuner-bench.bin");
+    fmt::print(
+            "{} MiB over {:.0f} KiB/s with {:.0f} ms round trips, {:.0f} KiB "
+            "queue\n",
+            size / 1024 / 1024,
+            bandwidth / 1024,
+            latency_usec / 1000,
+            queue / 1024);
+
+    Fixed fixed;
+    run("fixed 64KiB", fixed);
+    {
+        Tuned first;
+        run("tuned", first);
+        first.tuner.save();
+    }
+    Tuned second;
+    run("tuned again", second);
+
+    return 0;
+}
+
+int benchthreads(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const size_t threads = std::stoul(argv[2]);
+    const uint64_t iterations = std::stoull(argv[3]);
+
+    {
+        Mutex mutex("bench_mutex");
+        uint64_t counter = 0;
+        const auto ms = time_ms([&] {
+            std::vector<std::unique_ptr<Thread>> workers;
+            for (size_t i = 0; i < threads; ++i)
+                workers.push_back(std::make_unique<Thread>(
+                        fmt::format("bench_lock_{}", i), [&] {
+                            for (uint64_t n = 0; n < iterations; ++n)
+                            {
+                                std::lock_guard<Mutex> _(mutex);
+                                ++counter;
+                            }
+                        }));
+            for (const auto& worker : workers)
+                worker->join();
+        });
+        fmt::print(
+                "mutex, {} threads: {:.0f} ns per lock, counter {}\n",
+                threads,
+                ms * 1e6 / (threads * iterations),
+                counter);
+    }
+
+    {
+        // two threads hand a token back and forth
+        Cond cond("bench_ping_cond");
+        uint64_t turn = 0;
+        const auto ms = time_ms([&] {
+            const auto player = [&](uint64_t parity) {
+                std::lock_guard<Mutex> _(cond.get_mutex());
+                for (uint64_t n = 0; n < iterations; ++n)
+                {
+                    while (turn % 2 != parity)
+                        cond.wait();
+                    ++turn;
+                    cond.notify_one();
+                }
+            };
+            Thread ping("bench_ping", [&] { player(0); });
+            Thread pong("bench_pong", [&] { player(1); });
+            ping.join();
+            pong.join();
+        });
+        fmt::print(
+                "cond ping-pong: {:.1f} us per hand-off\n",
+                ms * 1e3 / (2 * iterations));
+    }
+
+    {
+        // every round wakes all the threads at once
+        Cond cond("bench_broadcast_cond");
+        uint64_t round = 0;
+        size_t waiting = 0;
+        const auto ms = time_ms([&] {
+            std::vector<std::unique_ptr<Thread>> workers;
+            for (size_t i = 0; i < threads; ++i)
+                workers.push_back(std::make_unique<Thread>(
+                        fmt::format("bench_waiter_{}", i), [&] {
+                            std::lock_guard<Mutex> _(cond.get_mutex());
+                            for (uint64_t seen = 0; seen < iterations;)
+                            {
+                                ++waiting;
+                                cond.notify_all();
+                                while (round == seen)
+                                    cond.wait();
+                                seen = round;
+                            }
+                        }));
+            {
+                std::lock_guard<Mutex> _(cond.get_mutex());
+                while (round < iterations)
+                {
+                    while (waiting < threads)
+                        cond.wait();
+                    waiting = 0;
+                    ++round;
+                    cond.notify_all();
+                }
+            }
+            for (const auto& worker : workers)
+                worker->join();
+        });
+        fmt::print(
+                "cond broadcast to {} threads: {:.1f} us per round\n",
+                threads,
+                ms * 1e3 / iterations);
+    }
+
+    {
+        Cond cond("bench_timeout_cond");
+        std::lock_guard<Mutex> _(cond.get_mutex());
+        bool notified = true;
+        const auto ms = time_ms([&] { notified = cond.wait_for(20); });
+        fmt::print(
+                "20 ms timed wait: {:.1f} ms, {}\n",
+                ms,
+                notified ? "notified" : "timed out");
+    }
+
+    return 0;
+}
+
+int benchpool(int argc, char* argv[])
+{
+    if (argc != 4)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const size_t workers = std::stoul(argv[2]);
+    const size_t tasks = std::stoul(argv[3]);
+
+    // hashing stands for the decompression of a block, every fourth task is
+    // eight times longer so that some queues drain before the others
+    std::vector<uint8_t> block(64 * 1024, 0x5a);
+    std::vector<std::array<uint8_t, SHA256_DIGEST_SIZE>> digests(tasks);
+    const auto hash = [&](size_t i) {
+        sha256_ctx sha;
+        sha256_init(&sha);
+        for (int n = 0; n < (i % 4 == 0 ? 8 : 1); ++n)
+            sha256_update(&sha, block.data(), block.size());
+        sha256_finish(&sha, digests[i].data());
+    };
+
+    const auto serial = time_ms([&] {
+        for (size_t i = 0; i < tasks; ++i)
+            hash(i);
+    });
+    fmt::print("serial: {:.1f} ms\n", serial);
+    const auto expected = digests;
+    std::fill(digests.begin(), digests.end(), decltype(digests)::value_type{});
+
+    TaskPool pool(workers);
+    const auto pooled = time_ms([&] {
+        std::vector<TaskHandle> handles;
+        for (size_t i = 0; i < tasks; ++i)
+            handles.push_back(pool.submit([&, i] { hash(i); }));
+        for (auto& handle : handles)
+            handle.join();
+    });
+    fmt::print(
+            "{} workers: {:.1f} ms ({:.1f}x), {} steals, {}\n",
+            workers,
+            pooled,
+            serial / pooled,
+            pool.steals(),
+            digests == expected ? "same digests" : "DIGESTS DIFFER");
+
+    // tasks that wait for the tasks they submit must not deadlock the pool
+    const auto nested = time_ms([&] {
+        std::vector<TaskHandle> handles;
+        for (size_t i = 0; i < tasks; i += 8)
+            handles.push_back(pool.submit([&, i] {
+                std::vector<TaskHandle> children;
+                for (size_t j = i; j < std::min(tasks, i + 8); ++j)
+                    children.push_back(pool.submit([&, j] { hash(j); }));
+                for (auto& child : children)
+                    child.join();
+            }));
+        for (auto& handle : handles)
+            handle.join();
+    });
+    fmt::print("nested joins: {:.1f} ms\n", nested);
+
+    // a high priority task goes before the queued low priority ones
+    double urgent = 0;
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<TaskHandle> handles;
+        for (size_t i = 0; i < tasks; ++i)
+            handles.push_back(
+                    pool.submit([&, i] { hash(i); }, TaskPool::PriorityLow));
+        pool.submit(
+                    [&] {
+                        urgent = std::chrono::duration<double, std::milli>(
+                                         std::chrono::steady_clock::now() -
+                                         start)
+                                         .count();
+                    },
+                    TaskPool::PriorityHigh)
+                .join();
+        for (auto& handle : handles)
+            handle.join();
+    }
+    fmt::print(
+            "high priority task behind {} low ones started after {:.1f} "
+            "ms\n",
+            tasks,
+            urgent);
+
+    try
+    {
+        pool.submit([] { throw std::runtime_error("task failed"); }).join();
+    }
+    catch (const std::exception& e)
+    {
+        fmt::print("exception from task: {}\n", e.what());
+    }
+
+    return 0;
+}
+
+// the queue the rings are measured against
+template <typename T>
+class CondQueue
+{
+public:
+    CondQueue(size_t capacity) : _capacity(capacity), _cond("bench_queue_cond")
+    {
+    }
+
+    bool push(T value)
+    {
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        while (!_closed && _queue.size() == _capacity)
+            _cond.wait();
+        if (_closed)
+            return false;
+        _queue.push_back(std::move(value));
+        _cond.notify_all();
+        return true;
+    }
+
+    bool pop(T& value)
+    {
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        while (!_closed && _queue.empty())
+            _cond.wait();
+        if (_queue.empty())
+            return false;
+        value = std::move(_queue.front());
+        _queue.pop_front();
+        _cond.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        _closed = true;
+        _cond.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    Cond _cond;
+    std::deque<T> _queue;
+    bool _closed = false;
+};
+
+// Runs a queue through the DownloadScheduler in simulated time. The link
+// gives every connection an equal share, and a server never sends faster
+// than stream_kbps on one connection. With prefetch_ms, the head of the next
+// queued item is fetched for that long once a download is in its tail, like
+// the Downloader does, and the item can't start meanwhile.
+int benchscheduler(int argc, char* argv[])
+{
+    if (argc != 6 && argc != 7)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const size_t slots = std::stoul(argv[2]);
+    const uint64_t link = std::stoull(argv[3]) * 1024;
+    const uint64_t stream = std::stoull(argv[4]) * 1024;
+    const uint64_t free_space = std::stoull(argv[5]) * 1024 * 1024;
+    const uint32_t prefetch_ms = argc == 7 ? std::stoul(argv[6]) : 0;
+
+    struct Item
+    {
+        const char* name;
+        uint64_t size;
+        std::shared_ptr<DownloadProgress> progress;
+        std::string partition = "ux0:";
+        uint32_t started = 0;
+        uint32_t finished = 0;
+        bool rejected = false;
+        // the head is being fetched until prefetch_end
+        bool prefetching = false;
+        bool prefetched = false;
+        uint32_t prefetch_end = 0;
+    };
+    constexpr uint64_t MB = 1024 * 1024;
+    std::vector<Item> items{
+            {"game 1.5 GB", 1536 * MB, nullptr},
+            {"dlc 12 MB", 12 * MB, nullptr},
+            {"dlc 3 MB", 3 * MB, nullptr},
+            {"game 600 MB", 600 * MB, nullptr},
+            {"update 80 MB", 80 * MB, nullptr},
+            {"dlc 20 MB", 20 * MB, nullptr},
+    };
+
+    // everything downloaded goes to one partition
+    uint64_t written = 0;
+    DownloadScheduler scheduler([&](const std::string&) {
+        return free_space > written ? free_space - written : 0;
+    });
+    scheduler.set_slots(slots);
+
+    constexpr uint32_t STEP = 100;
+    constexpr uint64_t PREFETCH_TAIL = 64 * MB;
+    // items are copied back once done
+    std::deque<Item> queue(items.begin(), items.end());
+    std::vector<Item> running;
+    const auto done = [&](const Item& item) {
+        for (auto& result : items)
+            if (result.name == item.name)
+                result = item;
+    };
+
+    uint32_t now = 0;
+    while (!queue.empty() || !running.empty())
+    {
+        scheduler.sample(now);
+
+        for (auto& item : queue)
+            if (item.prefetching && now >= item.prefetch_end)
+            {
+                item.prefetching = false;
+                item.prefetched = true;
+            }
+        const bool in_tail = std::any_of(
+                running.begin(), running.end(), [&](const auto& item) {
+                    const uint64_t left =
+                            item.progress->size - item.progress->offset;
+                    return left <= std::min(item.size / 10, PREFETCH_TAIL);
+                });
+        const bool has_prefetch =
+                std::any_of(queue.begin(), queue.end(), [](const auto& item) {
+                    return item.prefetching || item.prefetched;
+                });
+        if (prefetch_ms != 0 && in_tail && !has_prefetch && !queue.empty())
+        {
+            queue.front().prefetching = true;
+            queue.front().prefetch_end = now + prefetch_ms;
+        }
+
+        while (true)
+        {
+            const auto [it, lane] = scheduler.pick(
+                    queue,
+                    now,
+                    [](const Item& item) {
+                        return DownloadScheduler::is_small(item.size);
+                    },
+                    [](const Item& item) { return item.prefetching; });
+            if (it == queue.end())
+                break;
+            auto item = std::move(*it);
+            queue.erase(it);
+            if (lane == DownloadScheduler::LaneNoSpace)
+            {
+                item.rejected = true;
+                done(item);
+                continue;
+            }
+            item.progress = std::make_shared<DownloadProgress>();
+            item.progress->size = item.size;
+            item.started = now;
+            scheduler.started(lane, item.partition, item.size, item.progress);
+            running.push_back(std::move(item));
+        }
+
+        // the items left were all turned down
+        if (running.empty() && queue.empty())
+            break;
+        const uint64_t share =
+                running.empty() ? 0 : std::min(stream, link / running.size());
+        for (auto it = running.begin(); it != running.end();)
+        {
+            auto& progress = *it->progress;
+            const uint64_t step =
+                    std::min(share * STEP / 1000, progress.size - progress.offset);
+            progress.offset += step;
+            written += step;
+            if (progress.offset == progress.size)
+            {
+                it->finished = now + STEP;
+                scheduler.finished(&progress);
+                done(*it);
+                it = running.erase(it);
+            }
+            else
+                ++it;
+        }
+        now += STEP;
+    }
+
+    uint64_t total = 0;
+    for (const auto& item : items)
+        if (!item.rejected)
+            total += item.size;
+    const double sequential = total / static_cast<double>(std::min(stream, link));
+
+    for (const auto& item : items)
+        if (item.rejected)
+            fmt::print("{:<14} no space left\n", item.name);
+        else
+            fmt::print(
+                    "{:<14} started {:7.1f} s  done {:7.1f} s{}\n",
+                    item.name,
+                    item.started / 1000.0,
+                    item.finished / 1000.0,
+                    item.prefetched ? "  prefetched" : "");
+    fmt::print(
+            "all done in {:.1f} s, one at a time {:.1f} s\n",
+            now / 1000.0,
+            sequential);
+    for (size_t n = 1; n <= DownloadScheduler::MAX_SLOTS + 1; ++n)
+        if (const auto throughput = scheduler.throughput(n, now))
+            fmt::print(
+                    "measured with {} downloads: {} KB/s\n",
+                    n,
+                    throughput / 1024);
+    return 0;
+}
+
+int benchring(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const uint64_t messages = std::stoull(argv[2]);
+    constexpr size_t CAPACITY = 256;
+
+    // producers push 1..messages between them, the consumer sums them up
+    const auto throughput = [&](const char* name, auto& queue, size_t producers) {
+        uint64_t sum = 0;
+        const auto ms = time_ms([&] {
+            Thread consumer("bench_consumer", [&] {
+                uint64_t value;
+                while (queue.pop(value))
+                    sum += value;
+            });
+            std::vector<std::unique_ptr<Thread>> threads;
+            for (size_t p = 0; p < producers; ++p)
+                threads.push_back(std::make_unique<Thread>(
+                        fmt::format("bench_producer_{}", p), [&, p] {
+                            for (uint64_t n = p + 1; n <= messages;
+                                 n += producers)
+                                queue.push(n);
+                        }));
+            for (const auto& thread : threads)
+                thread->join();
+            queue.close();
+            consumer.join();
+        });
+        fmt::print(
+                "{:<28} {:8.1f} ms {:6.1f} M msg/s {}\n",
+                name,
+                ms,
+                messages / ms / 1e3,
+                sum == messages * (messages + 1) / 2 ? "" : "WRONG SUM");
+    };
+
+    // one message goes back and forth between two threads
+    const auto latency = [&](const char* name, auto& there, auto& back) {
+        const uint64_t round_trips = std::max<uint64_t>(1, messages / 100);
+        const auto ms = time_ms([&] {
+            Thread echo("bench_echo", [&] {
+                uint64_t value;
+                while (there.pop(value))
+                    back.push(value);
+            });
+            for (uint64_t n = 0; n < round_trips; ++n)
+            {
+                uint64_t value = n;
+                there.push(value);
+                back.pop(value);
+            }
+            there.close();
+            echo.join();
+        });
+        fmt::print(
+                "{:<28} {:8.2f} us per round trip\n",
+                name,
+                ms * 1e3 / round_trips);
+    };
+
+    fmt::print("{} messages, capacity {}\n", messages, CAPACITY);
+    {
+        SpscRing<uint64_t> ring(CAPACITY);
+        throughput("spsc ring, blocking", ring, 1);
+    }
+    {
+        SpscRing<uint64_t, SpinWait> ring(CAPACITY);
+        throughput("spsc ring, spinning", ring, 1);
+    }
+    {
+        CondQueue<uint64_t> queue(CAPACITY);
+        throughput("mutex+cond queue", queue, 1);
+    }
+    {
+        MpscRing<uint64_t> ring(CAPACITY);
+        throughput("mpsc ring, 3 producers", ring, 3);
+    }
+    {
+        CondQueue<uint64_t> queue(CAPACITY);
+        throughput("mutex+cond, 3 producers", queue, 3);
+    }
+    {
+        SpscRing<uint64_t> there(CAPACITY), back(CAPACITY);
+        latency("spsc ring, blocking", there, back);
+    }
+    {
+        SpscRing<uint64_t, SpinWait> there(CAPACITY), back(CAPACITY);
+        latency("spsc ring, spinning", there, back);
+    }
+    {
+        CondQueue<uint64_t> there(CAPACITY), back(CAPACITY);
+        latency("mutex+cond queue", there, back);
+    }
+
+    // 64 KiB chunks, like a download handing its reads to a writer
+    constexpr size_t CHUNK = 64 * 1024;
+    const uint64_t chunks = std::max<uint64_t>(1, messages / 100);
+    {
+        BufferPipe<> pipe(4, CHUNK);
+        uint64_t received = 0;
+        const auto ms = time_ms([&] {
+            Thread consumer("bench_writer", [&] {
+                while (const auto buffer = pipe.receive())
+                {
+                    received += buffer->data[buffer->size - 1];
+                    pipe.release(buffer);
+                }
+            });
+            for (uint64_t n = 0; n < chunks; ++n)
+            {
+                const auto buffer = pipe.acquire();
+                std::memset(buffer->data.data(), 1, CHUNK);
+                buffer->size = CHUNK;
+                pipe.send(buffer);
+            }
+            pipe.finish();
+            consumer.join();
+        });
+        fmt::print(
+                "{:<28} {:8.1f} ms {:6.0f} MiB/s {}\n",
+                "buffer pipe, 64 KiB",
+                ms,
+                chunks * CHUNK / 1024.0 / 1024 / (ms / 1000),
+                received == chunks ? "" : "LOST CHUNKS");
+    }
+    {
+        CondQueue<std::vector<uint8_t>> queue(4);
+        uint64_t received = 0;
+        const auto ms = time_ms([&] {
+            Thread consumer("bench_writer", [&] {
+                std::vector<uint8_t> chunk;
+                while (queue.pop(chunk))
+                    received += chunk.back();
+            });
+            for (uint64_t n = 0; n < chunks; ++n)
+            {
+                std::vector<uint8_t> chunk(CHUNK);
+                std::memset(chunk.data(), 1, CHUNK);
+                queue.push(std::move(chunk));
+            }
+            queue.close();
+            consumer.join();
+        });
+        fmt::print(
+                "{:<28} {:8.1f} ms {:6.0f} MiB/s {}\n",
+                "mutex+cond, new vectors",
+                ms,
+                chunks * CHUNK / 1024.0 / 1024 / (ms / 1000),
+                received == chunks ? "" : "LOST CHUNKS");
+    }
+
+    return 0;
+}
+
+int checkupdates(int argc, char* argv[])
+{
+    if (argc != 4 && argc != 5)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    struct Title
+    {
+        std::string titleid;
+        std::string installed_version;
+        std::optional<PatchInfo> patch;
+        std::string error;
+    };
+
+    std::vector<Title> titles;
+    {
+        std::ifstream file(argv[2]);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream fields(line);
+            Title title;
+            if (fields >> title.titleid)
+            {
+                fields >> title.installed_version;
+                titles.push_back(std::move(title));
+            }
+        }
+    }
+    const std::string base_url = argv[3];
+    const size_t workers = argc == 5 ? std::stoul(argv[4]) : 4;
+
+    std::atomic<size_t> next{0};
+    const auto elapsed = time_ms([&] {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < workers; ++i)
+            threads.emplace_back([&] {
+                // one connection per worker
+                CachingHttp http(make_http(base_url), "httpcache.db");
+                for (size_t index; (index = next++) < titles.size();)
+                {
+                    auto& title = titles[index];
+                    auto url = pkgi_patch_info_url(title.titleid);
+                    url = base_url + url.substr(url.find("/pl/np/"));
+                    try
+                    {
+                        title.patch = pkgi_fetch_patch_info(&http, url);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        title.error = e.what();
+                    }
+                    http.close();
+                }
+            });
+        for (auto& thread : threads)
+            thread.join();
+    });
+
+    size_t available = 0;
+    size_t failed = 0;
+    for (const auto& title : titles)
+    {
+        if (!title.error.empty())
+        {
+            ++failed;
+            fmt::print("{} failed: {}\n", title.titleid, title.error);
+            continue;
+        }
+        if (!title.patch || !pkgi_is_newer_version(
+                                    title.installed_version,
+                                    title.patch->version))
+            continue;
+        ++available;
+        fmt::print(
+                "{} {} -> {} (firmware {})\n",
+                title.titleid,
+                title.installed_version,
+                title.patch->version,
+                title.patch->fw_version);
+    }
+
+    const auto stats = CachingHttp::stats();
+    fmt::print(
+            "{} titles checked in {:.1f} ms with {} workers: {} updates, {} "
+            "failed, {} cache hits, {} revalidated, {} misses\n",
+            titles.size(),
+            elapsed,
+            workers,
+            available,
+            failed,
+            stats.hits,
+            stats.revalidated,
+            stats.misses);
+
+    return 0;
+}
+
+int benchjournal(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    const size_t items = std::stoul(argv[2]);
+    const std::string path = "benchjournal.journal";
+    pkgi_rm(path.c_str());
+
+    const auto make_item = [](size_t n) {
+        DownloadItem item;
+        item.type = Game;
+        item.name = fmt::format("Game {}", n);
+        item.content = fmt::format("UP0000-PCSE{:05}_00-0000000000000000", n);
+        item.url = fmt::format("http://example.com/{}.pkg", n);
+        item.rif.resize(PKGI_RIF_SIZE, n & 0xff);
+        item.digest.resize(32, n & 0xff);
+        item.save_as_iso = false;
+        item.partition = "ux0:";
+        item.size = n * 1024 * 1024;
+        return item;
+    };
+
+    // a queue is filled, then every other item completes
+    QueueJournal journal(path);
+    journal.load();
+    const auto add_ms = time_ms([&] {
+        for (size_t n = 0; n < items; ++n)
+            journal.added(make_item(n));
+    });
+    const auto complete_ms = time_ms([&] {
+        for (size_t n = 0; n < items; n += 2)
+            journal.completed(Game, make_item(n).content);
+    });
+    fmt::print(
+            "{} adds {:.3f} ms each, {} completes {:.3f} ms each, {} records "
+            "left\n",
+            items,
+            add_ms / items,
+            (items + 1) / 2,
+            complete_ms / ((items + 1) / 2),
+            journal.records());
+
+    const auto check = [&](const char* name, size_t expected) {
+        QueueJournal restored(path);
+        std::vector<DownloadItem> queue;
+        const auto ms = time_ms([&] { queue = restored.load(); });
+        bool same = queue.size() == expected;
+        for (size_t i = 0; same && i < queue.size(); ++i)
+        {
+            const auto item = make_item(2 * i + 1);
+            same = queue[i].content == item.content &&
+                   queue[i].rif == item.rif && queue[i].size == item.size;
+        }
+        fmt::print(
+                "{:<24} {} items in {:.2f} ms {}\n",
+                name,
+                queue.size(),
+                ms,
+                same ? "" : "WRONG QUEUE");
+    };
+    check("restored", items / 2);
+
+    // a crash in the middle of the last record
+    {
+        QueueJournal torn(path);
+        torn.load();
+        torn.added(make_item(items | 1));
+    }
+    auto data = pkgi_load(path);
+    pkgi_save(path, data.data(), data.size() - 3);
+    check("restored after a crash", items / 2);
+
+    pkgi_rm(path.c_str());
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     if (argc < 2)
@@ -151,6 +1490,10 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+#ifdef PKGI_ENABLE_LOCK_STATS
+    std::atexit([] { fputs(LockStats::summary().c_str(), stderr); });
+#endif
+
     if (std::string(argv[1]) == "extract")
         return extract(argc, argv);
     if (std::string(argv[1]) == "refreshlist")
@@ -163,6 +1506,30 @@ int main(int argc, char* argv[])
         return extractzip(argc, argv);
     if (std::string(argv[1]) == "patchinfo")
         return patchinfo(argc, argv);
+    if (std::string(argv[1]) == "benchdb")
+        return benchdb(argc, argv);
+    if (std::string(argv[1]) == "benchcomppack")
+        return benchcomppack(argc, argv);
+    if (std::string(argv[1]) == "benchhttp")
+        return benchhttp(argc, argv);
+    if (std::string(argv[1]) == "benchpatchinfo")
+        return benchpatchinfo(argc, argv);
+    if (std::string(argv[1]) == "benchtuner")
+        return benchtuner(argc, argv);
+    if (std::string(argv[1]) == "benchthreads")
+        return benchthreads(argc, argv);
+    if (std::string(argv[1]) == "benchpool")
+        return benchpool(argc, argv);
+    if (std::string(argv[1]) == "benchscheduler")
+        return benchscheduler(argc, argv);
+    if (std::string(argv[1]) == "benchring")
+        return benchring(argc, argv);
+    if (std::string(argv[1]) == "benchjournal")
+        return benchjournal(argc, argv);
+    if (std::string(argv[1]) == "benchcache")
+        return benchcache(argc, argv);
+    if (std::string(argv[1]) == "checkupdates")
+        return checkupdates(argc, argv);
 
     printf(USAGE, argv[0]);
     return 1;
@@ -10,23 +10,38 @@
 
 #include <algorithm>
 #include <cstring>
-#include <regex>
 #include <stdexcept>
 #include <string>
 
 #include <stddef.h>
 
-CompPackDatabase::CompPackDatabase(std::string const& dbPath) : _dbPath(dbPath)
+namespace
+{
+// the catalog shares the file, its refresh writes while the main loop reads
+constexpr int BUSY_TIMEOUT_MS = 5000;
+}
+
+CompPackDatabase::CompPackDatabase(
+        std::string const& dbPath, std::string const& table)
+    : _dbPath(dbPath), _table(table)
 {
+    _resume_count = pkgi_resume_count();
     reopen();
 }
 
 void CompPackDatabase::reopen()
 {
     LOG("opening database %s", _dbPath.c_str());
+    _statements.clear();
+    _sqliteDb.reset();
+    _broken = false;
+
     sqlite3* db;
-    SQLITE_CHECK(sqlite3_open(_dbPath.c_str(), &db), "can't open database");
+    const auto open_result = sqlite3_open(_dbPath.c_str(), &db);
+    // sqlite3_open allocates a handle even on failure, it must be closed
     _sqliteDb.reset(db);
+    SQLITE_CHECK(open_result, "can't open database");
+    sqlite3_busy_timeout(_sqliteDb.get(), BUSY_TIMEOUT_MS);
 
     try
     {
@@ -34,10 +49,13 @@ void CompPackDatabase::reopen()
         SQLITE_CHECK(
                 sqlite3_prepare_v2(
                         _sqliteDb.get(),
-                        R"(
+                        fmt::format(
+                                R"(
                         SELECT titleid, app_version, path
-                        FROM entries
+                        FROM {}
                         WHERE 0)",
+                                _table)
+                                .c_str(),
                         -1,
                         &stmt,
                         nullptr),
@@ -49,59 +67,212 @@ void CompPackDatabase::reopen()
         LOG("%s. Trying migration.", e.what());
         SQLITE_EXEC(
                 _sqliteDb,
-                R"(DROP TABLE IF EXISTS entries)",
+                fmt::format("DROP TABLE IF EXISTS {}", _table).c_str(),
                 "drop table failed");
     }
 
     SQLITE_EXEC(
             _sqliteDb,
-            R"(
-        CREATE TABLE IF NOT EXISTS entries (
+            fmt::format(
+                    R"(
+        CREATE TABLE IF NOT EXISTS {} (
             titleid TEXT NOT NULL,
             app_version TEXT NOT NULL,
             path TEXT NOT NULL,
             PRIMARY KEY (titleid, app_version)
         ))",
+                    _table)
+                    .c_str(),
             "can't create comp pack table");
 }
 
-namespace
+void CompPackDatabase::ensure_connection()
+{
+    // after the app is suspended, all further queries on an open connection
+    // return disk I/O error, so reconnect once we notice a resume
+    const auto resume_count = pkgi_resume_count();
+    if (_sqliteDb && !_broken && resume_count == _resume_count)
+        return;
+
+    LOGF("reconnecting to {} (resumed: {}, broken: {})",
+         _dbPath,
+         resume_count != _resume_count,
+         _broken);
+    _resume_count = resume_count;
+    reopen();
+}
+
+bool CompPackDatabase::is_io_error() const
 {
-std::vector<const char*> pkgi_split_row(char** pptr, const char* end)
+    return (sqlite3_extended_errcode(_sqliteDb.get()) & 0xff) == SQLITE_IOERR;
+}
+
+sqlite3_stmt* CompPackDatabase::prepare(const char* sql)
 {
-    auto& ptr = *pptr;
+    auto& stmt = _statements[sql];
+    if (!stmt)
+    {
+        sqlite3_stmt* raw;
+        SQLITE_CHECK(
+                sqlite3_prepare_v2(_sqliteDb.get(), sql, -1, &raw, nullptr),
+                "can't prepare SQL statement");
+        stmt.reset(raw);
+    }
+    else
+    {
+        sqlite3_reset(stmt.get());
+        sqlite3_clear_bindings(stmt.get());
+    }
+    return stmt.get();
+}
 
-    std::vector<const char*> result;
-    while (ptr != end)
+namespace
+{
+// [A-Z]{4}\d{5}-\d{2}_\d{3}-\d{2}_\d{2}-\d{2}_\d{2}.ppk
+// 'A' is an uppercase letter, '9' a digit and '?' any character
+constexpr char COMPPACK_NAME_PATTERN[] = "AAAA99999-99_999-99_99-99_99?ppk";
+constexpr size_t COMPPACK_NAME_SIZE = sizeof(COMPPACK_NAME_PATTERN) - 1;
+constexpr size_t COMPPACK_TITLEID_SIZE = 9;
+constexpr size_t COMPPACK_VERSION_OFFSET = 17;
+constexpr size_t COMPPACK_VERSION_SIZE = 5;
+
+bool pkgi_match_comppack_name(const char* ptr)
+{
+    for (size_t i = 0; i < COMPPACK_NAME_SIZE; ++i)
     {
-        const char* field = ptr;
-        while (ptr != end && *ptr != '=' && *ptr != '\n')
-            ++ptr;
-        if (ptr == end)
+        const char c = ptr[i];
+        switch (COMPPACK_NAME_PATTERN[i])
         {
-            result.push_back(field);
+        case 'A':
+            if (c < 'A' || c > 'Z')
+                return false;
             break;
-        }
-        if (*ptr == '\n')
-        {
-            *ptr++ = 0;
+        case '9':
+            if (c < '0' || c > '9')
+                return false;
             break;
-        }
-        *ptr++ = 0;
-        result.push_back(field);
-
-        if (ptr == end)
-        {
-            result.push_back(field);
+        case '?':
             break;
+        default:
+            if (c != COMPPACK_NAME_PATTERN[i])
+                return false;
         }
     }
-    return result;
+    return true;
 }
+
+const char* pkgi_find_comppack_name(const char* begin, const char* end)
+{
+    if ((size_t)(end - begin) < COMPPACK_NAME_SIZE)
+        return nullptr;
+    for (const char* ptr = begin; ptr + COMPPACK_NAME_SIZE <= end; ++ptr)
+        if (pkgi_match_comppack_name(ptr))
+            return ptr;
+    return nullptr;
 }
 
-void CompPackDatabase::parse_entries(std::string& db_data)
+std::string pkgi_insert_sql(const std::string& table, size_t rows)
 {
+    std::string sql = fmt::format(
+            "INSERT INTO {} (titleid, path, app_version) VALUES ", table);
+    for (size_t i = 0; i < rows; ++i)
+        sql += i == 0 ? "(?, ?, ?)" : ", (?, ?, ?)";
+    return sql;
+}
+}
+
+void CompPackDatabase::insert_rows(
+        const std::string& text, std::vector<PendingRow>& rows)
+{
+    if (rows.empty())
+        return;
+
+    sqlite3_stmt* stmt = prepare(pkgi_insert_sql(_table, rows.size()).c_str());
+
+    int param = 1;
+    for (const auto& row : rows)
+    {
+        const char* path = text.data() + row.path;
+        const char* name = text.data() + row.name;
+        sqlite3_bind_text(
+                stmt, param++, name, COMPPACK_TITLEID_SIZE, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, param++, path, row.path_size, SQLITE_STATIC);
+        sqlite3_bind_text(
+                stmt,
+                param++,
+                name + COMPPACK_VERSION_OFFSET,
+                COMPPACK_VERSION_SIZE,
+                SQLITE_STATIC);
+    }
+
+    auto err = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (err != SQLITE_DONE)
+        throw std::runtime_error(fmt::format(
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get())));
+
+    rows.clear();
+}
+
+void CompPackDatabase::add_line(
+        const char* begin,
+        const char* end,
+        std::string& text,
+        std::vector<PendingRow>& rows)
+{
+    if (end != begin && end[-1] == '\r')
+        --end;
+    if (begin == end)
+        return;
+
+    // the path is the first field, other fields are ignored
+    const char* path_end =
+            static_cast<const char*>(std::memchr(begin, '=', end - begin));
+    if (!path_end)
+        path_end = end;
+
+    const char* name = pkgi_find_comppack_name(begin, path_end);
+    if (!name)
+        throw formatEx<std::runtime_error>(
+                "无法解析行\n{}\n{}",
+                std::string(begin, end),
+                "正则表达式不正确");
+
+    if (rows.size() == INSERT_BATCH_ROWS)
+    {
+        insert_rows(text, rows);
+        text.clear();
+    }
+
+    const auto offset = static_cast<uint32_t>(text.size());
+    text.append(begin, path_end);
+    rows.push_back(PendingRow{
+            offset,
+            static_cast<uint32_t>(path_end - begin),
+            static_cast<uint32_t>(offset + (name - begin)),
+    });
+}
+
+void CompPackDatabase::ingest(Http* http)
+{
+    // bulk load settings, the list can be downloaded again if the app dies
+    // in the middle of the transaction
+    SQLITE_EXEC(_sqliteDb, "PRAGMA synchronous = OFF", "can't set pragma");
+    SQLITE_EXEC(
+            _sqliteDb, "PRAGMA journal_mode = TRUNCATE", "can't set pragma");
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        char* errmsg;
+        auto err = sqlite3_exec(
+                _sqliteDb.get(),
+                "PRAGMA synchronous = FULL; PRAGMA journal_mode = DELETE",
+                nullptr,
+                nullptr,
+                &errmsg);
+        if (err != SQLITE_OK)
+            LOG("sqlite error: %s", errmsg);
+    };
+
     SQLITE_EXEC(_sqliteDb, "BEGIN", "can't begin transaction");
 
     BOOST_SCOPE_EXIT_ALL(&)
@@ -118,74 +289,66 @@ void CompPackDatabase::parse_entries(std::string& db_data)
         }
     };
 
-    SQLITE_EXEC(_sqliteDb, "DELETE FROM entries", "can't truncate table");
-
-    sqlite3_stmt* stmt;
-    SQLITE_CHECK(
-            sqlite3_prepare_v2(
-                    _sqliteDb.get(),
-                    R"(INSERT INTO entries
-                    (titleid, path, app_version)
-                    VALUES (?, ?, ?))",
-                    -1,
-                    &stmt,
-                    nullptr),
-            "can't prepare SQL statement");
-    BOOST_SCOPE_EXIT_ALL(&)
+    SQLITE_EXEC(
+            _sqliteDb,
+            fmt::format("DELETE FROM {}", _table).c_str(),
+            "can't truncate table");
+
+    std::vector<char> chunk(READ_CHUNK_SIZE);
+    // line cut by the end of the previous chunk
+    std::string partial;
+    // paths of the rows waiting to be inserted
+    std::string text;
+    std::vector<PendingRow> rows;
+    rows.reserve(INSERT_BATCH_ROWS);
+
+    uint64_t total = 0;
+    for (;;)
     {
-        sqlite3_finalize(stmt);
-    };
-
-    char* ptr = db_data.data();
-    char* end = db_data.data() + db_data.size();
-
-    const auto regex = std::regex(
-            R"(([A-Z]{4}\d{5})-(\d{2}_\d{3})-(\d{2}_\d{2})-(\d{2}_\d{2}).ppk)");
+        int read = http->read(
+                reinterpret_cast<uint8_t*>(chunk.data()), chunk.size());
+        if (read == 0)
+            break;
+        total += read;
 
-    const char* current_line = ptr;
-    while (ptr < end && *ptr)
-    {
-        try
+        const char* ptr = chunk.data();
+        const char* end = chunk.data() + read;
+        for (;;)
         {
-            current_line = ptr;
-            const auto fields = pkgi_split_row(&ptr, end);
-            if (fields.size() < 1)
-                throw std::runtime_error("无法解析行");
-
-            const auto path = std::string(fields[0]);
-
-            std::smatch matches;
-            if (!std::regex_search(path, matches, regex))
-                throw formatEx<std::runtime_error>("正则表达式不正确");
-            const auto titleid = matches.str(1);
-            const auto app_version = matches.str(3);
-
-            sqlite3_reset(stmt);
-            sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
-            sqlite3_bind_text(stmt, 2, path.data(), path.size(), nullptr);
-            sqlite3_bind_text(
-                    stmt, 3, app_version.data(), app_version.size(), nullptr);
-
-            auto err = sqlite3_step(stmt);
-            if (err != SQLITE_DONE)
-                throw std::runtime_error(fmt::format(
-                        "无法执行SQL语句:\n{}",
-                        sqlite3_errmsg(_sqliteDb.get())));
-        }
-        catch (const std::exception& e)
-        {
-            throw formatEx<std::runtime_error>(
-                    "无法解析行\n{}\n{}", current_line, e.what());
+            const char* eol =
+                    static_cast<const char*>(std::memchr(ptr, '\n', end - ptr));
+            if (!eol)
+            {
+                partial.append(ptr, end);
+                break;
+            }
+
+            if (partial.empty())
+                add_line(ptr, eol, text, rows);
+            else
+            {
+                partial.append(ptr, eol);
+                add_line(
+                        partial.data(),
+                        partial.data() + partial.size(),
+                        text,
+                        rows);
+                partial.clear();
+            }
+            ptr = eol + 1;
         }
     }
+
+    if (total == 0)
+        throw std::runtime_error(
+                "兼容包列表为空... 请更新PKGj版本");
+
+    add_line(partial.data(), partial.data() + partial.size(), text, rows);
+    insert_rows(text, rows);
 }
 
 void CompPackDatabase::update(Http* http, const std::string& update_url)
 {
-    std::string db_data;
-    db_data.resize(MAX_DB_SIZE);
-    uint64_t db_size = 0;
-
     if (update_url.empty())
         throw std::runtime_error("没有兼容包链接");
 
@@ -193,76 +356,87 @@ void CompPackDatabase::update(Http* http, const std::string& update_url)
 
     http->start(update_url, 0);
 
-    const auto length = http->get_length();
-
-    if (length > (int64_t)db_data.size())
-        throw std::runtime_error(
-                "兼容包列表过大... 请更新PKGj版本");
+    LOG("parsing items");
 
-    for (;;)
+    ensure_connection();
+    _mirror_loaded = false;
+    try
     {
-        uint32_t want = (uint32_t)min64(64 * 1024, db_data.size() - db_size);
-        int read = http->read(
-                reinterpret_cast<uint8_t*>(db_data.data()) + db_size, want);
-        if (read == 0)
-            break;
-        db_size += read;
+        ingest(http);
+    }
+    catch (const std::exception&)
+    {
+        if (is_io_error())
+            _broken = true;
+        throw;
     }
-
-    if (db_size == 0)
-        throw std::runtime_error(
-                "兼容包列表为空... 请更新PKGj版本");
-
-    LOG("parsing items");
-
-    db_data.resize(db_size);
-    parse_entries(db_data);
 
     LOG("finished parsing");
 }
 
-std::optional<CompPackDatabase::Item> CompPackDatabase::get(
-        const std::string& titleid)
+void CompPackDatabase::load_mirror()
 {
-    // we need to reopen the db before every query because for some reason,
-    // after the app is suspended, all further query will return disk I/O error
-    reopen();
-
-    LOG("reloading database");
-
-    sqlite3_stmt* stmt;
-    SQLITE_CHECK(
-            sqlite3_prepare_v2(
-                    _sqliteDb.get(),
-                    "SELECT path, app_version "
-                    "FROM entries "
-                    "WHERE titleid = ? ",
-                    -1,
-                    &stmt,
-                    nullptr),
-            "can't prepare SQL statement");
-    BOOST_SCOPE_EXIT_ALL(&)
+    for (int attempt = 0;; ++attempt)
     {
-        sqlite3_finalize(stmt);
-    };
+        ensure_connection();
+        _mirror.clear();
+
+        // the primary key orders versions, keep the first one of each title
+        // like an indexed lookup would
+        sqlite3_stmt* stmt = prepare(
+                fmt::format(
+                        "SELECT titleid, path, app_version "
+                        "FROM {} "
+                        "ORDER BY titleid, app_version",
+                        _table)
+                        .c_str());
+
+        int err;
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            std::string app_version =
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+            // replace _ by .
+            if (app_version.size() > 2)
+                app_version[2] = '.';
+
+            _mirror.emplace(
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                    Item{
+                            reinterpret_cast<const char*>(
+                                    sqlite3_column_text(stmt, 1)),
+                            std::move(app_version),
+                    });
+        }
+        sqlite3_reset(stmt);
 
-    sqlite3_bind_text(stmt, 1, titleid.data(), titleid.size(), nullptr);
+        if (err == SQLITE_DONE)
+            break;
 
-    auto const err = sqlite3_step(stmt);
-    if (err == SQLITE_DONE)
-        return std::nullopt;
-    if (err != SQLITE_ROW)
+        if (is_io_error() && attempt == 0)
+        {
+            LOG("disk I/O error while loading comp packs, reconnecting");
+            _broken = true;
+            continue;
+        }
+
+        _mirror.clear();
         throw std::runtime_error(fmt::format(
-                "无法执行SQL语句:\n{}",
-                sqlite3_errmsg(_sqliteDb.get())));
+                "无法执行SQL语句:\n{}", sqlite3_errmsg(_sqliteDb.get())));
+    }
 
-    std::string app_version =
-            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-    // replace _ by .
-    app_version[2] = '.';
+    LOGF("loaded {} comp pack entries from {}", _mirror.size(), _dbPath);
+    _mirror_loaded = true;
+}
 
-    return Item{
-            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-            app_version,
-    };
+std::optional<CompPackDatabase::Item> CompPackDatabase::get(
+        const std::string& titleid)
+{
+    if (!_mirror_loaded)
+        load_mirror();
+
+    const auto it = _mirror.find(titleid);
+    if (it == _mirror.end())
+        return std::nullopt;
+    return it->second;
 }
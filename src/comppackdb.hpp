@@ -7,6 +7,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <cstdint>
@@ -20,20 +21,55 @@ public:
         std::string app_version;
     };
 
-    CompPackDatabase(const std::string& dbPath);
+    // table allows several lists to share one database file
+    CompPackDatabase(
+            const std::string& dbPath, const std::string& table = "entries");
 
     void update(Http* http, const std::string& update_url);
 
+    // served from an in-memory mirror, the database is only read the first
+    // time and after an update
     std::optional<Item> get(const std::string& titleid);
 
 private:
-    static constexpr auto MAX_DB_SIZE = 4 * 1024 * 1024;
+    static constexpr auto READ_CHUNK_SIZE = 64 * 1024;
+    // 3 parameters per row, stays below SQLITE_MAX_VARIABLE_NUMBER
+    static constexpr size_t INSERT_BATCH_ROWS = 64;
+
+    struct PendingRow
+    {
+        // offsets in the batch text
+        uint32_t path;
+        uint32_t path_size;
+        uint32_t name;
+    };
 
     std::string _dbPath;
+    std::string _table;
 
     SqlitePtr _sqliteDb = nullptr;
+    // keyed by SQL text, must be finalized before _sqliteDb is closed
+    std::unordered_map<std::string, SqliteStmtPtr> _statements;
+
+    // value of pkgi_resume_count() when the connection was opened
+    uint32_t _resume_count = 0;
+    // set when a query failed with an I/O error
+    bool _broken = false;
+
+    bool _mirror_loaded = false;
+    std::unordered_map<std::string, Item> _mirror;
 
-    void parse_entries(std::string& db_data);
+    void ingest(Http* http);
+    void add_line(
+            const char* begin,
+            const char* end,
+            std::string& text,
+            std::vector<PendingRow>& rows);
+    void insert_rows(const std::string& text, std::vector<PendingRow>& rows);
 
+    sqlite3_stmt* prepare(const char* sql);
+    bool is_io_error() const;
+    void ensure_connection();
+    void load_mirror();
     void reopen();
 };
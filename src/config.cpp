@@ -5,6 +5,8 @@
 #include "file.hpp"
 #include "pkgi.hpp"
 
+#include <cstdlib>
+
 static constexpr char default_psv_games_url[] = "http://47.100.93.203/tsv/titles_psvgames.tsv";
 static constexpr char default_psv_dlcs_url[] = "http://47.100.93.203/tsv/titles_psvdlcs.tsv";
 static constexpr char default_psv_demos_url[] = "http://47.100.93.203/tsv/titles_psvdemos.tsv";
@@ -126,6 +128,24 @@ static DbFilter parse_filter(char* value, uint32_t filter)
     return static_cast<DbFilter>(result);
 }
 
+static std::vector<std::string> parse_mirrors(const char* value)
+{
+    std::vector<std::string> mirrors;
+    const char* start = value;
+    for (const char* ptr = value;; ++ptr)
+    {
+        if (*ptr == ',' || *ptr == 0)
+        {
+            if (ptr != start)
+                mirrors.emplace_back(start, ptr);
+            if (*ptr == 0)
+                break;
+            start = ptr + 1;
+        }
+    }
+    return mirrors;
+}
+
 Config pkgi_load_config()
 {
     try
@@ -207,6 +227,8 @@ Config pkgi_load_config()
                 config.psp_dlcs_url = value;
             else if (pkgi_stricmp(key, "url_comppack") == 0)
                 config.comppack_url = value;
+            else if (pkgi_stricmp(key, "pkg_mirrors") == 0)
+                config.pkg_mirrors = parse_mirrors(value);
             else if (pkgi_stricmp(key, "sort") == 0)
                 config.sort = parse_sort(value, SortByName);
             else if (pkgi_stricmp(key, "order") == 0)
@@ -217,6 +239,12 @@ Config pkgi_load_config()
                 config.no_version_check = 1;
             else if (pkgi_stricmp(key, "install_psp_as_pbp") == 0)
                 config.install_psp_as_pbp = 1;
+            else if (pkgi_stricmp(key, "search_fold_kana") == 0)
+                config.search_fold_kana = 1;
+            else if (pkgi_stricmp(key, "sqlite_catalog") == 0)
+                config.sqlite_catalog = 1;
+            else if (pkgi_stricmp(key, "download_slots") == 0)
+                config.download_slots = atoi(value);
             else if (pkgi_stricmp(key, "install_psp_psx_location") == 0)
                 config.install_psp_psx_location = value;
             else if (pkgi_stricmp(key, "install_psp_game_path") == 0)
@@ -295,6 +323,18 @@ void pkgi_save_config(const Config& config)
     SAVE_CONF("install_psp_iso_path", install_psp_iso_path, default_install_psp_iso_path);
     SAVE_CONF("install_psp_psx_path", install_psp_psx_path, default_install_psp_game_path);
 #undef SAVE_CONF
+    if (!config.pkg_mirrors.empty())
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "pkg_mirrors ");
+        const char* sep = "";
+        for (const auto& mirror : config.pkg_mirrors)
+        {
+            len += pkgi_snprintf(
+                    data + len, sizeof(data) - len, "%s%s", sep, mirror.c_str());
+            sep = ",";
+        }
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "\n");
+    }
     len += pkgi_snprintf(
             data + len, sizeof(data) - len, "sort %s\n", sort_str(config.sort));
     len += pkgi_snprintf(
@@ -338,6 +378,27 @@ void pkgi_save_config(const Config& config)
                 data + len, sizeof(data) - len, "install_psp_as_pbp 1\n");
     }
 
+    if (config.search_fold_kana)
+    {
+        len += pkgi_snprintf(
+                data + len, sizeof(data) - len, "search_fold_kana 1\n");
+    }
+
+    if (config.sqlite_catalog)
+    {
+        len += pkgi_snprintf(
+                data + len, sizeof(data) - len, "sqlite_catalog 1\n");
+    }
+
+    if (config.download_slots)
+    {
+        len += pkgi_snprintf(
+                data + len,
+                sizeof(data) - len,
+                "download_slots %d\n",
+                config.download_slots);
+    }
+
     pkgi_save(
             fmt::format("{}/config.txt", pkgi_get_config_folder()), data, len);
 }
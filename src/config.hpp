@@ -3,6 +3,7 @@
 #include "db.hpp"
 
 #include <string>
+#include <vector>
 
 typedef struct Config
 {
@@ -11,6 +12,10 @@ typedef struct Config
     uint32_t filter;
     int no_version_check;
     int install_psp_as_pbp;
+    int search_fold_kana;
+    int sqlite_catalog;
+    // downloads at once, 0 for the default of the Downloader
+    int download_slots;
     std::string install_psv_location;
     std::string install_psp_psx_location;
     std::string install_psp_game_path;
@@ -27,6 +32,9 @@ typedef struct Config
     std::string psp_dlcs_url;
 
     std::string comppack_url;
+
+    // servers with the same files as the pkg urls, tried alongside them
+    std::vector<std::string> pkg_mirrors;
 } Config;
 
 Config pkgi_load_config();
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+
+// scheme://host[:port] of an url, connections are only reused within an origin
+inline std::string pkgi_http_origin(const std::string& url)
+{
+    const auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos)
+        return url;
+    return url.substr(0, url.find('/', scheme_end + 3));
+}
+
+// thrown by ConnectionPool::acquire() when no slot was released in time
+class ConnectionPoolTimeout : public HttpError
+{
+public:
+    ConnectionPoolTimeout() : HttpError("等待可用连接超时")
+    {
+    }
+};
+
+// Connection bookkeeping shared by the Http backends.
+//
+// At most max_active connections are in use at a time, acquire() waits up to
+// acquire_timeout_ms for a slot and then fails with an HttpError, which the
+// callers retry like a failed connection. Connections released after a
+// complete response are kept idle, up to max_idle of them, and handed out
+// again by acquire() for the same origin.
+//
+// Sync must provide lock(), unlock(), wait_for(ms) (called with the lock
+// held) and notify_one(). The pool never opens or closes connections itself,
+// connections it gives back must be closed by the caller.
+template <typename Connection, typename Sync>
+class ConnectionPool
+{
+public:
+    ConnectionPool(
+            size_t max_active, size_t max_idle, uint32_t acquire_timeout_ms)
+        : _max_active(max_active)
+        , _max_idle(max_idle)
+        , _acquire_timeout(acquire_timeout_ms)
+    {
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Takes a slot, waiting for one to be released if needed. Returns an
+    // idle connection to origin if there is one, otherwise the caller opens
+    // a new connection for the slot.
+    std::optional<Connection> acquire(const std::string& origin)
+    {
+        const auto deadline = std::chrono::steady_clock::now() +
+                              std::chrono::milliseconds(_acquire_timeout);
+        _sync.lock();
+        while (_active >= _max_active)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                _sync.unlock();
+                throw ConnectionPoolTimeout();
+            }
+            const auto left =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - now);
+            ++_waiting;
+            _sync.wait_for(static_cast<uint32_t>(left.count()) + 1);
+            --_waiting;
+        }
+        ++_active;
+
+        std::optional<Connection> result;
+        for (auto it = _idle.begin(); it != _idle.end(); ++it)
+        {
+            if (it->first != origin)
+                continue;
+            result = std::move(it->second);
+            _idle.erase(it);
+            ++_reused;
+            break;
+        }
+        _sync.unlock();
+        return result;
+    }
+
+    // Gives the slot back. A connection passed here is kept for reuse.
+    // Returns the connection the caller must close, either the one that was
+    // passed or the oldest idle one it replaced.
+    std::optional<Connection> release(
+            const std::string& origin, std::optional<Connection> connection)
+    {
+        std::optional<Connection> evicted;
+
+        _sync.lock();
+        --_active;
+        if (connection)
+        {
+            if (_max_idle == 0)
+                evicted = std::move(connection);
+            else
+            {
+                if (_idle.size() >= _max_idle)
+                {
+                    evicted = std::move(_idle.front().second);
+                    _idle.pop_front();
+                }
+                _idle.emplace_back(origin, std::move(*connection));
+            }
+        }
+        if (_waiting)
+            _sync.notify_one();
+        _sync.unlock();
+
+        return evicted;
+    }
+
+    // Removes all idle connections, for the caller to close
+    std::deque<Connection> drain()
+    {
+        std::deque<Connection> result;
+        _sync.lock();
+        for (auto& idle : _idle)
+            result.push_back(std::move(idle.second));
+        _idle.clear();
+        _sync.unlock();
+        return result;
+    }
+
+    // slots that are neither taken nor waited for, already stale when it
+    // returns
+    size_t spare()
+    {
+        _sync.lock();
+        const auto used = _active + _waiting;
+        _sync.unlock();
+        return used < _max_active ? _max_active - used : 0;
+    }
+
+    // number of acquire() that returned an idle connection
+    size_t reused() const
+    {
+        return _reused;
+    }
+
+private:
+    Sync _sync;
+    const size_t _max_active;
+    const size_t _max_idle;
+    const uint32_t _acquire_timeout;
+
+    size_t _active = 0;
+    size_t _waiting = 0;
+    size_t _reused = 0;
+    // oldest first
+    std::deque<std::pair<std::string, Connection>> _idle;
+};
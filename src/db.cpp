@@ -1,7 +1,9 @@
 #include "db.hpp"
 
+#include "chunktuner.hpp"
 #include "file.hpp"
 #include "pkgi.hpp"
+#include "searchkey.hpp"
 #include "sha256.hpp"
 #include "utils.hpp"
 
@@ -36,11 +38,18 @@ std::string pkgi_mode_to_string(Mode mode)
     return "未知模式";
 }
 
-TitleDatabase::TitleDatabase(const std::string& dbPath) : _dbPath(dbPath)
+TsvTitleDatabase::TsvTitleDatabase(
+        const std::string& dbPath, uint32_t search_flags, size_t cache_budget)
+    : _dbPath(dbPath), _search_flags(search_flags), _cache_budget(cache_budget)
 {
 }
 
-static const char* pkgi_mode_to_file_name(Mode mode)
+TsvTitleDatabase::~TsvTitleDatabase()
+{
+    close_rows();
+}
+
+const char* pkgi_mode_to_file_name(Mode mode)
 {
     switch (mode)
     {
@@ -271,9 +280,14 @@ const char* get_or_empty(
 }
 }
 
-void TitleDatabase::update(Mode mode, Http* http, const std::string& update_url)
+bool pkgi_download_title_list(
+        const std::string& tmppath,
+        const std::string& filepath,
+        Http* http,
+        const std::string& update_url,
+        std::atomic<uint32_t>* db_size,
+        std::atomic<uint32_t>* db_total)
 {
-    const auto tmppath = _dbPath + "/dbtmp.tsv";
     auto item_file = pkgi_create(tmppath);
     BOOST_SCOPE_EXIT_ALL(&)
     {
@@ -281,39 +295,46 @@ void TitleDatabase::update(Mode mode, Http* http, const std::string& update_url)
             pkgi_close(item_file);
     };
 
-    const auto filepath =
-            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
     uint32_t last = pkgi_get_size(filepath.c_str());
 
-    std::vector<uint8_t> db_data(64 * 1024);
-    db_total = 0;
-    db_size = 0;
+    std::vector<uint8_t> db_data;
+    *db_total = 0;
+    *db_size = 0;
 
     LOGF("loading update from {}", update_url);
 
     http->start(update_url, 0, true);
 
-    db_total = http->get_length();
-    if (last == db_total) return; // skip when size same
+    *db_total = http->get_length();
+    if (last == *db_total) return false; // skip when size same
 
     http->close();
     http->start(update_url, 0);
     
 
+    ChunkTuner tuner("list", update_url);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        tuner.save();
+    };
+
     for (;;)
     {
+        db_data.resize(tuner.chunk_size());
+        const auto start = ChunkTuner::now_usec();
         int read = http->read(db_data.data(), db_data.size());
         if (read == 0)
             break;
-        db_size += read;
+        tuner.record(read, ChunkTuner::now_usec() - start);
+        *db_size += read;
 
         pkgi_write(item_file, db_data.data(), read);
     }
 
-    if (db_size == 0)
+    if (*db_size == 0)
         throw std::runtime_error(
                 "列表为空... 请更新PKGj版本");
-    if (db_size != db_total)
+    if (*db_size != *db_total)
         throw std::runtime_error(
                 "TSV文件不完整, 请检查网络连接是否异常, 然后"
                 "重试");
@@ -321,74 +342,362 @@ void TitleDatabase::update(Mode mode, Http* http, const std::string& update_url)
     pkgi_close(item_file);
     item_file = nullptr;
 
-    pkgi_rename(tmppath, filepath);
-
     LOG("finished downloading");
+    return true;
+}
+
+std::string TsvTitleDatabase::list_path(Mode mode) const
+{
+    return fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+}
+
+void TsvTitleDatabase::update(
+        Mode mode, Http* http, const std::string& update_url)
+{
+    const auto tmppath = _dbPath + "/dbtmp.tsv";
+    const auto filepath = list_path(mode);
+    // left by a refresh that was never applied
+    const auto newpath = filepath + ".new";
+    if (pkgi_file_exists(newpath))
+        pkgi_rm(newpath.c_str());
+
+    if (!pkgi_download_title_list(
+                tmppath, filepath, http, update_url, &db_size, &db_total))
+        return;
+
+    // the column store of the main thread points into filepath
+    pkgi_rename(tmppath, newpath);
+}
+
+void TsvTitleDatabase::apply_update()
+{
+    for (int i = 0; i < ModeCount; ++i)
+    {
+        const auto mode = static_cast<Mode>(i);
+        const auto filepath = list_path(mode);
+        const auto newpath = filepath + ".new";
+        if (!pkgi_file_exists(newpath))
+            continue;
+        if (_loaded_mode == mode)
+            close_rows();
+        pkgi_rename(newpath, filepath);
+    }
+}
+
+namespace
+{
+uint8_t region_to_filter(const char* region)
+{
+    if (strcmp(region, "ASIA") == 0)
+        return DbFilterRegionASA;
+    if (strcmp(region, "EU") == 0)
+        return DbFilterRegionEUR;
+    if (strcmp(region, "JP") == 0)
+        return DbFilterRegionJPN;
+    if (strcmp(region, "US") == 0)
+        return DbFilterRegionUSA;
+    return 0;
+}
+
+bool is_missing(const char* url, const char* zrif)
+{
+    return *url == '\0' || strcmp(url, "MISSING") == 0 ||
+           strcmp(url, "CART ONLY") == 0 || strcmp(zrif, "MISSING") == 0;
+}
+
+std::string get_full_name(
+        const std::string& name,
+        const std::string& app_version,
+        const std::string& fw_version)
+{
+    std::string full_name = name;
+    if (!app_version.empty())
+        full_name = fmt::format("{} ({})", name, app_version);
+    if (!name.empty() && name.back() != ']' && fw_version > "3.60")
+        full_name = fmt::format("{} [{}]", full_name, fw_version);
+    return full_name;
+}
+
+size_t item_bytes(const DbItem& item)
+{
+    return sizeof(DbItem) + item.partition.capacity() +
+           item.titleid.capacity() + item.content.capacity() +
+           item.name.capacity() + item.name_org.capacity() +
+           item.zrif.capacity() + item.url.capacity() + item.date.capacity() +
+           item.app_version.capacity() + item.fw_version.capacity();
+}
+}
+
+void TsvTitleDatabase::close_rows()
+{
+    clear_cache();
+    if (_rows_file)
+    {
+        pkgi_close(_rows_file);
+        _rows_file = nullptr;
+    }
+    _loaded_mode = -1;
+    _view.clear();
+    _row_offsets.clear();
+    _row_sizes.clear();
+    _names.clear();
+    _dates.clear();
+    _titleids.clear();
+    _sizes.clear();
+    _regions.clear();
+    _strings.clear();
+    _search_key_offsets.clear();
+    _search_keys.clear();
+    _title_count = 0;
 }
 
 namespace
 {
-const char* region_to_string(GameRegion region)
+// Calls on_line(offset, row, size, line) for every line of the file. The row
+// is null terminated and may be modified by on_line.
+template <typename F>
+void pkgi_for_each_line(void* file, F&& on_line)
 {
-    switch (region)
+    static constexpr auto INGEST_CHUNK = 64 * 1024;
+
+    // +1 so that an unterminated last line can still be null terminated
+    std::vector<char> buffer(INGEST_CHUNK + 1);
+    size_t filled = 0;
+    uint64_t buffer_offset = 0;
+    unsigned line = 0;
+
+    while (true)
     {
-    case RegionASA:
-        return "ASIA";
-    case RegionEUR:
-        return "EU";
-    case RegionJPN:
-        return "JP";
-    case RegionUSA:
-        return "US";
-    default:
-        throw std::runtime_error(fmt::format("未知发行区域 {}", (int)region));
+        const auto read = pkgi_read(
+                file, buffer.data() + filled, buffer.size() - 1 - filled);
+        filled += read;
+        const bool eof = read == 0;
+
+        char* ptr = buffer.data();
+        char* const end = buffer.data() + filled;
+        while (ptr != end)
+        {
+            auto eol = static_cast<char*>(memchr(ptr, '\n', end - ptr));
+            if (!eol)
+            {
+                if (!eof)
+                    break;
+                eol = end;
+            }
+            *eol = 0;
+
+            const auto row_offset = buffer_offset + (ptr - buffer.data());
+            const auto row_size = static_cast<uint32_t>(eol - ptr);
+            char* row = ptr;
+            ptr = eol == end ? end : eol + 1;
+
+            on_line(row_offset, row, row_size, line++);
+        }
+
+        const size_t consumed = ptr - buffer.data();
+        memmove(buffer.data(), ptr, filled - consumed);
+        filled -= consumed;
+        buffer_offset += consumed;
+
+        if (eof)
+            break;
+        // a single row doesn't fit in the buffer
+        if (filled == buffer.size() - 1)
+            buffer.resize(buffer.size() * 2);
     }
 }
 
-std::set<std::string> filter_to_vector(uint32_t filter)
+std::array<char, 9> get_titleid(const char* content)
 {
-    std::set<std::string> ret;
-#define HANDLE_REGION(reg)            \
-    if (filter & DbFilterRegion##reg) \
-    ret.insert(region_to_string(Region##reg))
-    HANDLE_REGION(ASA);
-    HANDLE_REGION(EUR);
-    HANDLE_REGION(JPN);
-    HANDLE_REGION(USA);
-#undef HANDLE_REGION
-    return ret;
+    std::array<char, 9> titleid{};
+    if (strlen(content) >= 7 + 9)
+        memcpy(titleid.data(), content + 7, titleid.size());
+    return titleid;
 }
 
-bool lower(const DbItem& a, const DbItem& b, DbSort sort, DbSortOrder order)
+int64_t get_size(Mode mode, std::vector<const char*> const& fields)
 {
-    GameRegion reg_a = pkgi_get_region(a.titleid);
-    GameRegion reg_b = pkgi_get_region(b.titleid);
+    const std::string size = get_or_empty(mode, fields, Column::Size);
+    return size.empty() ? 0 : std::stoll(size);
+}
 
-    int64_t cmp;
-    if (sort == SortByTitle)
-        cmp = a.titleid.compare(b.titleid);
-    else if (sort == SortByRegion)
-        cmp = reg_a - reg_b;
-    else if (sort == SortByName)
-        cmp = pkgi_stricmp(a.name.c_str(), b.name.c_str());
-    else if (sort == SortBySize)
-        cmp = a.size - b.size;
-    else if (sort == SortByDate)
-        cmp = a.date.compare(b.date);
+DbItem make_item(
+        Mode mode,
+        std::vector<const char*> const& fields,
+        const std::string& partition,
+        const std::array<char, 9>& titleid,
+        const std::string& name,
+        int64_t size,
+        const char* date)
+{
+    const auto digest = get_or_empty(mode, fields, Column::Digest);
+    bool bdigest = true;
+    std::array<uint8_t, 32> digest_array{};
+    if (strnlen(digest, 64) == 64)
+        digest_array = pkgi_hexbytes(digest, SHA256_DIGEST_SIZE);
     else
-        throw std::runtime_error(fmt::format("未知排序顺序 {}", sort));
-
-    if (cmp == 0)
-        cmp = a.titleid.compare(b.titleid);
+        bdigest = false;
+
+    return DbItem{
+            PresenceUnknown,
+            partition,
+            std::string(
+                    titleid.data(), strnlen(titleid.data(), titleid.size())),
+            get_or_empty(mode, fields, Column::Content),
+            0,
+            name,
+            get_or_empty(mode, fields, Column::NameOrg),
+            get_or_empty(mode, fields, Column::Zrif),
+            get_or_empty(mode, fields, Column::Url),
+            bdigest,
+            digest_array,
+            size,
+            date,
+            get_or_empty(mode, fields, Column::AppVersion),
+            get_or_empty(mode, fields, Column::FwVersion),
+    };
+}
+}
 
-    if (order == SortDescending)
-        cmp = -cmp;
+void pkgi_parse_title_list(
+        const std::string& path,
+        Mode mode,
+        const std::function<void(const DbTitleRow& row)>& on_row)
+{
+    auto file = pkgi_open(path.c_str());
+    if (!file)
+        throw formatEx<std::runtime_error>("无法打开 {}", path);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        pkgi_close(file);
+    };
 
-    return cmp < 0;
+    pkgi_for_each_line(
+            file, [&](uint64_t, char* row, uint32_t row_size, unsigned line) {
+                // skip header
+                if (line == 0 || *row == '\0')
+                    return;
+
+                try
+                {
+                    const auto fields = pkgi_split_row(&row, row + row_size);
+
+                    const auto url = get_or_empty(mode, fields, Column::Url);
+                    const auto zrif = get_or_empty(mode, fields, Column::Zrif);
+                    if (is_missing(url, zrif))
+                        return;
+
+                    const auto name = get_or_empty(mode, fields, Column::Name);
+                    const auto full_name = get_full_name(
+                            name,
+                            get_or_empty(mode, fields, Column::AppVersion),
+                            get_or_empty(mode, fields, Column::FwVersion));
+
+                    on_row(DbTitleRow{
+                            make_item(
+                                    mode,
+                                    fields,
+                                    "",
+                                    get_titleid(get_or_empty(
+                                            mode, fields, Column::Content)),
+                                    full_name,
+                                    get_size(mode, fields),
+                                    get_or_empty(
+                                            mode,
+                                            fields,
+                                            Column::LastModification)),
+                            name,
+                            region_to_filter(get_or_empty(
+                                    mode, fields, Column::Region)),
+                    });
+                }
+                catch (const std::exception& e)
+                {
+                    throw formatEx<std::runtime_error>(
+                            "无法解析行 {}: {}", line, e.what());
+                }
+            });
 }
+
+void TsvTitleDatabase::ingest(Mode mode)
+{
+    close_rows();
+
+    const auto dbpath = list_path(mode);
+
+    if (!pkgi_file_exists(dbpath))
+        return;
+
+    _rows_file = pkgi_open(dbpath.c_str());
+    if (!_rows_file)
+        throw formatEx<std::runtime_error>("无法打开 {}", dbpath);
+    _loaded_mode = mode;
+
+    pkgi_for_each_line(
+            _rows_file,
+            [&](uint64_t row_offset,
+                char* row,
+                uint32_t row_size,
+                unsigned line) {
+                // skip header
+                if (line == 0 || *row == '\0')
+                    return;
+
+                try
+                {
+                    const auto fields = pkgi_split_row(&row, row + row_size);
+
+                    const auto url = get_or_empty(mode, fields, Column::Url);
+                    const auto zrif = get_or_empty(mode, fields, Column::Zrif);
+                    if (is_missing(url, zrif))
+                        return;
+
+                    _row_offsets.push_back(row_offset);
+                    _row_sizes.push_back(row_size);
+                    _titleids.push_back(get_titleid(
+                            get_or_empty(mode, fields, Column::Content)));
+                    _regions.push_back(region_to_filter(
+                            get_or_empty(mode, fields, Column::Region)));
+                    _sizes.push_back(get_size(mode, fields));
+
+                    const auto name = get_or_empty(mode, fields, Column::Name);
+                    _names.push_back(_strings.size());
+                    _strings += get_full_name(
+                            name,
+                            get_or_empty(mode, fields, Column::AppVersion),
+                            get_or_empty(mode, fields, Column::FwVersion));
+                    _strings.push_back('\0');
+
+                    _search_key_offsets.push_back(_search_keys.size());
+                    _search_keys += pkgi_search_key(name, _search_flags);
+                    _search_keys.push_back('\0');
+                    _search_keys += pkgi_search_key(
+                            get_or_empty(mode, fields, Column::NameOrg),
+                            _search_flags);
+                    _search_keys.push_back('\0');
+
+                    _dates.push_back(_strings.size());
+                    _strings += get_or_empty(
+                            mode, fields, Column::LastModification);
+                    _strings.push_back('\0');
+                }
+                catch (const std::exception& e)
+                {
+                    throw formatEx<std::runtime_error>(
+                            "无法解析行 {}: {}", line, e.what());
+                }
+            });
+
+    _title_count = _row_offsets.size();
+    _strings.shrink_to_fit();
+    _search_keys.shrink_to_fit();
+
+    LOGF("ingested {} rows, {} bytes of strings",
+         _title_count,
+         _strings.size());
 }
 
-void TitleDatabase::reload(
+void TsvTitleDatabase::reload(
         Mode mode,
         uint32_t region_filter,
         DbSort sort_by,
@@ -399,147 +708,220 @@ void TitleDatabase::reload(
 {
     const auto filter_by_region =
             (region_filter & DbFilterAllRegions) != DbFilterAllRegions;
-    const auto regions = filter_to_vector(region_filter);
 
-    db.clear();
-    _title_count = 0;
+    // changing filters, sort or search only rebuilds the view, the file is
+    // parsed again only when the mode changed or after an update
+    if (_loaded_mode != mode)
+        ingest(mode);
 
-    const auto dbpath =
-            fmt::format("{}/{}", _dbPath, pkgi_mode_to_file_name(mode));
+    clear_cache();
+    _view.clear();
+    _partition = partition;
 
-    if (!pkgi_file_exists(dbpath))
-        return;
+    std::vector<bool> matches;
+    if (!search.empty())
+    {
+        const auto key = pkgi_search_key(search.c_str(), _search_flags);
+        matches.resize(_row_offsets.size());
+
+        const auto keys = _search_keys.data();
+        const auto keys_end = keys + _search_keys.size();
+        auto ptr = keys;
+        while (auto found = static_cast<const char*>(
+                       memmem(ptr, keys_end - ptr, key.data(), key.size())))
+        {
+            const auto next = std::upper_bound(
+                    _search_key_offsets.begin(),
+                    _search_key_offsets.end(),
+                    static_cast<uint32_t>(found - keys));
+            matches[next - _search_key_offsets.begin() - 1] = true;
+            if (next == _search_key_offsets.end())
+                break;
+            ptr = keys + *next;
+        }
+    }
 
-    auto db_data = pkgi_load(dbpath);
+    for (uint32_t row = 0; row < _row_offsets.size(); ++row)
+    {
+        if (filter_by_region && !(_regions[row] & region_filter))
+            continue;
 
-    auto ptr = reinterpret_cast<char*>(db_data.data());
-    const auto end = reinterpret_cast<char*>(db_data.data() + db_data.size());
+        if (!search.empty() && !matches[row])
+            continue;
 
-    // skip header
-    while (ptr < end && *ptr != '\n')
-        ptr++;
-    if (ptr == end)
-        return;
-    ptr++; // \n
+        if ((region_filter & DbFilterInstalled) &&
+            installed_games.find(std::string(
+                    _titleids[row].data(),
+                    strnlen(_titleids[row].data(), _titleids[row].size()))) ==
+                    installed_games.end())
+            continue;
 
-    unsigned line = 1;
-    while (ptr < end && *ptr)
+        _view.push_back(row);
+    }
+
+    std::vector<uint8_t> title_regions;
+    if (sort_by == SortByRegion)
     {
-        ++line;
-        try
-        {
-            const auto fields = pkgi_split_row(&ptr, end);
-
-            const std::string content =
-                    get_or_empty(mode, fields, Column::Content);
-            const std::string titleid =
-                    content.size() >= 7 + 9 ? content.substr(7, 9) : "";
-            const auto region = get_or_empty(mode, fields, Column::Region);
-            const std::string name = get_or_empty(mode, fields, Column::Name);
-            const auto name_org = get_or_empty(mode, fields, Column::NameOrg);
-            const auto url = get_or_empty(mode, fields, Column::Url);
-            const auto zrif = get_or_empty(mode, fields, Column::Zrif);
-            const auto digest = get_or_empty(mode, fields, Column::Digest);
-            const std::string size = get_or_empty(mode, fields, Column::Size);
-            const std::string fw_version =
-                    get_or_empty(mode, fields, Column::FwVersion);
-            const auto last_modification =
-                    get_or_empty(mode, fields, Column::LastModification);
-            const std::string app_version =
-                    get_or_empty(mode, fields, Column::AppVersion);
-
-            if (*url == '\0' || std::string(url) == "MISSING" ||
-                std::string(url) == "CART ONLY" ||
-                std::string(zrif) == "MISSING")
-                continue;
-
-            ++_title_count;
-
-            if (filter_by_region && !regions.count(region))
-                continue;
-
-            if (!search.empty() &&
-                !pkgi_stricontains(name.c_str(), search.c_str()))
-                continue;
-
-            bool bdigest = true;
-            std::array<uint8_t, 32> digest_array{};
-            if (std::all_of(digest, digest + 64, [](const auto c) {
-                    return c != 0;
-                }))
-                digest_array = pkgi_hexbytes(digest, SHA256_DIGEST_SIZE);
-            else
-                bdigest = false;
-
-            std::string full_name = name;
-            if (!app_version.empty())
-                full_name = fmt::format("{} ({})", name, app_version);
-            if (!name.empty() && name.back() != ']' && fw_version > "3.60")
-                full_name = fmt::format("{} [{}]", full_name, fw_version);
-
-            if (!(region_filter & DbFilterInstalled) ||
-                installed_games.find(titleid) != installed_games.end())
-                db.push_back(DbItem{
-                        PresenceUnknown,
-                        partition,
-                        titleid,
-                        content,
-                        0,
-                        full_name,
-                        name_org ? name_org : "",
-                        zrif ? zrif : "",
-                        url,
-                        static_cast<bool>(bdigest),
-                        digest_array,
-                        size.empty() ? 0 : std::stoll(size),
-                        last_modification,
-                        app_version,
-                        fw_version,
-                });
-        }
-        catch (const std::exception& e)
-        {
+        title_regions.resize(_row_offsets.size());
+        for (const auto row : _view)
+            title_regions[row] = pkgi_get_region(std::string(
+                    _titleids[row].data(), _titleids[row].size()));
+    }
+
+    const auto lower = [&](uint32_t a, uint32_t b) {
+        int64_t cmp;
+        if (sort_by == SortByTitle)
+            cmp = 0;
+        else if (sort_by == SortByRegion)
+            cmp = title_regions[a] - title_regions[b];
+        else if (sort_by == SortByName)
+            cmp = pkgi_stricmp(string_at(_names[a]), string_at(_names[b]));
+        else if (sort_by == SortBySize)
+            cmp = _sizes[a] - _sizes[b];
+        else if (sort_by == SortByDate)
+            cmp = strcmp(string_at(_dates[a]), string_at(_dates[b]));
+        else
+            throw std::runtime_error(
+                    fmt::format("未知排序顺序 {}", static_cast<int>(sort_by)));
+
+        if (cmp == 0)
+            cmp = memcmp(
+                    _titleids[a].data(),
+                    _titleids[b].data(),
+                    _titleids[a].size());
+
+        if (sort_order == SortDescending)
+            cmp = -cmp;
+
+        return cmp < 0;
+    };
+    std::sort(_view.begin(), _view.end(), lower);
+
+    LOGF("reloaded {}/{} items", _view.size(), _title_count);
+}
+
+DbItem* TsvTitleDatabase::materialize(uint32_t row)
+{
+    const auto it = _cache.find(row);
+    if (it != _cache.end())
+    {
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        return it->second.item.get();
+    }
+
+    const auto mode = static_cast<Mode>(_loaded_mode);
+
+    std::vector<char> data(_row_sizes[row] + 1);
+    pkgi_seek(_rows_file, _row_offsets[row]);
+    uint32_t pos = 0;
+    while (pos < _row_sizes[row])
+    {
+        const auto read = pkgi_read(
+                _rows_file, data.data() + pos, _row_sizes[row] - pos);
+        if (read <= 0)
             throw formatEx<std::runtime_error>(
-                    "无法解析行 {}: {}", line, e.what());
-        }
+                    "无法读取行 {}", static_cast<unsigned>(row));
+        pos += read;
     }
 
-    std::sort(db.begin(), db.end(), [&](const auto& a, const auto& b) {
-        return lower(a, b, sort_by, sort_order);
-    });
+    char* ptr = data.data();
+    const auto fields = pkgi_split_row(&ptr, data.data() + _row_sizes[row]);
+
+    auto item = std::make_unique<DbItem>(make_item(
+            mode,
+            fields,
+            _partition,
+            _titleids[row],
+            string_at(_names[row]),
+            _sizes[row],
+            string_at(_dates[row])));
+
+    const auto bytes = item_bytes(*item);
+    const auto ret = item.get();
+    _lru.push_front(row);
+    _cache.emplace(row, CachedItem{std::move(item), _lru.begin(), bytes});
+    _cache_bytes += bytes;
 
-    LOGF("reloaded {}/{} items", db.size(), _title_count);
+    evict();
+
+    return ret;
 }
 
-void TitleDatabase::get_update_status(uint32_t* updated, uint32_t* total)
+void TsvTitleDatabase::evict()
+{
+    if (_cache_budget == 0)
+        return;
+
+    while (_cache_bytes > _cache_budget && _cache.size() > MIN_VALID_ITEMS)
+    {
+        const auto row = _lru.back();
+        const auto it = _cache.find(row);
+        _cache_bytes -= it->second.bytes;
+        _cache.erase(it);
+        _lru.pop_back();
+    }
+}
+
+void TsvTitleDatabase::clear_cache()
+{
+    _cache.clear();
+    _lru.clear();
+    _cache_bytes = 0;
+}
+
+void TsvTitleDatabase::get_update_status(uint32_t* updated, uint32_t* total)
 {
     *updated = db_size;
     *total = db_total;
 }
 
-uint32_t TitleDatabase::count()
+uint32_t TsvTitleDatabase::count()
 {
-    return db.size();
+    return _view.size();
 }
 
-uint32_t TitleDatabase::total()
+uint32_t TsvTitleDatabase::total()
 {
     return _title_count;
 }
 
-DbItem* TitleDatabase::get(uint32_t index)
+DbItem* TsvTitleDatabase::get(uint32_t index)
 {
-    return index < db.size() ? &db[index] : NULL;
+    return index < _view.size() ? materialize(_view[index]) : NULL;
 }
 
-DbItem* TitleDatabase::get_by_content(const char* content)
+DbItem* TsvTitleDatabase::get_by_content(const char* content)
 {
-    for (size_t i = 0; i < db.size(); ++i)
-        if (db[i].content == content)
-            return &db[i];
+    // the titleid is part of the content id, so only rows with a matching
+    // titleid need to be read back
+    if (strlen(content) < 7 + 9)
+        return NULL;
+    for (size_t i = 0; i < _view.size(); ++i)
+    {
+        const auto row = _view[i];
+        if (memcmp(_titleids[row].data(), content + 7, 9) != 0)
+            continue;
+        const auto item = materialize(row);
+        if (item->content == content)
+            return item;
+    }
     return NULL;
 }
 
+size_t TsvTitleDatabase::memory_usage() const
+{
+    return _row_offsets.capacity() * sizeof(uint32_t) +
+           _row_sizes.capacity() * sizeof(uint32_t) +
+           _names.capacity() * sizeof(uint32_t) +
+           _dates.capacity() * sizeof(uint32_t) +
+           _titleids.capacity() * sizeof(std::array<char, 9>) +
+           _sizes.capacity() * sizeof(int64_t) +
+           _regions.capacity() * sizeof(uint8_t) + _strings.capacity() +
+           _search_key_offsets.capacity() * sizeof(uint32_t) +
+           _search_keys.capacity() +
+           _view.capacity() * sizeof(uint32_t) + _cache_bytes;
+}
+
 GameRegion pkgi_get_region(const std::string& titleid)
 {
     if (titleid.size() < 4)
@@ -3,11 +3,16 @@
 #include "http.hpp"
 
 #include <array>
+#include <atomic>
+#include <functional>
+#include <list>
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <cstddef>
 #include <cstdint>
 
 enum DbPresence
@@ -96,7 +101,52 @@ std::string pkgi_mode_to_string(Mode mode);
 class TitleDatabase
 {
 public:
-    TitleDatabase(const std::string& dbPath);
+    virtual ~TitleDatabase() = default;
+
+    virtual void reload(
+            Mode mode,
+            uint32_t region_filter,
+            DbSort sort_by,
+            DbSortOrder sort_order,
+            const std::string& partition,
+            const std::string& search,
+            const std::set<std::string>& installed_games) = 0;
+
+    // called on the refresh thread while the other methods are used on the
+    // main one, the new list must not be visible before apply_update()
+    virtual void update(Mode mode, Http* http, const std::string& update_url) = 0;
+    // on the main thread once the refresh thread is done, before the next
+    // reload
+    virtual void apply_update() = 0;
+    virtual void get_update_status(uint32_t* updated, uint32_t* total) = 0;
+
+    virtual uint32_t count() = 0;
+    virtual uint32_t total() = 0;
+    // the returned item stays valid until the next reload and at least while
+    // the last MIN_VALID_ITEMS items returned by get() are being accessed
+    virtual DbItem* get(uint32_t index) = 0;
+    virtual DbItem* get_by_content(const char* content) = 0;
+
+    // approximate heap usage of the backend
+    virtual size_t memory_usage() const = 0;
+
+protected:
+    static constexpr auto MIN_VALID_ITEMS = 64;
+};
+
+// Parses the title lists downloaded in the config folder, keeping a column
+// store of the current mode in memory
+class TsvTitleDatabase : public TitleDatabase
+{
+public:
+    // budget for the items materialized by get(), 0 means unbounded
+    static constexpr size_t DEFAULT_CACHE_BUDGET = 512 * 1024;
+
+    TsvTitleDatabase(
+            const std::string& dbPath,
+            uint32_t search_flags = 0,
+            size_t cache_budget = DEFAULT_CACHE_BUDGET);
+    ~TsvTitleDatabase();
 
     void reload(
             Mode mode,
@@ -105,25 +155,103 @@ public:
             DbSortOrder sort_order,
             const std::string& partition,
             const std::string& search,
-            const std::set<std::string>& installed_games);
+            const std::set<std::string>& installed_games) override;
 
-    void update(Mode mode, Http* http, const std::string& update_url);
-    void get_update_status(uint32_t* updated, uint32_t* total);
+    // downloads the list next to the current one, apply_update() replaces it
+    void update(Mode mode, Http* http, const std::string& update_url) override;
+    void apply_update() override;
+    void get_update_status(uint32_t* updated, uint32_t* total) override;
 
-    uint32_t count();
-    uint32_t total();
-    DbItem* get(uint32_t index);
-    DbItem* get_by_content(const char* content);
+    uint32_t count() override;
+    uint32_t total() override;
+    DbItem* get(uint32_t index) override;
+    DbItem* get_by_content(const char* content) override;
 
-private:
-    static constexpr auto MAX_DB_ITEMS = 8192;
+    // approximate heap usage of the column store and of the item cache
+    size_t memory_usage() const override;
 
+private:
     std::string _dbPath;
-    uint32_t db_total;
-    uint32_t db_size;
+    // written by update() on the refresh thread, read by the main one
+    std::atomic<uint32_t> db_total{0};
+    std::atomic<uint32_t> db_size{0};
     uint32_t _title_count;
 
-    std::vector<DbItem> db;
+    // Column store of the currently loaded TSV. Only the columns needed to
+    // filter and sort are kept, the rest of a row is read back from the file
+    // when the row is materialized.
+    int _loaded_mode = -1;
+    void* _rows_file = nullptr;
+    std::vector<uint32_t> _row_offsets;
+    std::vector<uint32_t> _row_sizes;
+    std::vector<uint32_t> _names; // offsets in _strings
+    std::vector<uint32_t> _dates; // offsets in _strings
+    std::vector<std::array<char, 9>> _titleids;
+    std::vector<int64_t> _sizes;
+    std::vector<uint8_t> _regions;
+    std::string _strings;
+
+    // normalized name and original name of every row, separated by \0, so
+    // that a search is a single substring scan over the whole catalog
+    uint32_t _search_flags;
+    std::vector<uint32_t> _search_key_offsets;
+    std::string _search_keys;
+
+    // rows matching the current filter, in display order
+    std::vector<uint32_t> _view;
+    std::string _partition;
+
+    size_t _cache_budget;
+    size_t _cache_bytes = 0;
+    std::list<uint32_t> _lru; // most recently used first
+    struct CachedItem
+    {
+        std::unique_ptr<DbItem> item;
+        std::list<uint32_t>::iterator lru;
+        size_t bytes;
+    };
+    std::unordered_map<uint32_t, CachedItem> _cache;
+
+    std::string list_path(Mode mode) const;
+    void close_rows();
+    void ingest(Mode mode);
+    DbItem* materialize(uint32_t row);
+    void evict();
+    void clear_cache();
+    const char* string_at(uint32_t offset) const
+    {
+        return _strings.data() + offset;
+    }
 };
 
 GameRegion pkgi_get_region(const std::string& titleid);
+
+// Title list helpers shared by the backends
+
+const char* pkgi_mode_to_file_name(Mode mode);
+
+// Downloads the list of a mode to tmppath. Returns false without downloading
+// when the list has the same size as filepath.
+bool pkgi_download_title_list(
+        const std::string& tmppath,
+        const std::string& filepath,
+        Http* http,
+        const std::string& update_url,
+        std::atomic<uint32_t>* db_size,
+        std::atomic<uint32_t>* db_total);
+
+struct DbTitleRow
+{
+    // presence is unknown and the partition is empty
+    DbItem item;
+    // name without version suffixes, as it should be searched
+    const char* raw_name;
+    // one of the DbFilterRegion* bits, or 0
+    uint8_t region;
+};
+
+// Calls on_row for every valid row of a downloaded title list
+void pkgi_parse_title_list(
+        const std::string& path,
+        Mode mode,
+        const std::function<void(const DbTitleRow& row)>& on_row);
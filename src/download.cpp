@@ -3,6 +3,7 @@
 #include "file.hpp"
 #include "log.hpp"
 #include "pkgi.hpp"
+#include "taskpool.hpp"
 #include "utils.hpp"
 
 #include <fmt/format.h>
@@ -11,6 +12,7 @@
 
 #include <cereal/archives/binary.hpp>
 
+#include <deque>
 #include <fstream>
 
 #include <cstddef>
@@ -390,6 +392,9 @@ void Download::download_data(
 
     update_progress();
 
+    if (tuner)
+        _http->set_max_connections(tuner->connections());
+
     if (!*_http)
     {
         LOGF("requesting {} @ {}", download_url, download_offset);
@@ -455,12 +460,13 @@ void Download::skip_to_file_offset(uint64_t to_offset)
         throw DownloadError(
                 fmt::format("无法向后寻找至 {}", to_offset));
 
-    std::vector<uint8_t> down(64 * 1024);
+    std::vector<uint8_t> down;
     while (encrypted_offset != to_offset)
     {
+        down.resize(tuner->chunk_size());
         const uint32_t read =
                 (uint32_t)min64(down.size(), to_offset - encrypted_offset);
-        download_data(down.data(), read, 1, 0);
+        tuner->measure(read, [&] { download_data(down.data(), read, 1, 0); });
 
         if ((encrypted_base + encrypted_offset - last_state_save) /
                     SAVE_PERIOD >=
@@ -652,12 +658,13 @@ int Download::download_head(const uint8_t* rif)
 
 void Download::download_file_content(uint64_t encrypted_size)
 {
-    std::vector<uint8_t> down(64 * 1024);
+    std::vector<uint8_t> down;
     while (encrypted_offset != encrypted_size)
     {
+        down.resize(tuner->chunk_size());
         const uint32_t read =
                 (uint32_t)min64(down.size(), encrypted_size - encrypted_offset);
-        download_data(down.data(), read, 1, 1);
+        tuner->measure(read, [&] { download_data(down.data(), read, 1, 1); });
 
         if ((encrypted_base + encrypted_offset - last_state_save) /
                     SAVE_PERIOD >=
@@ -723,6 +730,41 @@ void Download::download_file_content_to_iso(uint64_t item_size)
     for (auto& table : tables)
         download_data(table.data(), table.size(), 1, 0);
 
+    // blocks are decrypted and decompressed on the task pool while the next
+    // ones are downloaded, and written in order
+    struct Block
+    {
+        // the decoder may read past the end of the compressed data
+        std::vector<uint8_t> data = std::vector<uint8_t>(16 * ISO_SECTOR_SIZE);
+        uint32_t size;
+        TaskHandle task;
+    };
+    auto& pool = pkgi_task_pool();
+    const size_t max_blocks = 2 * pool.workers();
+    std::deque<std::unique_ptr<Block>> blocks;
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        // the tasks still use the blocks and the key
+        for (const auto& block : blocks)
+        {
+            try
+            {
+                block->task.join();
+            }
+            catch (...)
+            {
+            }
+        }
+    };
+
+    const auto write_block = [&] {
+        auto& block = *blocks.front();
+        block.task.join();
+        if (!pkgi_write(item_file, block.data.data(), block.size))
+            throw formatEx<DownloadError>("无法写入至 {}", item_path);
+        blocks.pop_front();
+    };
+
     for (uint32_t i = 0; i < block_count; i++)
     {
         auto const& table = tables[i];
@@ -740,48 +782,53 @@ void Download::download_file_content_to_iso(uint64_t item_size)
                     "ISO数据块大小/偏移量过大: {} > {}",
                     psar_offset + block_size,
                     item_size));
+        if (block_size > 16 * ISO_SECTOR_SIZE)
+            throw DownloadError("内部错误 - PKG文件可能已损坏! "
+                                "请重新下载");
+
+        if (blocks.size() == max_blocks)
+            write_block();
 
-        std::vector<uint8_t> data(16 * ISO_SECTOR_SIZE);
+        blocks.push_back(std::make_unique<Block>());
+        auto& block = *blocks.back();
+        block.size = block_size;
 
         uint64_t abs_offset = psar_offset + block_offset;
         skip_to_file_offset(abs_offset);
-        download_data(data.data(), block_size, 1, 0);
+        download_data(block.data.data(), block_size, 1, 0);
 
-        if ((block_flags & 4) == 0)
-        {
-            aes128_psp_decrypt(
-                    &psp_key,
-                    psp_iv,
-                    block_offset / 16,
-                    data.data(),
-                    block_size);
-        }
+        block.task = pool.submit([&, block_offset, block_flags, block = &block] {
+            if ((block_flags & 4) == 0)
+            {
+                aes128_psp_decrypt(
+                        &psp_key,
+                        psp_iv,
+                        block_offset / 16,
+                        block->data.data(),
+                        block->size);
+            }
+
+            if (block->size == iso_block * ISO_SECTOR_SIZE)
+                return;
 
-        if (block_size == iso_block * ISO_SECTOR_SIZE)
-        {
-            if (!pkgi_write(item_file, data.data(), block_size))
-                throw DownloadError(
-                        fmt::format("无法写入至 %s", item_path));
-        }
-        else
-        {
             std::vector<uint8_t> uncompressed(16 * ISO_SECTOR_SIZE);
             auto const out_size = lzrc_decompress(
                     uncompressed.data(),
                     uncompressed.size(),
-                    data.data(),
-                    block_size);
+                    block->data.data(),
+                    block->size);
             if (out_size != int(iso_block) * ISO_SECTOR_SIZE)
             {
                 throw DownloadError(
                         "内部错误 - PKG文件可能已损坏! "
                         "请重新下载");
             }
-            if (!pkgi_write(item_file, uncompressed.data(), out_size))
-                throw DownloadError(
-                        fmt::format("无法写入至 %s", item_path));
-        }
+            block->data = std::move(uncompressed);
+            block->size = out_size;
+        });
     }
+    while (!blocks.empty())
+        write_block();
 
     skip_to_file_offset(item_size);
 }
@@ -1174,41 +1221,92 @@ int Download::adjust_psm_files(void)
     return 1;
 }
 
-int Download::pkgi_download(
+void Download::start(
         const char* partition,
         const char* content,
         const char* url,
-        const uint8_t* rif,
-        const uint8_t* digest)
+        const uint8_t* rif)
 {
     root = fmt::format("{}pkgj/{}", partition, content);
     LOGF("temp installation folder: {}", root);
 
-    try
+    update_status("Downloading");
+    sha256_init(&sha);
+
+    resuming = false;
+    item_file = NULL;
+    item_index = 0;
+    last_state_save = 0;
+    download_size = 0;
+    download_offset = 0;
+    download_content = content;
+    download_url = url;
+
+    tuner = std::make_unique<ChunkTuner>("pkg", url);
+
+    info_start = pkgi_time_msec();
+    info_update = info_start + 1000;
+
+    deserialize_state();
+
+    if (!resuming)
     {
-        update_status("Downloading");
-        sha256_init(&sha);
+        pkgi_delete_dir(root);
+        download_head(rif);
+    }
+    prepared = true;
+}
 
-        resuming = false;
-        item_file = NULL;
-        item_index = 0;
-        last_state_save = 0;
-        download_size = 0;
-        download_offset = 0;
-        download_content = content;
-        download_url = url;
+void Download::drop_resume()
+{
+    LOGF("deleting resume file");
+    try
+    {
+        pkgi_rm(fmt::format("{}.resume", root).c_str());
+        pkgi_delete_dir(root);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to delete resume file");
+    }
+}
 
-        info_start = pkgi_time_msec();
-        info_update = info_start + 1000;
+void Download::prepare(
+        const char* partition,
+        const char* content,
+        const char* url,
+        const uint8_t* rif)
+{
+    try
+    {
+        start(partition, content, url, rif);
+    }
+    catch (const ResumeError& e)
+    {
+        drop_resume();
+        throw;
+    }
+    // download_data starts a new request at download_offset
+    _http->close();
+}
 
-        deserialize_state();
+int Download::pkgi_download(
+        const char* partition,
+        const char* content,
+        const char* url,
+        const uint8_t* rif,
+        const uint8_t* digest)
+{
+    try
+    {
+        if (!prepared)
+            start(partition, content, url, rif);
 
-        if (!resuming)
-            pkgi_delete_dir(root);
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            tuner->save();
+        };
 
-        if (!resuming)
-            if (!download_head(rif))
-                return 0;
         if (!download_files())
             return 0;
         if (!download_tail())
@@ -1261,16 +1359,7 @@ int Download::pkgi_download(
     }
     catch (const ResumeError& e)
     {
-        LOGF("deleting resume file");
-        try
-        {
-            pkgi_rm(fmt::format("{}.resume", root).c_str());
-            pkgi_delete_dir(root);
-        }
-        catch (const std::exception& e)
-        {
-            LOGF("failed to delete resume file");
-        }
+        drop_resume();
         throw;
     }
 }
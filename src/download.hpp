@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "aes128.hpp"
+#include "chunktuner.hpp"
 #include "http.hpp"
 #include "sha256.hpp"
 
@@ -62,12 +63,25 @@ public:
             const uint8_t* rif,
             const uint8_t* digest);
 
+    // The first step of pkgi_download: loads the resume data or downloads
+    // head.bin and checks it against rif, total_size is known afterwards. The
+    // connection is closed so that it is not held while the item waits, a
+    // following pkgi_download of the same item reopens it where the head
+    // ends. content and url must outlive the download.
+    void prepare(
+            const char* partition,
+            const char* content,
+            const char* url,
+            const uint8_t* rif);
+    bool prepared{false};
+
     // private:
     bool save_as_iso{false};
 
     std::string root;
 
     std::unique_ptr<Http> _http;
+    std::unique_ptr<ChunkTuner> tuner; // read size of the download
     const char* download_content;
     const char* download_url;
 
@@ -129,6 +143,13 @@ public:
     int create_psm_rif(const uint8_t* rif);
     int adjust_psm_files();
 
+    void start(
+            const char* partition,
+            const char* content,
+            const char* url,
+            const uint8_t* rif);
+    void drop_resume();
+
     void serialize_state() const;
     void deserialize_state();
 };
@@ -4,12 +4,17 @@
 #include "file.hpp"
 #include "filedownload.hpp"
 #include "install.hpp"
+#include "multisourcehttp.hpp"
+#include "queuejournal.hpp"
+#include "resuminghttp.hpp"
 #include "vitahttp.hpp"
 
 #include <fmt/format.h>
 
 #include <boost/scope_exit.hpp>
 
+#include <algorithm>
+
 std::string type_to_string(Type type)
 {
     switch (type)
@@ -36,18 +41,69 @@ std::string type_to_string(Type type)
     return "未知";
 }
 
+int install_rank(Type type)
+{
+    switch (type)
+    {
+    case Game:
+    case PsmGame:
+    case PsxGame:
+    case PspGame:
+        return 0;
+    case Patch:
+    case Dlc:
+    case PspDlc:
+        return 1;
+    case CompPackBase:
+        return 2;
+    case CompPackPatch:
+        return 3;
+    }
+    return 0;
+}
+
+std::string title_of(const DownloadItem& item)
+{
+    if (item.type == CompPackBase || item.type == CompPackPatch)
+        return item.content;
+    // UP0000-PCSE00000_00-0000000000000000
+    if (item.content.size() < 16)
+        return item.content;
+    return item.content.substr(7, 9);
+}
+
+// every download holds a connection of its own, the small lane too
+static_assert(
+        DownloadScheduler::MAX_SLOTS + 1 <= VitaHttp::DOWNLOAD_CONNECTIONS,
+        "the connection pool has no room for every download");
+
 Downloader::Downloader()
-    : _cond("downloader_cond"), _thread("downloader_thread", [this] { run(); })
+    : _cond("downloader_cond")
+    , _scheduler([](const std::string& partition) {
+        return pkgi_get_free_space(partition.c_str());
+    })
+    , _snapshot(std::make_shared<QueueSnapshot>())
 {
     LOG("new downloader");
+    for (size_t i = 0; i < DownloadScheduler::MAX_SLOTS + 1; ++i)
+        _threads.push_back(std::make_unique<Thread>(
+                fmt::format("downloader_thread_{}", i), [this] { run(); }));
+    _threads.push_back(std::make_unique<Thread>(
+            "downloader_installer", [this] { run_installs(); }));
+    _threads.push_back(std::make_unique<Thread>(
+            "downloader_prefetch", [this] { run_prefetch(); }));
 }
 
 Downloader::~Downloader()
 {
     LOG("destroying downloader");
-    _dying = true;
-    _cond.notify_one();
-    _thread.join();
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    for (const auto& thread : _threads)
+        thread->join();
     LOG("downloader destroyed");
 }
 
@@ -57,44 +113,109 @@ void Downloader::add(const DownloadItem& d)
     {
         ScopeLock _(_cond.get_mutex());
         _queue.push_back(d);
+        if (_journal)
+            _journal->added(d);
+        publish();
     }
-    _cond.notify_one();
+    // the installer and the prefetch wait on the same Cond as the workers
+    _cond.notify_all();
 }
 
-bool Downloader::is_in_queue(Type type, const std::string& contentid)
+void Downloader::restore(std::unique_ptr<QueueJournal> journal)
 {
-    ScopeLock _(_cond.get_mutex());
-    if (type == _current_download.type &&
-        contentid == _current_download.content)
-        return true;
+    {
+        ScopeLock _(_cond.get_mutex());
+        _journal = std::move(journal);
+        for (auto& item : _journal->load())
+        {
+            LOG("restoring download %s", item.name.c_str());
+            _queue.push_back(std::move(item));
+        }
+        publish();
+    }
+    _cond.notify_all();
+}
 
+void Downloader::set_slots(size_t slots)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _scheduler.set_slots(slots);
+    }
+    _cond.notify_all();
+}
+
+void Downloader::publish()
+{
+    auto snapshot = std::make_shared<QueueSnapshot>();
+    for (const auto& slot : _active)
+    {
+        snapshot->active.push_back({slot->item, slot->progress});
+        snapshot->_keys.emplace(slot->item.type, slot->item.content);
+    }
+    snapshot->queued = _queue.size();
     for (const auto& item : _queue)
-        if (item.type == type && item.content == contentid)
-            return true;
-    return false;
+        snapshot->_keys.emplace(item.type, item.content);
+    if (_installing)
+        snapshot->installing.push_back(_installing->item);
+    for (const auto& slot : _installs)
+        snapshot->installing.push_back(slot->item);
+    for (const auto& item : snapshot->installing)
+        snapshot->_keys.emplace(item.type, item.content);
+    std::atomic_store(
+            &_snapshot,
+            std::shared_ptr<const QueueSnapshot>(std::move(snapshot)));
+}
+
+std::shared_ptr<const QueueSnapshot> Downloader::snapshot() const
+{
+    return std::atomic_load(&_snapshot);
+}
+
+bool Downloader::is_in_queue(Type type, const std::string& contentid)
+{
+    return snapshot()->contains(type, contentid);
 }
 
 std::optional<DownloadItem> Downloader::get_current_download()
 {
-    ScopeLock _(_cond.get_mutex());
-    if (_current_download.content.empty())
+    const auto queue = snapshot();
+    if (queue->active.empty())
         return std::nullopt;
-    return _current_download;
+    return queue->active.front().item;
 }
 
 std::tuple<uint64_t, uint64_t> Downloader::get_current_download_progress()
 {
-    return {_download_offset.load(), _download_size.load()};
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    for (const auto& active : snapshot()->active)
+    {
+        offset += active.progress->offset;
+        size += active.progress->size;
+    }
+    return {offset, size};
 }
 
 void Downloader::remove_from_queue(Type type, const std::string& contentid)
 {
     ScopeLock _(_cond.get_mutex());
-    if (type == _current_download.type &&
-        contentid == _current_download.content)
-        _cancel_current = true;
-    else
-        _queue.erase(
+    for (const auto& slot : _active)
+        if (type == slot->item.type && contentid == slot->item.content)
+            slot->cancel = true;
+    _prefetched.erase(
+            std::remove_if(
+                    _prefetched.begin(),
+                    _prefetched.end(),
+                    [&](auto const& slot) {
+                        if (slot->item.type != type ||
+                            slot->item.content != contentid)
+                            return false;
+                        slot->cancel = true;
+                        return true;
+                    }),
+            _prefetched.end());
+    _queue.erase(
                 std::remove_if(
                         _queue.begin(),
                         _queue.end(),
@@ -103,71 +224,401 @@ void Downloader::remove_from_queue(Type type, const std::string& contentid)
                                    item.content == contentid;
                         }),
                 _queue.end());
+    // the downloaded files are kept and resumed if the item is added back,
+    // an install that started can't be stopped
+    _installs.erase(
+            std::remove_if(
+                    _installs.begin(),
+                    _installs.end(),
+                    [&](auto const& slot) {
+                        return slot->item.type == type &&
+                               slot->item.content == contentid;
+                    }),
+            _installs.end());
+    if (_journal)
+        _journal->removed(type, contentid);
+    publish();
+}
+
+std::shared_ptr<Downloader::Slot> Downloader::start_next()
+{
+    const auto now = pkgi_time_msec();
+    _scheduler.sample(now);
+    const auto find_prefetched = [&](const DownloadItem& item) {
+        return std::find_if(
+                _prefetched.begin(), _prefetched.end(), [&](const auto& slot) {
+                    return slot->item.type == item.type &&
+                           slot->item.content == item.content;
+                });
+    };
+    while (true)
+    {
+        const auto [it, lane] = _scheduler.pick(
+                _queue,
+                now,
+                [](const DownloadItem& item) {
+                    // compatibility packs are small, their size is not in the
+                    // list
+                    return item.type == CompPackBase ||
+                           item.type == CompPackPatch ||
+                           DownloadScheduler::is_small(item.size);
+                },
+                [&](const DownloadItem& item) {
+                    // its head is still being fetched, the prefetch thread
+                    // also fails it if it does not fit
+                    const auto prefetched = find_prefetched(item);
+                    return prefetched != _prefetched.end() &&
+                           (*prefetched)->prefetching;
+                });
+        if (it == _queue.end())
+            return nullptr;
+
+        const auto prefetched = find_prefetched(*it);
+        if (lane == DownloadScheduler::LaneNoSpace)
+        {
+            if (prefetched != _prefetched.end())
+                _prefetched.erase(prefetched);
+            LOG("no space left for %s", it->name.c_str());
+            auto failure = fmt::format(
+                    "{} 空间不足: 需要 {} MB, 可用 {} MB",
+                    it->partition,
+                    it->size / (1024 * 1024),
+                    _scheduler.available(it->partition) / (1024 * 1024));
+            if (_journal)
+                _journal->removed(it->type, it->content);
+            _rejected.emplace_back(std::move(*it), std::move(failure));
+            _queue.erase(it);
+            publish();
+            continue;
+        }
+
+        std::shared_ptr<Slot> slot;
+        if (prefetched != _prefetched.end())
+        {
+            slot = *prefetched;
+            _prefetched.erase(prefetched);
+        }
+        else
+        {
+            slot = std::make_shared<Slot>();
+            slot->item = std::move(*it);
+            slot->progress = std::make_shared<DownloadProgress>();
+        }
+        _queue.erase(it);
+        _scheduler.started(
+                lane, slot->item.partition, slot->item.size, slot->progress);
+        _active.push_back(slot);
+        publish();
+        return slot;
+    }
 }
 
 void Downloader::run()
 {
     while (true)
     {
-        DownloadItem item;
+        std::shared_ptr<Slot> slot;
+        std::vector<std::pair<DownloadItem, std::string>> rejected;
         {
             ScopeLock _(_cond.get_mutex());
+            while (!_dying && !(slot = start_next()) && _rejected.empty())
+            {
+                // held back items are looked at again once the throughput
+                // of the running downloads is measured
+                if (_queue.empty())
+                    _cond.wait();
+                else
+                    _cond.wait_for(DownloadScheduler::SAMPLE_PERIOD);
+            }
+            rejected.swap(_rejected);
+            if (!slot && rejected.empty())
+                return;
+        }
+
+        // reported without the mutex, error() may wait for the UI
+        for (const auto& reject : rejected)
+        {
+            error(reject.second);
+            refresh_item(reject.first);
+        }
+        if (!slot)
+            continue;
 
-            _current_download = {};
-            _cancel_current = false;
-            _download_offset = 0;
-            _download_size = 0;
+        // another item may fit in the small lane
+        _cond.notify_all();
+
+        bool downloaded = false;
+        try
+        {
+            downloaded = do_download(*slot);
+        }
+        catch (const std::exception& e)
+        {
+            LOG("download error: %s", e.what());
+            error(e.what());
+        }
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            _scheduler.finished(slot->progress.get());
+            _active.erase(std::find(_active.begin(), _active.end(), slot));
+            if (downloaded && !_dying)
+                _installs.push_back(slot);
+            // a canceled item was journaled by remove_from_queue
+            else if (!_dying && !slot->cancel && _journal)
+                _journal->removed(slot->item.type, slot->item.content);
+            publish();
+        }
+        _cond.notify_all();
+        if (!downloaded)
+            refresh_item(slot->item);
+    }
+}
+
+std::shared_ptr<Downloader::Slot> Downloader::next_prefetch()
+{
+    if (!_prefetched.empty())
+        return nullptr;
 
-            if (_dying)
+    const bool in_tail =
+            std::any_of(_active.begin(), _active.end(), [](const auto& slot) {
+                const uint64_t size = slot->progress->size;
+                const uint64_t offset = slot->progress->offset;
+                return size != 0 && offset <= size &&
+                       size - offset <= std::min(size / 10, PREFETCH_TAIL);
+            });
+    if (!in_tail)
+        return nullptr;
+
+    for (const auto& item : _queue)
+    {
+        if (item.type == CompPackBase || item.type == CompPackPatch)
+            continue;
+        auto slot = std::make_shared<Slot>();
+        slot->item = item;
+        slot->progress = std::make_shared<DownloadProgress>();
+        slot->prefetching = true;
+        _prefetched.push_back(slot);
+        return slot;
+    }
+    return nullptr;
+}
+
+void Downloader::run_prefetch()
+{
+    while (true)
+    {
+        std::shared_ptr<Slot> slot;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (!_dying && !(slot = next_prefetch()))
+                _cond.wait_for(PREFETCH_POLL);
+            if (!slot)
                 return;
-            else if (!_queue.empty())
+        }
+
+        std::string failure;
+        try
+        {
+            prefetch(*slot);
+        }
+        catch (const std::exception& e)
+        {
+            if (!slot->cancel && !_dying)
+                failure = e.what();
+        }
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            slot->prefetching = false;
+            const auto prefetched =
+                    std::find(_prefetched.begin(), _prefetched.end(), slot);
+            // removed from the queue meanwhile
+            if (prefetched == _prefetched.end())
+                continue;
+            const auto queued = std::find_if(
+                    _queue.begin(), _queue.end(), [&](const auto& item) {
+                        return item.type == slot->item.type &&
+                               item.content == slot->item.content;
+                    });
+            if (!failure.empty() || slot->cancel)
             {
-                item = _current_download = _queue.front();
-                _queue.pop_front();
+                _prefetched.erase(prefetched);
+                if (!failure.empty() && queued != _queue.end())
+                    _queue.erase(queued);
+                if (!failure.empty() && _journal)
+                    _journal->removed(slot->item.type, slot->item.content);
             }
-            else
+            else if (queued != _queue.end())
+                // the scheduler holds it back with its real size
+                queued->size = slot->item.size;
+            publish();
+        }
+        _cond.notify_all();
+
+        if (!failure.empty())
+        {
+            LOG("prefetch error: %s", failure.c_str());
+            error(failure);
+            refresh_item(slot->item);
+        }
+    }
+}
+
+void Downloader::prefetch(Slot& slot)
+{
+    const auto& item = slot.item;
+    ScopeProcessLock _;
+    LOG("prefetching %s", item.name.c_str());
+    make_download(slot);
+    slot.download->prepare(
+            item.partition.c_str(),
+            item.content.c_str(),
+            item.url.c_str(),
+            item.rif.empty() ? nullptr : item.rif.data());
+
+    const uint64_t total_size = slot.download->total_size;
+    const uint64_t offset = slot.download->download_offset;
+    if (total_size <= offset)
+        return;
+    uint64_t available;
+    {
+        ScopeLock _(_cond.get_mutex());
+        available = _scheduler.available(item.partition);
+    }
+    if (total_size - offset > available)
+        throw formatEx<DownloadError>(
+                "{} 空间不足: 需要 {} MB, 可用 {} MB",
+                item.partition,
+                (total_size - offset) / (1024 * 1024),
+                available / (1024 * 1024));
+    slot.item.size = total_size;
+    LOG("prefetch of %s done", item.name.c_str());
+}
+
+bool Downloader::waits_for_install(const DownloadItem& item) const
+{
+    const auto rank = install_rank(item.type);
+    const auto title = title_of(item);
+    const auto before = [&](const DownloadItem& other) {
+        return install_rank(other.type) < rank && title_of(other) == title;
+    };
+    for (const auto& other : _queue)
+        if (before(other))
+            return true;
+    for (const auto& slot : _active)
+        if (before(slot->item))
+            return true;
+    for (const auto& slot : _installs)
+        if (before(slot->item))
+            return true;
+    return false;
+}
+
+std::shared_ptr<Downloader::Slot> Downloader::next_install()
+{
+    for (auto it = _installs.begin(); it != _installs.end(); ++it)
+    {
+        if (waits_for_install((*it)->item))
+            continue;
+        auto slot = *it;
+        _installs.erase(it);
+        return slot;
+    }
+    return nullptr;
+}
+
+void Downloader::run_installs()
+{
+    while (true)
+    {
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (!_dying && !(_installing = next_install()))
                 _cond.wait();
+            if (!_installing)
+                return;
+            publish();
         }
 
         try
         {
-            if (!item.content.empty())
-                do_download(item);
+            do_install(_installing->item);
         }
         catch (const std::exception& e)
         {
-            LOG("download error: %s", e.what());
+            LOG("install error: %s", e.what());
             error(e.what());
         }
+
+        std::shared_ptr<Slot> slot;
+        {
+            ScopeLock _(_cond.get_mutex());
+            slot = std::move(_installing);
+            _installing = nullptr;
+            if (_journal)
+                _journal->completed(slot->item.type, slot->item.content);
+            publish();
+        }
+        // items of the same title may install now
+        _cond.notify_all();
+        refresh_item(slot->item);
     }
 }
 
-void Downloader::do_download_package(const DownloadItem& item)
+void Downloader::refresh_item(const DownloadItem& item)
 {
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
+    if (item.type == CompPackBase || item.type == CompPackPatch)
+        refresh("");
+    else
         refresh(item.content);
-    };
+}
+
+void Downloader::make_download(Slot& slot)
+{
+    const auto is_canceled = [this, &slot] { return slot.cancel || _dying; };
+    slot.download = std::make_unique<Download>(std::make_unique<ResumingHttp>(
+            std::make_unique<MultiSourceHttp>(
+                    [] { return std::make_unique<VitaHttp>(); },
+                    pkg_mirrors,
+                    &VitaHttp::spare_connections),
+            is_canceled));
+    slot.download->save_as_iso = slot.item.save_as_iso;
+    slot.download->update_progress_cb =
+            [progress = slot.progress](
+                    uint64_t download_offset, uint64_t download_size) {
+                progress->offset = download_offset;
+                progress->size = download_size;
+            };
+    slot.download->update_status = [](auto&&) {};
+    slot.download->is_canceled = is_canceled;
+}
 
+bool Downloader::do_download_package(Slot& slot)
+{
+    const auto& item = slot.item;
     ScopeProcessLock _;
     LOG("downloading %s", item.name.c_str());
-    auto download = std::make_unique<Download>(std::make_unique<VitaHttp>());
-    download->save_as_iso = item.save_as_iso;
-    download->update_progress_cb = [this](uint64_t download_offset,
-                                          uint64_t download_size) {
-        _download_offset = download_offset;
-        _download_size = download_size;
+    if (!slot.download)
+        make_download(slot);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        // closes the connection and the files
+        slot.download = nullptr;
     };
-    download->update_status = [](auto&&) {};
-    download->is_canceled = [this] { return _cancel_current || _dying; };
-    if (!download->pkgi_download(
+    if (!slot.download->pkgi_download(
                 item.partition.c_str(),
                 item.content.c_str(),
                 item.url.c_str(),
                 item.rif.empty() ? nullptr : item.rif.data(),
                 item.digest.empty() ? nullptr : item.digest.data()))
-        return;
+        return false;
     LOG("download of %s completed!", item.name.c_str());
+    return true;
+}
+
+void Downloader::do_install_package(const DownloadItem& item)
+{
     switch (item.type)
     {
     case Game:
@@ -204,39 +655,57 @@ void Downloader::do_download_package(const DownloadItem& item)
     LOG("install of %s completed!", item.name.c_str());
 }
 
-void Downloader::do_download_comppack(const DownloadItem& item)
+bool Downloader::do_download_comppack(const Slot& slot)
 {
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        refresh("");
-    };
-
+    const auto& item = slot.item;
     ScopeProcessLock _;
     LOGF("downloading comppack {}", item.url);
-    auto download =
-            std::make_unique<FileDownload>(std::make_unique<VitaHttp>());
+    const auto is_canceled = [this, &slot] { return slot.cancel || _dying; };
+    auto download = std::make_unique<FileDownload>(
+            std::make_unique<ResumingHttp>(
+                    std::make_unique<VitaHttp>(), is_canceled));
 
-    download->update_progress_cb = [this](uint64_t download_offset,
-                                          uint64_t download_size) {
-        _download_offset = download_offset;
-        _download_size = download_size;
-    };
-    download->is_canceled = [this] { return _cancel_current || _dying; };
+    download->update_progress_cb =
+            [progress = slot.progress](
+                    uint64_t download_offset, uint64_t download_size) {
+                progress->offset = download_offset;
+                progress->size = download_size;
+            };
+    download->is_canceled = is_canceled;
 
     download->download(
-            item.partition.c_str(), item.content.c_str(), item.url.c_str());
+            item.partition,
+            item.content,
+            item.type == CompPackPatch,
+            item.url);
     LOGF("download of comppack {} completed!", item.url);
+    return true;
+}
+
+void Downloader::do_install_comppack(const DownloadItem& item)
+{
     pkgi_install_comppack(
             item.partition, item.content, item.type == CompPackPatch, item.version);
-    pkgi_rm(fmt::format("{}pkgj/{}-comp.ppk", item.partition, item.content)
+    pkgi_rm(pkgi_comppack_temp_path(
+                    item.partition, item.content, item.type == CompPackPatch)
                     .c_str());
     LOG("install of %s completed!", item.name.c_str());
 }
 
-void Downloader::do_download(const DownloadItem& item)
+bool Downloader::do_download(Slot& slot)
 {
+    if (slot.item.type == CompPackBase || slot.item.type == CompPackPatch)
+        return do_download_comppack(slot);
+    else
+        return do_download_package(slot);
+}
+
+void Downloader::do_install(const DownloadItem& item)
+{
+    ScopeProcessLock _;
+    LOG("installing %s", item.name.c_str());
     if (item.type == CompPackBase || item.type == CompPackPatch)
-        do_download_comppack(item);
+        do_install_comppack(item);
     else
-        do_download_package(item);
+        do_install_package(item);
 }
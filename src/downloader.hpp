@@ -2,13 +2,22 @@
 
 #include <atomic>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <string>
 #include <tuple>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "downloadscheduler.hpp"
 #include "thread.hpp"
 
+class Download;
+class QueueJournal;
+
 enum Type
 {
     Game,
@@ -37,10 +46,69 @@ struct DownloadItem
     std::string psx_path;
     // only used by compatibility packs
     std::string version;
+    // of the package, 0 when unknown
+    uint64_t size = 0;
 };
 
 std::string type_to_string(Type type);
 
+// Items of one title are installed from the lowest rank to the highest: the
+// game, then its patch and additional content, then the compatibility packs
+int install_rank(Type type);
+// the title id of the item, the compatibility packs are queued under it
+std::string title_of(const DownloadItem& item);
+
+// The queue of a Downloader at one point. A new snapshot is published on
+// every change of the queue and is never modified afterwards, so the UI can
+// read it without any lock.
+class QueueSnapshot
+{
+public:
+    struct Active
+    {
+        DownloadItem item;
+        std::shared_ptr<const DownloadProgress> progress;
+    };
+
+    // items being downloaded, oldest first
+    std::vector<Active> active;
+    // items waiting for their turn
+    size_t queued = 0;
+    // downloaded items, the one being installed first, then the ones
+    // waiting for it
+    std::vector<DownloadItem> installing;
+
+    // whether the item is queued, downloading or not installed yet
+    bool contains(Type type, const std::string& content) const
+    {
+        return _keys.find({type, content}) != _keys.end();
+    }
+
+private:
+    friend class Downloader;
+
+    using Key = std::pair<Type, std::string>;
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<std::string>()(key.second) ^ key.first;
+        }
+    };
+
+    std::unordered_set<Key, KeyHash> _keys;
+};
+
+// Downloads the queued items on a few threads, as many at once as its
+// DownloadScheduler allows. A downloaded item is handed to an installer
+// thread so that its slot takes the next item right away. Installs are done
+// one at a time and in the order of install_rank() among the items of a
+// title, a patch waits for the install of its game even if it was downloaded
+// first.
+//
+// Near the end of a download, the head of the next queued package is
+// fetched ahead on another thread, see prefetch().
 class Downloader
 {
 public:
@@ -54,30 +122,109 @@ public:
 
     void add(const DownloadItem& d);
     void remove_from_queue(Type type, const std::string& contentid);
+
+    // queues the items left in the journal, which then records every change
+    // of the queue so that it is restored on the next start. The callbacks
+    // and mirrors must be set before.
+    void restore(std::unique_ptr<QueueJournal> journal);
+
+    // downloads in the regular lane, see DownloadScheduler::set_slots
+    void set_slots(size_t slots);
+
+    // the last published state of the queue, take it once per frame rather
+    // than calling the helpers below for every row
+    std::shared_ptr<const QueueSnapshot> snapshot() const;
+
     bool is_in_queue(Type type, const std::string& titleid);
+    // the oldest running download
     std::optional<DownloadItem> get_current_download();
+    // of all the running downloads together
     std::tuple<uint64_t, uint64_t> get_current_download_progress();
 
+    // called on the downloader threads
     std::function<void(const std::string& content)> refresh;
     std::function<void(const std::string& error)> error;
 
+    // tried alongside the url of every package, see MultiSourceHttp
+    std::vector<std::string> pkg_mirrors;
+
 private:
     using ScopeLock = std::lock_guard<Mutex>;
 
+    // a running download, then a downloaded item until it is installed
+    struct Slot
+    {
+        DownloadItem item;
+        std::shared_ptr<DownloadProgress> progress;
+        std::atomic<bool> cancel{false};
+        // of a package, made ahead by prefetch() or when the download
+        // starts. It points into item, which is never assigned afterwards.
+        std::unique_ptr<Download> download;
+        // while the prefetch thread works on download, under the mutex
+        bool prefetching = false;
+    };
+
+    // a download is in its tail for the last PREFETCH_TAIL bytes or its last
+    // tenth, whichever is smaller
+    static constexpr uint64_t PREFETCH_TAIL = 64 * 1024 * 1024;
+    // milliseconds between two looks at the running downloads
+    static constexpr uint32_t PREFETCH_POLL = 500;
+
     Cond _cond;
     std::deque<DownloadItem> _queue;
+    std::vector<std::shared_ptr<Slot>> _active;
+    DownloadScheduler _scheduler;
+    // downloaded items waiting for the installer, oldest first
+    std::deque<std::shared_ptr<Slot>> _installs;
+    std::shared_ptr<Slot> _installing;
+    // queued packages whose head was fetched ahead, at most one
+    std::vector<std::shared_ptr<Slot>> _prefetched;
+    // items turned down for lack of space by start_next(), with the error
+    // that run() reports
+    std::vector<std::pair<DownloadItem, std::string>> _rejected;
+    // items leave it once installed, when they fail or are removed, but not
+    // when the downloader stops
+    std::unique_ptr<QueueJournal> _journal;
 
-    DownloadItem _current_download;
-    bool _cancel_current = false;
-    std::atomic<uint64_t> _download_offset = 0;
-    std::atomic<uint64_t> _download_size = 0;
+    // read and written with the atomic functions of shared_ptr
+    std::shared_ptr<const QueueSnapshot> _snapshot;
 
-    Thread _thread;
-    bool _dying = false;
+    std::atomic<bool> _dying{false};
+    // one per slot, one for the small lane, the installer and the prefetch
+    std::vector<std::unique_ptr<Thread>> _threads;
 
     void run();
-    void do_download(const DownloadItem& item);
+    void run_installs();
+    void run_prefetch();
+    // with the mutex held, takes the first queued item the scheduler lets
+    // start and moves the ones that can't fit to _rejected
+    std::shared_ptr<Slot> start_next();
+    // with the mutex held, the first queued package once a running download
+    // is in its tail
+    std::shared_ptr<Slot> next_prefetch();
+    // downloads the head of the package and checks that it fits in the free
+    // space, so that a bad item fails before its turn and a good one starts
+    // right after the head
+    void prefetch(Slot& slot);
+    // with the mutex held, takes the oldest downloaded item that has nothing
+    // to wait for
+    std::shared_ptr<Slot> next_install();
+    // with the mutex held, whether an item of the same title that has to be
+    // installed before item is not installed yet
+    bool waits_for_install(const DownloadItem& item) const;
+    // with the mutex held, after every change of the queue
+    void publish();
+
+    void make_download(Slot& slot);
+    // whether the item was fully downloaded
+    bool do_download(Slot& slot);
+    bool do_download_package(Slot& slot);
+    bool do_download_comppack(const Slot& slot);
+
+    // calls refresh for the list the item is in
+    void refresh_item(const DownloadItem& item);
 
-    void do_download_package(const DownloadItem& item);
-    void do_download_comppack(const DownloadItem& item);
+    void do_install(const DownloadItem& item);
+    void do_install_package(const DownloadItem& item);
+    void do_install_comppack(const DownloadItem& item);
 };
@@ -0,0 +1,154 @@
+#include "downloadscheduler.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+
+DownloadScheduler::DownloadScheduler(FreeSpace free_space)
+    : _free_space(std::move(free_space))
+{
+}
+
+void DownloadScheduler::set_slots(size_t slots)
+{
+    if (slots == 0)
+        slots = DEFAULT_SLOTS;
+    _slots = std::min(slots, MAX_SLOTS);
+}
+
+size_t DownloadScheduler::count(Lane lane) const
+{
+    return std::count_if(
+            _running.begin(), _running.end(), [&](const auto& running) {
+                return running.lane == lane;
+            });
+}
+
+bool DownloadScheduler::downloads_to(const std::string& partition) const
+{
+    return std::any_of(
+            _running.begin(), _running.end(), [&](const auto& running) {
+                return running.partition == partition;
+            });
+}
+
+uint64_t DownloadScheduler::available(const std::string& partition) const
+{
+    uint64_t reserved = 0;
+    for (const auto& running : _running)
+    {
+        if (running.partition != partition)
+            continue;
+        const uint64_t offset = running.progress->offset;
+        if (running.size > offset)
+            reserved += running.size - offset;
+    }
+    const auto free = _free_space(partition);
+    return free > reserved ? free - reserved : 0;
+}
+
+uint64_t DownloadScheduler::throughput(size_t n, uint32_t now) const
+{
+    if (n >= sizeof(_measures) / sizeof(_measures[0]))
+        return 0;
+    const auto& measure = _measures[n];
+    if (!measure.done || now - measure.time > SAMPLE_TTL)
+        return 0;
+    return measure.throughput;
+}
+
+bool DownloadScheduler::pays_off(uint32_t now) const
+{
+    const auto current = throughput(_running.size(), now);
+    // what runs now must be measured first
+    if (current == 0)
+        return false;
+    const auto next = throughput(_running.size() + 1, now);
+    return next == 0 || next >= current * MIN_GAIN;
+}
+
+DownloadScheduler::Lane DownloadScheduler::admit(
+        const std::string& partition, uint64_t size, bool small, uint32_t now)
+{
+    if (size != 0 && size > available(partition))
+        return downloads_to(partition) ? LaneNone : LaneNoSpace;
+
+    const auto regular = count(LaneRegular);
+    if (regular < _slots && (regular == 0 || pays_off(now)))
+        return LaneRegular;
+    if (small && count(LaneSmall) == 0)
+        return LaneSmall;
+    return LaneNone;
+}
+
+void DownloadScheduler::started(
+        Lane lane,
+        const std::string& partition,
+        uint64_t size,
+        std::shared_ptr<const DownloadProgress> progress)
+{
+    _running.push_back(
+            Running{lane, partition, size, std::move(progress), 0, false});
+}
+
+void DownloadScheduler::finished(const DownloadProgress* progress)
+{
+    _running.erase(
+            std::remove_if(
+                    _running.begin(),
+                    _running.end(),
+                    [&](const auto& running) {
+                        return running.progress.get() == progress;
+                    }),
+            _running.end());
+}
+
+void DownloadScheduler::restart_window(uint32_t now)
+{
+    _window_running = _running.size();
+    _window_start = now;
+    _window_received = _received;
+    _window_valid = std::all_of(
+            _running.begin(), _running.end(), [](const auto& running) {
+                return running.has_counted;
+            });
+}
+
+void DownloadScheduler::sample(uint32_t now)
+{
+    for (auto& running : _running)
+    {
+        // the offset is only meaningful once the download knows its size
+        if (running.progress->size == 0)
+            continue;
+        const uint64_t offset = running.progress->offset;
+        if (running.has_counted && offset > running.counted)
+            _received += offset - running.counted;
+        running.counted = offset;
+        running.has_counted = true;
+    }
+
+    if (_running.size() != _window_running)
+    {
+        restart_window(now);
+        return;
+    }
+
+    const auto elapsed = now - _window_start;
+    if (elapsed < SAMPLE_PERIOD)
+        return;
+
+    if (_window_valid && _window_running != 0 &&
+        _window_running < sizeof(_measures) / sizeof(_measures[0]))
+    {
+        auto& measure = _measures[_window_running];
+        measure.throughput =
+                (_received - _window_received) * 1000 / elapsed;
+        measure.time = now;
+        measure.done = true;
+        LOGF("{} downloads: {} KB/s",
+             _window_running,
+             measure.throughput / 1024);
+    }
+    restart_window(now);
+}
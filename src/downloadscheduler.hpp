@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Bytes done of a download, updated while it runs
+struct DownloadProgress
+{
+    std::atomic<uint64_t> offset{0};
+    std::atomic<uint64_t> size{0};
+};
+
+// Decides when the queued items of a Downloader start. Up to slots() items
+// download at once in the regular lane. One more slot, the small lane, only
+// takes small items, so that they don't wait behind a big game.
+//
+// An item is held back when its size does not fit in the free space left by
+// the downloads of its partition. When nothing runs on the partition, waiting
+// frees nothing and the item is turned down instead.
+//
+// A regular slot is only filled while it pays off: the scheduler measures the
+// throughput of all the downloads together for every number of downloads it
+// runs, and starts one more only when that number was not measured yet or
+// gave MIN_GAIN more than the current one.
+// Downloads share the link per connection, like the transfers of different
+// applications do.
+//
+// Not thread safe, the Downloader calls it with its mutex held.
+class DownloadScheduler
+{
+public:
+    enum Lane
+    {
+        LaneNone,
+        LaneRegular,
+        LaneSmall,
+        // the item does not fit even with nothing else downloading to its
+        // partition
+        LaneNoSpace,
+    };
+
+    static constexpr size_t MAX_SLOTS = 3;
+    static constexpr size_t DEFAULT_SLOTS = 2;
+    // items up to this size may take the small lane
+    static constexpr uint64_t SMALL_ITEM_SIZE = 32 * 1024 * 1024;
+    // milliseconds of a throughput measurement
+    static constexpr uint32_t SAMPLE_PERIOD = 2000;
+    // milliseconds after which a measurement is redone
+    static constexpr uint32_t SAMPLE_TTL = 5 * 60 * 1000;
+    static constexpr double MIN_GAIN = 1.1;
+
+    using FreeSpace = std::function<uint64_t(const std::string& partition)>;
+
+    explicit DownloadScheduler(FreeSpace free_space);
+
+    // 0 for DEFAULT_SLOTS, at most MAX_SLOTS
+    void set_slots(size_t slots);
+    size_t slots() const
+    {
+        return _slots;
+    }
+
+    static bool is_small(uint64_t size)
+    {
+        return size != 0 && size <= SMALL_ITEM_SIZE;
+    }
+
+    // the lane an item can start in now, LaneNone when it has to wait. size
+    // is 0 when unknown, such an item always fits.
+    Lane admit(
+            const std::string& partition,
+            uint64_t size,
+            bool small,
+            uint32_t now);
+
+    // the first item of queue that can start now or that is turned down,
+    // with its lane. Items held back and the ones busy(item) is true for are
+    // passed over, small(item) tells whether one may take the small lane.
+    // queue.end() when there is none.
+    template <typename Queue, typename Small, typename Busy>
+    std::pair<typename Queue::iterator, Lane> pick(
+            Queue& queue, uint32_t now, Small small, Busy busy)
+    {
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            if (busy(*it))
+                continue;
+            const auto lane = admit(it->partition, it->size, small(*it), now);
+            if (lane != LaneNone)
+                return {it, lane};
+        }
+        return {queue.end(), LaneNone};
+    }
+
+    void started(
+            Lane lane,
+            const std::string& partition,
+            uint64_t size,
+            std::shared_ptr<const DownloadProgress> progress);
+    void finished(const DownloadProgress* progress);
+
+    // counts the bytes downloaded since the last call, to be called at least
+    // every SAMPLE_PERIOD while downloads run
+    void sample(uint32_t now);
+
+    // the free space of partition less what its running downloads still
+    // have to write
+    uint64_t available(const std::string& partition) const;
+
+    size_t running() const
+    {
+        return _running.size();
+    }
+
+    // bytes per second of n downloads together, 0 when not measured
+    uint64_t throughput(size_t n, uint32_t now) const;
+
+private:
+    struct Running
+    {
+        Lane lane;
+        std::string partition;
+        uint64_t size;
+        std::shared_ptr<const DownloadProgress> progress;
+        // offset at the last sample, the first one only sets it as a resumed
+        // download starts far from 0
+        uint64_t counted;
+        bool has_counted;
+    };
+
+    struct Measure
+    {
+        uint64_t throughput = 0;
+        uint32_t time = 0;
+        bool done = false;
+    };
+
+    FreeSpace _free_space;
+    size_t _slots = DEFAULT_SLOTS;
+    std::vector<Running> _running;
+
+    uint64_t _received = 0;
+    // the current measurement, restarted when the number of downloads changes
+    size_t _window_running = 0;
+    uint32_t _window_start = 0;
+    uint64_t _window_received = 0;
+    // whether every download had started when the measurement did
+    bool _window_valid = false;
+    Measure _measures[MAX_SLOTS + 2];
+
+    size_t count(Lane lane) const;
+    bool downloads_to(const std::string& partition) const;
+    bool pays_off(uint32_t now) const;
+    void restart_window(uint32_t now);
+};
@@ -1,5 +1,6 @@
 #include "extractzip.hpp"
 
+#include "chunktuner.hpp"
 #include "file.hpp"
 #include "pkgi.hpp"
 
@@ -19,6 +20,12 @@ void pkgi_extract_zip(const std::string& zip_file, const std::string& dest)
         zip_close(zip_fd);
     };
 
+    ChunkTuner tuner("extract", "", ChunkTuner::LOCAL);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        tuner.save();
+    };
+
     const auto num_entries = zip_get_num_entries(zip_fd, 0);
     for (auto i = 0; i < num_entries; ++i)
     {
@@ -65,16 +72,18 @@ void pkgi_extract_zip(const std::string& zip_file, const std::string& dest)
                 pkgi_close(out_fd);
             };
 
-            static constexpr auto READ_SIZE = 1 * 1024 * 1024;
-            std::vector<uint8_t> buffer(READ_SIZE);
+            std::vector<uint8_t> buffer;
 
             uint64_t pos = 0;
             while (pos < stat.size)
             {
+                buffer.resize(tuner.chunk_size());
                 const auto to_read =
                         std::min<uint64_t>(buffer.size(), stat.size - pos);
+                const auto start = ChunkTuner::now_usec();
                 const auto readed = zip_fread(comp_fd, buffer.data(), to_read);
                 pkgi_write(out_fd, buffer.data(), readed);
+                tuner.record(readed, ChunkTuner::now_usec() - start);
                 pos += readed;
             }
         }
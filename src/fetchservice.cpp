@@ -0,0 +1,141 @@
+#include "fetchservice.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+
+FetchService::FetchService(size_t workers, HttpFactory make_http)
+    : _make_http(std::move(make_http)), _cond("fetch_service_cond")
+{
+    for (size_t i = 0; i < workers; ++i)
+        _threads.push_back(std::make_unique<Thread>(
+                fmt::format("fetch_worker_{}", i), [this] { run(); }));
+}
+
+FetchService::~FetchService()
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        _dying = true;
+        _queue.clear();
+        for (const auto& job : _jobs)
+        {
+            job.second->_canceled = true;
+            if (job.second->_http)
+                job.second->_http->abort();
+        }
+    }
+    for (size_t i = 0; i < _threads.size(); ++i)
+        _cond.notify_one();
+    for (const auto& thread : _threads)
+        thread->join();
+}
+
+std::shared_ptr<FetchJob> FetchService::acquire(
+        const std::string& key,
+        int priority,
+        const std::function<std::shared_ptr<FetchJob>()>& make_job)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        const auto it = _jobs.find(key);
+        if (it != _jobs.end())
+        {
+            auto& job = it->second;
+            ++job->_handles;
+            job->_priority = std::max(job->_priority, priority);
+            return job;
+        }
+    }
+
+    // built outside of the lock, jobs may do some work in their constructor
+    auto job = make_job();
+    job->_key = key;
+    job->_priority = priority;
+    job->_handles = 1;
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        // another thread may have queued the same key in the meantime
+        const auto it = _jobs.find(key);
+        if (it != _jobs.end())
+        {
+            ++it->second->_handles;
+            it->second->_priority = std::max(it->second->_priority, priority);
+            return it->second;
+        }
+        job->_sequence = _sequence++;
+        _jobs.emplace(key, job);
+        _queue.push_back(job);
+    }
+    _cond.notify_one();
+    return job;
+}
+
+void FetchService::release(FetchJob* job)
+{
+    ScopeLock _(_cond.get_mutex());
+    if (--job->_handles != 0)
+        return;
+
+    LOGF("canceling fetch {}", job->_key);
+    job->_canceled = true;
+    if (job->_http)
+        job->_http->abort();
+    _queue.erase(
+            std::remove_if(
+                    _queue.begin(),
+                    _queue.end(),
+                    [&](const auto& queued) { return queued.get() == job; }),
+            _queue.end());
+    _jobs.erase(job->_key);
+}
+
+std::shared_ptr<FetchJob> FetchService::pop()
+{
+    const auto best = std::max_element(
+            _queue.begin(), _queue.end(), [](const auto& a, const auto& b) {
+                if (a->_priority != b->_priority)
+                    return a->_priority < b->_priority;
+                return a->_sequence > b->_sequence;
+            });
+    auto job = std::move(*best);
+    _queue.erase(best);
+    return job;
+}
+
+void FetchService::run()
+{
+    while (true)
+    {
+        std::shared_ptr<FetchJob> job;
+        {
+            ScopeLock _(_cond.get_mutex());
+            while (!_dying && _queue.empty())
+                _cond.wait();
+            if (_dying)
+                return;
+            job = pop();
+        }
+
+        auto http = job->wrap_http(_make_http());
+        {
+            ScopeLock _(_cond.get_mutex());
+            if (job->_canceled)
+                continue;
+            job->_http = http.get();
+        }
+
+        try
+        {
+            job->run(http.get());
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("fetch {} failed: {}", job->_key, e.what());
+        }
+
+        ScopeLock _(_cond.get_mutex());
+        job->_http = nullptr;
+    }
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "http.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+class FetchService;
+
+// Work queued on the FetchService. Subclasses keep their result behind their
+// own lock, it is read from the UI thread through the handles.
+class FetchJob
+{
+public:
+    virtual ~FetchJob() = default;
+
+    // set once every handle to the job is gone, long jobs should stop early
+    bool is_canceled() const
+    {
+        return _canceled;
+    }
+
+protected:
+    // runs on a worker, http is not started yet
+    virtual void run(Http* http) = 0;
+
+    // lets a job put a decorator around the worker's Http
+    virtual std::unique_ptr<Http> wrap_http(std::unique_ptr<Http> http)
+    {
+        return http;
+    }
+
+private:
+    friend class FetchService;
+
+    std::string _key;
+    int _priority = 0;
+    uint64_t _sequence = 0;
+    unsigned _handles = 0;
+    std::atomic<bool> _canceled{false};
+    // set while the job runs, to abort it
+    Http* _http = nullptr;
+};
+
+// Shares the result of a job. Destroying the last handle of a job cancels it:
+// it is removed from the queue, or aborted if it is running.
+template <typename Job>
+class FetchHandle
+{
+public:
+    FetchHandle() = default;
+    FetchHandle(FetchService* service, std::shared_ptr<Job> job)
+        : _service(service), _job(std::move(job))
+    {
+    }
+    FetchHandle(const FetchHandle&) = delete;
+    FetchHandle& operator=(const FetchHandle&) = delete;
+    FetchHandle(FetchHandle&& other)
+        : _service(other._service), _job(std::move(other._job))
+    {
+    }
+    FetchHandle& operator=(FetchHandle&& other)
+    {
+        reset();
+        _service = other._service;
+        _job = std::move(other._job);
+        return *this;
+    }
+    ~FetchHandle()
+    {
+        reset();
+    }
+
+    void reset();
+
+    Job* operator->() const
+    {
+        return _job.get();
+    }
+
+    explicit operator bool() const
+    {
+        return static_cast<bool>(_job);
+    }
+
+private:
+    FetchService* _service = nullptr;
+    std::shared_ptr<Job> _job;
+};
+
+// A few worker threads that run fetch jobs, highest priority first. Jobs are
+// deduplicated by key: fetching a key that is still queued, running or held
+// by a handle shares the existing job instead of starting a new one.
+class FetchService
+{
+public:
+    static constexpr int PriorityLow = 0;
+    static constexpr int PriorityNormal = 1;
+    static constexpr int PriorityHigh = 2;
+
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+
+    FetchService(const FetchService&) = delete;
+    FetchService(FetchService&&) = delete;
+    FetchService& operator=(const FetchService&) = delete;
+    FetchService& operator=(FetchService&&) = delete;
+
+    FetchService(size_t workers, HttpFactory make_http);
+    ~FetchService();
+
+    // make_job is only called when no job with this key exists. The key must
+    // always map to the same Job type.
+    template <typename Job, typename MakeJob>
+    FetchHandle<Job> fetch(const std::string& key, int priority, MakeJob make_job)
+    {
+        auto job = acquire(key, priority, [&]() -> std::shared_ptr<FetchJob> {
+            return make_job();
+        });
+        return FetchHandle<Job>(this, std::static_pointer_cast<Job>(job));
+    }
+
+private:
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    template <typename Job>
+    friend class FetchHandle;
+
+    HttpFactory _make_http;
+
+    Cond _cond;
+    // a handful of jobs at most, scanned for the best one
+    std::vector<std::shared_ptr<FetchJob>> _queue;
+    std::unordered_map<std::string, std::shared_ptr<FetchJob>> _jobs;
+    uint64_t _sequence = 0;
+    bool _dying = false;
+
+    std::vector<std::unique_ptr<Thread>> _threads;
+
+    std::shared_ptr<FetchJob> acquire(
+            const std::string& key,
+            int priority,
+            const std::function<std::shared_ptr<FetchJob>()>& make_job);
+    void release(FetchJob* job);
+    std::shared_ptr<FetchJob> pop();
+    void run();
+};
+
+template <typename Job>
+void FetchHandle<Job>::reset()
+{
+    if (!_job)
+        return;
+    _service->release(_job.get());
+    _job = nullptr;
+}
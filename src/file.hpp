@@ -25,6 +25,8 @@ void pkgi_rename(const std::string& from, const std::string& to);
 void* pkgi_create(const std::string& path);
 // open existing file in read/write, fails if file does not exist
 void* pkgi_openrw(const char* path);
+// open existing file read-only, fails if file does not exist
+void* pkgi_open(const char* path);
 // open file for writing, next write will append data to end of it
 void* pkgi_append(const char* path);
 
@@ -1,8 +1,11 @@
 #include "filedownload.hpp"
 #include "download.hpp"
 
+#include "chunktuner.hpp"
+
 #include "file.hpp"
 #include "pkgi.hpp"
+#include "ringbuffer.hpp"
 #include "utils.hpp"
 
 #include <fmt/format.h>
@@ -37,7 +40,7 @@ void FileDownload::start_download()
     LOGF("http response length = {}", download_size);
 }
 
-void FileDownload::download_data(uint32_t size)
+void FileDownload::download_data(uint8_t* buffer, uint32_t size)
 {
     if (is_canceled())
         throw std::runtime_error("下载已被取消");
@@ -47,21 +50,16 @@ void FileDownload::download_data(uint32_t size)
 
     update_progress();
 
-    std::vector<uint8_t> buffer(size);
+    size_t pos = 0;
+    while (pos < size)
     {
-        size_t pos = 0;
-        while (pos < size)
-        {
-            const int read = _http->read(buffer.data() + pos, size - pos);
-            if (read == 0)
-                throw DownloadError("HTTP连接已断开");
-            pos += read;
-        }
+        const int read = _http->read(buffer + pos, size - pos);
+        if (read == 0)
+            throw DownloadError("HTTP连接已断开");
+        pos += read;
     }
 
     download_offset += size;
-
-    pkgi_write(item_file, buffer.data(), buffer.size());
 }
 
 void FileDownload::download_file()
@@ -78,24 +76,75 @@ void FileDownload::download_file()
         pkgi_close(item_file);
     };
 
-    start_download();
+    ChunkTuner tuner("comppack", download_url);
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        tuner.save();
+    };
 
-    static constexpr auto SAVE_PERIOD = 64 * 1024;
+    _http->set_max_connections(tuner.connections());
+    start_download();
 
-    while (download_offset < download_size)
+    // the file is written on another thread while the next chunks download
+    BufferPipe<> pipe(WRITE_BUFFERS, tuner.chunk_size());
+    std::string write_error;
     {
-        const uint32_t read =
-                (uint32_t)min64(SAVE_PERIOD, download_size - download_offset);
-        download_data(read);
+        Thread writer("comppack_writer", [&] {
+            try
+            {
+                while (const auto buffer = pipe.receive())
+                {
+                    pkgi_write(item_file, buffer->data.data(), buffer->size);
+                    pipe.release(buffer);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                write_error = e.what();
+                pipe.cancel();
+            }
+        });
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            pipe.finish();
+            writer.join();
+        };
+
+        while (download_offset < download_size)
+        {
+            const auto buffer = pipe.acquire();
+            if (!buffer)
+                break;
+            const uint32_t read = (uint32_t)min64(
+                    tuner.chunk_size(), download_size - download_offset);
+            if (buffer->data.size() < read)
+                buffer->data.resize(read);
+            buffer->size = read;
+            tuner.measure(
+                    read, [&] { download_data(buffer->data.data(), read); });
+            _http->set_max_connections(tuner.connections());
+            if (!pipe.send(buffer))
+                break;
+        }
     }
+    if (!write_error.empty())
+        throw DownloadError(write_error);
+}
+
+std::string pkgi_comppack_temp_path(
+        const std::string& partition, const std::string& titleid, bool patch)
+{
+    return fmt::format(
+            "{}pkgj/{}-comp{}.ppk", partition, titleid, patch ? "-patch" : "");
 }
 
 void FileDownload::download(
         const std::string& partition,
         const std::string& titleid,
+        bool patch,
         const std::string& url)
 {
-    root = fmt::format("{}pkgj/{}-comp.ppk", partition, titleid);
+    root = pkgi_comppack_temp_path(partition, titleid, patch);
     LOGF("temp installation folder: {}", root);
 
     download_size = 0;
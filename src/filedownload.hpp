@@ -9,6 +9,11 @@
 
 #include "http.hpp"
 
+// where the compatibility pack of titleid is downloaded to. The base and patch
+// packs of a title have their own file, they may download at the same time.
+std::string pkgi_comppack_temp_path(
+        const std::string& partition, const std::string& titleid, bool patch);
+
 class FileDownload
 {
 public:
@@ -21,9 +26,13 @@ public:
     void download(
             const std::string& partition,
             const std::string& titleid,
+            bool patch,
             const std::string& url);
 
 private:
+    // chunks downloaded ahead of the writes
+    static constexpr size_t WRITE_BUFFERS = 4;
+
     std::string root;
 
     std::unique_ptr<Http> _http;
@@ -36,6 +45,6 @@ private:
     void update_progress();
 
     void start_download();
-    void download_data(uint32_t size);
+    void download_data(uint8_t* buffer, uint32_t size);
     void download_file();
 };
@@ -19,6 +19,7 @@ constexpr unsigned GameViewHeight = VITA_HEIGHT * 0.8;
 GameView::GameView(
         const Config* config,
         Downloader* downloader,
+        FetchService* fetch_service,
         DbItem* item,
         std::optional<CompPackDatabase::Item> base_comppack,
         std::optional<CompPackDatabase::Item> patch_comppack)
@@ -27,8 +28,8 @@ GameView::GameView(
     , _item(item)
     , _base_comppack(base_comppack)
     , _patch_comppack(patch_comppack)
-    , _patch_info_fetcher(item->titleid)
-    , _image_fetcher(item)
+    , _patch_info_fetcher(*fetch_service, item->titleid)
+    , _image_fetcher(*fetch_service, item)
 {
     refresh();
 }
@@ -4,6 +4,7 @@
 #include "config.hpp"
 #include "db.hpp"
 #include "downloader.hpp"
+#include "fetchservice.hpp"
 #include "install.hpp"
 #include "patchinfofetcher.hpp"
 #include "imagefetcher.hpp"
@@ -16,6 +17,7 @@ public:
     GameView(
             const Config* config,
             Downloader* downloader,
+            FetchService* fetch_service,
             DbItem* item,
             std::optional<CompPackDatabase::Item> base_comppack,
             std::optional<CompPackDatabase::Item> patch_comppack);
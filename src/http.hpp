@@ -35,5 +35,21 @@ public:
     virtual int get_status() = 0;
     virtual int64_t get_length() = 0;
 
+    // extra header sent with the next start() only
+    virtual void add_request_header(
+            const std::string& /*name*/, const std::string& /*value*/)
+    {
+    }
+    // value of a header of the current response, empty when absent
+    virtual std::string get_response_header(const std::string& /*name*/)
+    {
+        return {};
+    }
+    // most connections a transfer split in segments uses at once, 0 for no
+    // limit, may change while it runs
+    virtual void set_max_connections(unsigned /*connections*/)
+    {
+    }
+
     virtual explicit operator bool() const = 0;
 };
@@ -54,34 +54,28 @@ std::string get_image_url(DbItem* item)
             pkgi_time_msec());
 }
 
-ImageFetcher::ImageFetcher(DbItem* item)
-    : _mutex("image_fetcher_mutex")
-    , _path(fmt::format("{}pkgj/cover/{}.jpg", item->partition, item->titleid))
-    , _url(get_image_url(item))
-    , _texture(nullptr)
-    , _thread("image_fetcher", [this] { do_request(); })
+ImageFetcher::ImageFetcher(FetchService& service, DbItem* item)
 {
     auto path = fmt::format("{}pkgj/cover", item->partition);
     pkgi_mkdirs(path.c_str());
+
+    // the url changes every time, the cover file identifies the image
+    const auto cover = fmt::format("{}/{}.jpg", path, item->titleid);
+    _job = service.fetch<Job>(
+            "cover:" + cover, FetchService::PriorityNormal, [&] {
+                return std::make_shared<Job>(cover, get_image_url(item));
+            });
 }
 
-ImageFetcher::~ImageFetcher()
+vita2d_texture* ImageFetcher::get_texture()
 {
-    Http* http;
-    {
-        std::lock_guard<Mutex> lock(_mutex);
-        _abort = true;
-        http = _http.get();
-    }
-    if (http)
-        http->abort();
-    _thread.join();
+    std::lock_guard<Mutex> lock(_job->mutex);
+    return _job->texture;
 }
 
-vita2d_texture* ImageFetcher::get_texture()
+ImageFetcher::Job::Job(std::string path, std::string url)
+    : mutex("image_fetcher_mutex"), _path(std::move(path)), _url(std::move(url))
 {
-    std::lock_guard<Mutex> lock(_mutex);
-    return _texture;
 }
 
 std::optional<std::vector<uint8_t>> download_data(
@@ -105,31 +99,26 @@ std::optional<std::vector<uint8_t>> download_data(
     return data;
 }
 
-void ImageFetcher::do_request()
+void ImageFetcher::Job::run(Http* http)
 {
     try
     {
         if (pkgi_file_exists(_path.c_str()))
         {
-            std::lock_guard<Mutex> lock(_mutex);
-            _texture = vita2d_load_JPEG_file(_path.c_str());
-            if (_texture) return;
-        }
-        {
-            std::lock_guard<Mutex> lock(_mutex);
-            if (_abort)
+            std::lock_guard<Mutex> lock(mutex);
+            texture = vita2d_load_JPEG_file(_path.c_str());
+            if (texture)
                 return;
-            _http = std::make_unique<VitaHttp>();
-        }
-        const auto image = download_data(_http.get(), _url);
-        {
-            std::lock_guard<Mutex> lock(_mutex);
-            if (image && !image->empty())
-                _texture = vita2d_load_JPEG_buffer(image->data(), image->size());
-            _http = nullptr;
         }
+        if (is_canceled())
+            return;
+        const auto image = download_data(http, _url);
         if (image && !image->empty())
         {
+            {
+                std::lock_guard<Mutex> lock(mutex);
+                texture = vita2d_load_JPEG_buffer(image->data(), image->size());
+            }
             auto image_file = pkgi_create(_path.c_str());
             pkgi_write(image_file, image->data(), image->size());
             pkgi_close(image_file);
@@ -137,8 +126,6 @@ void ImageFetcher::do_request()
     }
     catch (const std::exception& e)
     {
-        LOGF("Failed to fetch patch info: {}", e.what());
-        std::lock_guard<Mutex> lock(_mutex);
-        _http = nullptr;
+        LOGF("Failed to fetch cover: {}", e.what());
     }
 }
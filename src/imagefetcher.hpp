@@ -1,6 +1,6 @@
 #pragma once
 
-#include "http.hpp"
+#include "fetchservice.hpp"
 #include "thread.hpp"
 
 #include <vita2d.h>
@@ -8,21 +8,26 @@
 class ImageFetcher
 {
 public:
-    ImageFetcher(DbItem *item);
-    ~ImageFetcher();
+    ImageFetcher(FetchService& service, DbItem* item);
 
     vita2d_texture* get_texture();
 
 private:
-    Mutex _mutex;
+    class Job : public FetchJob
+    {
+    public:
+        Job(std::string path, std::string url);
 
-    std::string _path;
-    std::string _url;
-    bool _abort{false};
-    std::unique_ptr<Http> _http;
-    vita2d_texture* _texture;
+        Mutex mutex;
+        vita2d_texture* texture{nullptr};
 
-    Thread _thread;
+    protected:
+        void run(Http* http) override;
 
-    void do_request();
+    private:
+        std::string _path;
+        std::string _url;
+    };
+
+    FetchHandle<Job> _job;
 };
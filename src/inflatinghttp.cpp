@@ -0,0 +1,198 @@
+#include "inflatinghttp.hpp"
+
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+
+#include <strings.h>
+
+namespace
+{
+std::atomic<uint64_t> g_received{0};
+std::atomic<uint64_t> g_inflated{0};
+
+// 15 bits of window, +32 detects a zlib or a gzip header
+constexpr int AUTO_WINDOW_BITS = 15 + 32;
+constexpr int RAW_WINDOW_BITS = -15;
+
+bool is_hidden_header(const std::string& name)
+{
+    return strcasecmp(name.c_str(), "Content-Length") == 0 ||
+           strcasecmp(name.c_str(), "Content-Encoding") == 0;
+}
+}
+
+InflatingHttp::InflatingHttp(std::unique_ptr<Http> http)
+    : _http(std::move(http))
+{
+}
+
+InflatingHttp::~InflatingHttp()
+{
+    end();
+}
+
+InflatingHttp::Stats InflatingHttp::stats()
+{
+    return Stats{g_received, g_inflated};
+}
+
+void InflatingHttp::start(const std::string& url, uint64_t offset, bool head)
+{
+    end();
+
+    // a range would apply to the compressed bytes
+    const bool compressible = !head && offset == 0;
+    if (compressible)
+        _http->add_request_header("Accept-Encoding", "gzip, deflate");
+    _http->start(url, offset, head);
+
+    if (!compressible)
+        return;
+
+    auto encoding = _http->get_response_header("Content-Encoding");
+    encoding.erase(0, encoding.find_first_not_of(" \t"));
+    encoding.erase(encoding.find_last_not_of(" \t") + 1);
+    if (encoding.empty() || strcasecmp(encoding.c_str(), "identity") == 0)
+        return;
+    begin(encoding);
+}
+
+void InflatingHttp::begin(const std::string& encoding)
+{
+    if (strcasecmp(encoding.c_str(), "gzip") == 0 ||
+        strcasecmp(encoding.c_str(), "x-gzip") == 0)
+        _deflate = false;
+    else if (strcasecmp(encoding.c_str(), "deflate") == 0)
+        _deflate = true;
+    else
+        throw formatEx<HttpError>("不支持的内容编码: {}", encoding);
+
+    LOGF("inflating {} response", encoding);
+
+    _stream = std::make_unique<z_stream_s>();
+    if (inflateInit2(_stream.get(), AUTO_WINDOW_BITS) != Z_OK)
+    {
+        _stream = nullptr;
+        throw HttpError("无法初始化解压");
+    }
+    _finished = false;
+    _input.resize(INPUT_SIZE);
+    _input_size = 0;
+    _received = 0;
+}
+
+void InflatingHttp::end()
+{
+    if (!_stream)
+        return;
+    inflateEnd(_stream.get());
+    _stream = nullptr;
+}
+
+// deflate is meant to be a zlib stream, but some servers send the raw deflate
+// data. Only possible while the first input buffer is still at hand.
+bool InflatingHttp::retry_raw()
+{
+    if (!_deflate || _stream->total_out != 0 || _received != _input_size)
+        return false;
+    _deflate = false;
+    if (inflateReset2(_stream.get(), RAW_WINDOW_BITS) != Z_OK)
+        return false;
+    LOG("deflate response has no zlib header, inflating it raw");
+    _stream->next_in = _input.data();
+    _stream->avail_in = _input_size;
+    return true;
+}
+
+int64_t InflatingHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (!_stream)
+        return _http->read(buffer, size);
+
+    if (size == 0 || _finished)
+        return 0;
+
+    const auto avail = static_cast<uInt>(std::min<uint64_t>(size, UINT_MAX));
+    _stream->next_out = buffer;
+    _stream->avail_out = avail;
+
+    // a read returns 0 only at the end, wait for some output
+    while (_stream->avail_out == avail)
+    {
+        if (_stream->avail_in == 0)
+        {
+            const auto read = _http->read(_input.data(), _input.size());
+            if (read == 0)
+                throw HttpError("压缩数据不完整");
+            g_received += read;
+            _received += read;
+            _input_size = read;
+            _stream->next_in = _input.data();
+            _stream->avail_in = read;
+        }
+
+        const int err = inflate(_stream.get(), Z_NO_FLUSH);
+        if (err == Z_STREAM_END)
+        {
+            _finished = true;
+            break;
+        }
+        if (err == Z_DATA_ERROR && retry_raw())
+            continue;
+        if (err != Z_OK && err != Z_BUF_ERROR)
+            throw formatEx<HttpError>(
+                    "解压失败: {}", _stream->msg ? _stream->msg : "");
+    }
+
+    const auto inflated = avail - _stream->avail_out;
+    g_inflated += inflated;
+    return inflated;
+}
+
+void InflatingHttp::abort()
+{
+    _http->abort();
+}
+
+void InflatingHttp::close()
+{
+    end();
+    _http->close();
+}
+
+int InflatingHttp::get_status()
+{
+    return _http->get_status();
+}
+
+int64_t InflatingHttp::get_length()
+{
+    // still asked to the wrapped Http, it checks the status
+    const auto length = _http->get_length();
+    return _stream ? 0 : length;
+}
+
+void InflatingHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _http->add_request_header(name, value);
+}
+
+std::string InflatingHttp::get_response_header(const std::string& name)
+{
+    if (_stream && is_hidden_header(name))
+        return {};
+    return _http->get_response_header(name);
+}
+
+InflatingHttp::operator bool() const
+{
+    return static_cast<bool>(*_http);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+struct z_stream_s;
+
+// Asks for a gzip or deflate Content-Encoding on plain GET requests and
+// inflates the response as it is read, so that the caller still sees the
+// bytes of the file. HEAD and ranged requests are sent without
+// Accept-Encoding: their length and offsets are those of the file itself.
+//
+// While a response is inflated its length is unknown, get_length() returns 0
+// and the Content-Length and Content-Encoding headers are hidden.
+class InflatingHttp : public Http
+{
+public:
+    static constexpr size_t INPUT_SIZE = 16 * 1024;
+
+    struct Stats
+    {
+        // bytes received for compressed responses
+        uint64_t received;
+        // bytes these responses inflated to
+        uint64_t inflated;
+    };
+
+    InflatingHttp(std::unique_ptr<Http> http);
+    ~InflatingHttp();
+
+    void start(const std::string& url, uint64_t offset, bool head = false) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+    void close() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
+    explicit operator bool() const override;
+
+    // counted over all instances
+    static Stats stats();
+
+private:
+    std::unique_ptr<Http> _http;
+
+    // set while the response is being inflated
+    std::unique_ptr<z_stream_s> _stream;
+    // the server said deflate, it may mean a raw deflate stream
+    bool _deflate = false;
+    bool _finished = false;
+    std::vector<uint8_t> _input;
+    size_t _input_size = 0;
+    uint64_t _received = 0;
+
+    void begin(const std::string& encoding);
+    void end();
+    bool retry_raw();
+};
@@ -2,6 +2,7 @@
 
 #include "extractzip.hpp"
 #include "file.hpp"
+#include "filedownload.hpp"
 #include "log.hpp"
 #include "sfo.hpp"
 #include "sqlite.hpp"
@@ -110,7 +111,7 @@ void pkgi_install_update(const std::string& partition, const std::string& titlei
 void pkgi_install_comppack(
         const std::string& partition, const std::string& titleid, bool patch, const std::string& version)
 {
-    const auto src = fmt::format("{}pkgj/{}-comp.ppk", partition, titleid);
+    const auto src = pkgi_comppack_temp_path(partition, titleid, patch);
     const auto dest = fmt::format("{}rePatch/{}", partition, titleid);
 
     if (!patch)
@@ -0,0 +1,155 @@
+#include "lockstats.hpp"
+
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace
+{
+void store_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+    auto current = max.load(std::memory_order_relaxed);
+    while (current < value &&
+           !max.compare_exchange_weak(
+                   current, value, std::memory_order_relaxed))
+        ;
+}
+
+// Mutex can't be used here, it reports to the registry
+class SpinLock
+{
+public:
+    void lock()
+    {
+        while (_flag.test_and_set(std::memory_order_acquire))
+            ;
+    }
+
+    void unlock()
+    {
+        _flag.clear(std::memory_order_release);
+    }
+
+private:
+    std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+};
+
+struct Registry
+{
+    SpinLock lock;
+    std::vector<std::unique_ptr<LockStats>> stats;
+};
+
+Registry& registry()
+{
+    // never destroyed, see LockStats::get
+    static auto registry = new Registry;
+    return *registry;
+}
+}
+
+void LockStats::acquired(bool contended, uint64_t waited_us)
+{
+    acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (!contended)
+        return;
+    contentions.fetch_add(1, std::memory_order_relaxed);
+    wait_us.fetch_add(waited_us, std::memory_order_relaxed);
+    store_max(max_wait_us, waited_us);
+}
+
+void LockStats::released(uint64_t held_us)
+{
+    hold_us.fetch_add(held_us, std::memory_order_relaxed);
+    store_max(max_hold_us, held_us);
+}
+
+void LockStats::cond_waited(uint64_t waited_us)
+{
+    cond_waits.fetch_add(1, std::memory_order_relaxed);
+    cond_wait_us.fetch_add(waited_us, std::memory_order_relaxed);
+}
+
+LockStats& LockStats::get(const std::string& name)
+{
+    auto& reg = registry();
+    reg.lock.lock();
+    auto it = std::find_if(
+            reg.stats.begin(), reg.stats.end(), [&](const auto& stats) {
+                return stats->name == name;
+            });
+    if (it == reg.stats.end())
+    {
+        reg.stats.push_back(std::make_unique<LockStats>());
+        reg.stats.back()->name = name;
+        it = reg.stats.end() - 1;
+    }
+    auto& stats = **it;
+    reg.lock.unlock();
+    return stats;
+}
+
+uint64_t LockStats::now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+std::string LockStats::summary()
+{
+    auto& reg = registry();
+    std::vector<const LockStats*> stats;
+    reg.lock.lock();
+    for (const auto& entry : reg.stats)
+        if (entry->acquisitions != 0)
+            stats.push_back(entry.get());
+    reg.lock.unlock();
+
+    std::sort(stats.begin(), stats.end(), [](const auto* a, const auto* b) {
+        return a->wait_us > b->wait_us;
+    });
+
+    std::string result = fmt::format(
+            "{:<32} {:>10} {:>9} {:>10} {:>9} {:>10} {:>9} {:>8} {:>10}\n",
+            "lock",
+            "acquired",
+            "contended",
+            "wait ms",
+            "max wait",
+            "held ms",
+            "max held",
+            "waits",
+            "cond ms");
+    for (const auto* s : stats)
+        result += fmt::format(
+                "{:<32} {:>10} {:>9} {:>10.1f} {:>9.1f} {:>10.1f} {:>9.1f} "
+                "{:>8} {:>10.1f}\n",
+                s->name,
+                s->acquisitions.load(),
+                s->contentions.load(),
+                s->wait_us / 1000.0,
+                s->max_wait_us / 1000.0,
+                s->hold_us / 1000.0,
+                s->max_hold_us / 1000.0,
+                s->cond_waits.load(),
+                s->cond_wait_us / 1000.0);
+    return result;
+}
+
+void LockStats::dump()
+{
+    const auto table = summary();
+    size_t begin = 0;
+    while (begin < table.size())
+    {
+        const auto end = table.find('\n', begin);
+        LOGF("{}", table.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
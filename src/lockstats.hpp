@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include <cstdint>
+
+// How long the locks of a name were waited for and held. Mutex, Cond and
+// ScopeProcessLock only report here in builds with PKGI_ENABLE_LOCK_STATS.
+struct LockStats
+{
+    std::string name;
+
+    std::atomic<uint64_t> acquisitions{0};
+    // acquisitions that found the lock taken and had to wait
+    std::atomic<uint64_t> contentions{0};
+    std::atomic<uint64_t> wait_us{0};
+    std::atomic<uint64_t> max_wait_us{0};
+    std::atomic<uint64_t> hold_us{0};
+    std::atomic<uint64_t> max_hold_us{0};
+    // waits on the Cond of the lock, the lock is not held meanwhile
+    std::atomic<uint64_t> cond_waits{0};
+    std::atomic<uint64_t> cond_wait_us{0};
+
+    void acquired(bool contended, uint64_t waited_us);
+    void released(uint64_t held_us);
+    void cond_waited(uint64_t waited_us);
+
+    // the stats of name, made on first use and never freed, so that locks
+    // with static storage can report until the end
+    static LockStats& get(const std::string& name);
+
+    static uint64_t now_us();
+
+    // a table of the locks that were acquired, most waited for first
+    static std::string summary();
+    // sends summary() through LOG, line by line
+    static void dump();
+};
+
+#ifdef PKGI_ENABLE_LOCK_STATS
+
+// Times the lock it belongs to. A lock that is free is taken with try_lock
+// so that only contended acquisitions pay for the clock before locking.
+class LockProbe
+{
+public:
+    explicit LockProbe(const std::string& name) : _stats(LockStats::get(name))
+    {
+    }
+
+    template <typename TryLock, typename Lock>
+    void lock(TryLock&& try_lock, Lock&& lock)
+    {
+        uint64_t waited_us = 0;
+        const bool contended = !try_lock();
+        if (contended)
+        {
+            const auto start = LockStats::now_us();
+            lock();
+            waited_us = LockStats::now_us() - start;
+        }
+        _locked_at = LockStats::now_us();
+        _stats.acquired(contended, waited_us);
+    }
+
+    // after a successful try_lock
+    void locked()
+    {
+        _locked_at = LockStats::now_us();
+        _stats.acquired(false, 0);
+    }
+
+    // before the lock is released
+    void unlocking()
+    {
+        _stats.released(LockStats::now_us() - _locked_at);
+    }
+
+    // a Cond wait releases the lock and takes it back
+    uint64_t cond_wait_begin()
+    {
+        unlocking();
+        return LockStats::now_us();
+    }
+
+    void cond_wait_end(uint64_t start)
+    {
+        _locked_at = LockStats::now_us();
+        _stats.cond_waited(_locked_at - start);
+    }
+
+private:
+    LockStats& _stats;
+    // only written by the holder of the lock
+    uint64_t _locked_at = 0;
+};
+
+#else
+
+class LockProbe
+{
+public:
+    explicit LockProbe(const std::string&)
+    {
+    }
+
+    template <typename TryLock, typename Lock>
+    void lock(TryLock&&, Lock&& lock)
+    {
+        lock();
+    }
+
+    void locked()
+    {
+    }
+
+    void unlocking()
+    {
+    }
+
+    uint64_t cond_wait_begin()
+    {
+        return 0;
+    }
+
+    void cond_wait_end(uint64_t)
+    {
+    }
+};
+
+#endif
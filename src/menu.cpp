@@ -26,6 +26,7 @@ typedef enum
     MenuSort,
     MenuFilter,
     MenuRefresh,
+    MenuCheckUpdates,
     MenuShow,
 } MenuType;
 
@@ -55,6 +56,7 @@ static const MenuEntry menu_entries[] = {
         {MenuFilter, "已安装的游戏", DbFilterInstalled},
 
         {MenuRefresh, "刷新列表", 0},
+        {MenuCheckUpdates, "检查游戏更新", 0},
 
         {MenuShow, "显示PSV游戏", 1},
         {MenuShow, "显示PSV追加下载内容", 2},
@@ -193,6 +195,12 @@ int pkgi_do_menu(pkgi_input* input)
             menu_delta = -1;
             return 1;
         }
+        else if (type == MenuCheckUpdates)
+        {
+            menu_result = MenuResultCheckUpdates;
+            menu_delta = -1;
+            return 1;
+        }
         else if (type == MenuShow)
         {
             switch (menu_entries[menu_selected].value)
@@ -295,7 +303,8 @@ int pkgi_do_menu(pkgi_input* input)
 
         char text[64];
         if (type == MenuSearch || type == MenuSearchClear || type == MenuText ||
-            type == MenuRefresh || type == MenuShow)
+            type == MenuRefresh || type == MenuCheckUpdates ||
+            type == MenuShow)
         {
             pkgi_strncpy(text, sizeof(text), entry->text);
         }
@@ -0,0 +1,675 @@
+#include "multisourcehttp.hpp"
+
+#include "connectionpool.hpp"
+#include "log.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <strings.h>
+
+namespace
+{
+constexpr size_t READ_SIZE = 64 * 1024;
+// smaller ends of segments are not worth a new request
+constexpr size_t MIN_STEAL_SIZE = 4 * READ_SIZE;
+
+uint64_t now_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+int expected_status(uint64_t offset)
+{
+    return offset == 0 ? 200 : 206;
+}
+}
+
+std::string pkgi_mirror_url(const std::string& url, const std::string& mirror)
+{
+    auto base = mirror;
+    while (!base.empty() && base.back() == '/')
+        base.pop_back();
+    return base + url.substr(pkgi_http_origin(url).size());
+}
+
+MultiSourceHttp::MultiSourceHttp(
+        HttpFactory make_http,
+        std::vector<std::string> mirrors,
+        SpareConnections spare_connections)
+    : _make_http(std::move(make_http))
+    , _mirrors(std::move(mirrors))
+    , _spare_connections(std::move(spare_connections))
+    , _cond("multi_source_cond")
+{
+}
+
+MultiSourceHttp::~MultiSourceHttp()
+{
+    close();
+}
+
+void MultiSourceHttp::start(const std::string& url, uint64_t offset, bool head)
+{
+    if (*this)
+        throw HttpError("HTTP连接已启动");
+
+    _aborted = false;
+    auto headers = std::move(_request_headers);
+    _request_headers.clear();
+
+    if (_mirrors.empty() || head)
+    {
+        _single = _make_http();
+        for (const auto& header : headers)
+            _single->add_request_header(header.first, header.second);
+        _single->start(url, offset, head);
+        return;
+    }
+
+    std::vector<std::string> urls{url};
+    for (const auto& mirror : _mirrors)
+        urls.push_back(pkgi_mirror_url(url, mirror));
+
+    // another server has other validators and would answer a conditional
+    // request with the whole file
+    Headers conditional;
+    headers.erase(
+            std::remove_if(
+                    headers.begin(),
+                    headers.end(),
+                    [&](const auto& header) {
+                        if (strncasecmp(header.first.c_str(), "If-", 3) != 0)
+                            return false;
+                        conditional.push_back(header);
+                        return true;
+                    }),
+            headers.end());
+    std::vector<size_t> order;
+    for (size_t i = 0; i < urls.size(); ++i)
+        order.push_back(i);
+    const bool validated = !conditional.empty() && _reference < urls.size();
+    if (validated)
+        std::rotate(
+                order.begin(),
+                order.begin() + _reference,
+                order.begin() + _reference + 1);
+
+    // the first source that answers is the reference for the others
+    std::vector<uint8_t> reference;
+    std::string first_error;
+    for (const auto index : order)
+    {
+        auto source = std::make_unique<Source>();
+        source->index = index;
+        source->url = urls[index];
+        source->http = _make_http();
+        source->headers = headers;
+        if (validated && index == _reference)
+            source->headers.insert(
+                    source->headers.end(),
+                    conditional.begin(),
+                    conditional.end());
+
+        std::vector<uint8_t> bytes;
+        try
+        {
+            if (!probe(*source, offset, bytes))
+            {
+                // the file changed, the caller finds out from the status
+                if (validated && index == _reference)
+                {
+                    LOGF("{} changed since the last response", source->url);
+                    _single = std::move(source->http);
+                    return;
+                }
+                throw formatEx<HttpError>(
+                        "HTTP状态异常: {}", source->http->get_status());
+            }
+        }
+        catch (const HttpError& e)
+        {
+            LOGF("dropping source {}: {}", source->url, e.what());
+            if (first_error.empty())
+                first_error = e.what();
+            // only this source can tell whether the bytes the caller has
+            // are still good
+            if (validated && index == _reference)
+                throw;
+            continue;
+        }
+
+        if (_sources.empty())
+        {
+            reference = std::move(bytes);
+            _reference = index;
+            _end = offset + source->http->get_length();
+            _status = source->http->get_status();
+            _etag = source->http->get_response_header("ETag");
+            _last_modified = source->http->get_response_header("Last-Modified");
+            // holding its connection while the next probe waits for one
+            // could take every slot of the connection pool
+            source->http->close();
+            source->stream_offset = 0;
+            _sources.push_back(std::move(source));
+            continue;
+        }
+
+        const auto end = offset + source->http->get_length();
+        source->http->close();
+        source->stream_offset = 0;
+        if (end != _end)
+        {
+            LOGF("dropping source {}: length {} instead of {}",
+                 source->url,
+                 end,
+                 _end);
+            continue;
+        }
+        if (bytes != reference)
+        {
+            LOGF("dropping source {}: content differs", source->url);
+            continue;
+        }
+        _sources.push_back(std::move(source));
+    }
+
+    if (_sources.empty())
+        throw HttpError(first_error);
+    limit_sources();
+
+    LOGF("fetching {} from {} sources", url, _sources.size());
+
+    _start_offset = offset;
+    _read_offset = offset;
+    _read_in_segment = 0;
+    _next_segment = offset;
+    _error.clear();
+    _stopping = false;
+
+    // the probe of the reference is the start of the first segment
+    if (_end != offset)
+    {
+        const auto size = std::min(SEGMENT_SIZE, _end - offset);
+        auto segment = std::make_shared<Segment>(
+                Segment{offset, size, std::vector<uint8_t>(size)});
+        std::copy(reference.begin(), reference.end(), segment->data.begin());
+        segment->filled = reference.size();
+        _segments.push_back(std::move(segment));
+        _next_segment += size;
+    }
+
+    _started = true;
+    _running = _sources.size();
+    for (const auto& source : _sources)
+        _threads.push_back(std::make_unique<Thread>(
+                fmt::format("multi_source_{}", _threads.size()),
+                [this, source = source.get()] { run(*source); }));
+}
+
+void MultiSourceHttp::limit_sources()
+{
+    // the first one answered first and holds the probe the segments start
+    // with
+    std::stable_sort(
+            _sources.begin() + 1,
+            _sources.end(),
+            [](const auto& a, const auto& b) {
+                return a->throughput > b->throughput;
+            });
+
+    if (!_spare_connections)
+        return;
+
+    // the probes gave their connections back, the first source needs one
+    // even if it has to wait
+    const auto limit = std::max<size_t>(1, _spare_connections());
+    if (_sources.size() <= limit)
+        return;
+
+    for (auto it = _sources.begin() + limit; it != _sources.end(); ++it)
+        LOGF("not using source {}: no connection left", (*it)->url);
+    _sources.resize(limit);
+}
+
+void MultiSourceHttp::start_source(Source& source, uint64_t offset)
+{
+    for (const auto& header : source.headers)
+        source.http->add_request_header(header.first, header.second);
+    source.http->start(source.url, offset);
+}
+
+bool MultiSourceHttp::probe(
+        Source& source, uint64_t offset, std::vector<uint8_t>& bytes)
+{
+    const auto start = now_usec();
+    start_source(source, offset);
+
+    const auto status = source.http->get_status();
+    if (offset != 0 && status == 200)
+        return false;
+    if (status != expected_status(offset))
+        throw formatEx<HttpError>("HTTP状态异常: {}", status);
+    const auto length = source.http->get_length();
+    if (length <= 0)
+        throw HttpError("HTTP响应长度未知");
+
+    bytes.resize(std::min<uint64_t>(PROBE_SIZE, length));
+    size_t pos = 0;
+    while (pos < bytes.size())
+    {
+        const auto read =
+                source.http->read(bytes.data() + pos, bytes.size() - pos);
+        if (read == 0)
+            throw HttpError("HTTP连接意外断开");
+        pos += read;
+    }
+
+    source.stream_offset = offset + bytes.size();
+    source.received = bytes.size();
+    source.throughput =
+            bytes.size() * 1e6 / std::max<uint64_t>(1, now_usec() - start);
+    return true;
+}
+
+void MultiSourceHttp::run(Source& source)
+{
+    std::unique_lock<Mutex> lock(_cond.get_mutex());
+    while (!_stopping && !source.dropped)
+    {
+        if (is_slow(source))
+        {
+            LOGF("source {} is too slow, dropping it", source.url);
+            source.dropped = true;
+            break;
+        }
+
+        if (is_parked(source))
+        {
+            source.parked = true;
+            if (source.stream_offset != 0)
+            {
+                // the connection goes back to the pool while it waits
+                lock.unlock();
+                source.http->close();
+                lock.lock();
+                source.stream_offset = 0;
+                continue;
+            }
+            if (fetched_all())
+                break;
+            _cond.wait();
+            continue;
+        }
+
+        const auto segment = claim(source);
+        if (!segment)
+        {
+            if (fetched_all())
+                break;
+            _cond.wait();
+            continue;
+        }
+
+        lock.unlock();
+        try
+        {
+            fetch(source, *segment);
+            lock.lock();
+        }
+        catch (const ConnectionPoolTimeout& e)
+        {
+            // the pool is busy, the source did nothing wrong
+            lock.lock();
+            segment->owner = nullptr;
+            source.stream_offset = 0;
+            if (!_stopping)
+                LOGF("source {} waits for a connection: {}",
+                     source.url,
+                     e.what());
+        }
+        catch (const HttpError& e)
+        {
+            lock.lock();
+            segment->owner = nullptr;
+            source.stream_offset = 0;
+            if (!_stopping)
+            {
+                LOGF("source {} failed: {}", source.url, e.what());
+                if (++source.errors >= MAX_SOURCE_ERRORS)
+                    source.dropped = true;
+            }
+        }
+        _cond.notify_all();
+    }
+
+    --_running;
+    if (_running == 0 && _error.empty() && !_stopping && !fetched_all())
+        _error = "所有下载源均已失败";
+    _cond.notify_all();
+}
+
+std::shared_ptr<MultiSourceHttp::Segment> MultiSourceHttp::claim(
+        Source& source)
+{
+    // a segment given back by a failed source is the most urgent one
+    for (const auto& segment : _segments)
+        if (!segment->owner && segment->filled != segment->size)
+        {
+            segment->owner = &source;
+            return segment;
+        }
+
+    const auto sources = std::max<size_t>(1, active_sources());
+    if (_next_segment == _end || _segments.size() >= SEGMENTS_AHEAD * sources)
+        return steal(source);
+
+    const auto size = std::min(SEGMENT_SIZE, _end - _next_segment);
+    _segments.push_back(std::make_shared<Segment>(
+            Segment{_next_segment, size, std::vector<uint8_t>(size)}));
+    _next_segment += size;
+    _segments.back()->owner = &source;
+    return _segments.back();
+}
+
+// The reader needs the segments in order, so a slow source holding one stalls
+// the whole transfer. The slow source keeps what it can fetch while the fast
+// one fetches the rest.
+std::shared_ptr<MultiSourceHttp::Segment> MultiSourceHttp::steal(
+        Source& source)
+{
+    for (auto it = _segments.begin(); it != _segments.end(); ++it)
+    {
+        auto& segment = **it;
+        const auto owner = segment.owner;
+        if (!owner || owner == &source ||
+            owner->throughput * SLOW_SOURCE_RATIO >= source.throughput)
+            continue;
+
+        const auto remaining = segment.size - segment.filled;
+        const auto keep = static_cast<size_t>(
+                remaining * owner->throughput /
+                (owner->throughput + source.throughput));
+        if (remaining - keep < MIN_STEAL_SIZE)
+            continue;
+
+        const auto split = segment.filled + keep;
+        const auto size = segment.size - split;
+        auto stolen = std::make_shared<Segment>(Segment{
+                segment.offset + split, size, std::vector<uint8_t>(size)});
+        stolen->owner = &source;
+        segment.size = split;
+        LOGF("{} takes {} bytes at {} over from {}",
+             source.url,
+             size,
+             stolen->offset,
+             owner->url);
+
+        _segments.insert(it + 1, stolen);
+        return stolen;
+    }
+    return nullptr;
+}
+
+void MultiSourceHttp::fetch(Source& source, Segment& segment)
+{
+    // filled is only written by the owner of the segment
+    auto filled = segment.filled;
+    const auto offset = segment.offset + filled;
+
+    const auto start = now_usec();
+    if (source.stream_offset != offset)
+    {
+        source.http->close();
+        source.stream_offset = 0;
+        start_source(source, offset);
+
+        const auto status = source.http->get_status();
+        if (status != expected_status(offset))
+            throw formatEx<HttpError>("HTTP状态异常: {}", status);
+        const auto end = offset + source.http->get_length();
+        if (end != _end)
+        {
+            {
+                ScopeLock _(_cond.get_mutex());
+                source.dropped = true;
+            }
+            throw formatEx<HttpError>("length {} instead of {}", end, _end);
+        }
+        source.stream_offset = offset;
+    }
+
+    uint64_t received = 0;
+    while (true)
+    {
+        size_t to_read;
+        {
+            ScopeLock _(_cond.get_mutex());
+            // the segment may have been split in the meantime
+            if (filled >= segment.size)
+            {
+                segment.owner = nullptr;
+                return;
+            }
+            to_read = std::min(READ_SIZE, segment.size - filled);
+        }
+
+        const auto read =
+                source.http->read(segment.data.data() + filled, to_read);
+        if (read == 0)
+            throw HttpError("HTTP连接意外断开");
+        filled += read;
+        received += read;
+        source.stream_offset += read;
+
+        {
+            ScopeLock _(_cond.get_mutex());
+            segment.filled = std::min(filled, segment.size);
+            source.received += read;
+            // the estimate of the probe is kept until a few reads went by
+            if (received >= MIN_STEAL_SIZE)
+            {
+                source.throughput = received * 1e6 /
+                                    std::max<uint64_t>(1, now_usec() - start);
+                source.parked = false;
+            }
+        }
+        _cond.notify_all();
+    }
+}
+
+bool MultiSourceHttp::fetched_all() const
+{
+    return _next_segment == _end &&
+           std::all_of(
+                   _segments.begin(), _segments.end(), [](const auto& segment) {
+                       return segment->filled == segment->size;
+                   });
+}
+
+bool MultiSourceHttp::is_slow(const Source& source) const
+{
+    // the throughput of a source that waited is older than that of the
+    // others
+    if (source.parked)
+        return false;
+
+    double best = 0;
+    size_t sources = 0;
+    for (const auto& other : _sources)
+        if (!other->dropped && !other->parked)
+        {
+            best = std::max(best, other->throughput);
+            ++sources;
+        }
+    return sources > 1 && source.throughput * SLOW_SOURCE_RATIO < best;
+}
+
+bool MultiSourceHttp::is_parked(const Source& source) const
+{
+    if (_max_connections == 0)
+        return false;
+
+    unsigned rank = 0;
+    for (const auto& other : _sources)
+    {
+        if (other.get() == &source)
+            break;
+        if (!other->dropped)
+            ++rank;
+    }
+    return rank >= _max_connections;
+}
+
+size_t MultiSourceHttp::active_sources() const
+{
+    const size_t sources = std::count_if(
+            _sources.begin(), _sources.end(), [](const auto& source) {
+                return !source->dropped;
+            });
+    return _max_connections == 0 ? sources
+                                 : std::min<size_t>(sources, _max_connections);
+}
+
+int64_t MultiSourceHttp::read(uint8_t* buffer, uint64_t size)
+{
+    if (_single)
+        return _single->read(buffer, size);
+
+    ScopeLock _(_cond.get_mutex());
+    while (true)
+    {
+        if (_read_offset == _end)
+            return 0;
+
+        if (!_segments.empty())
+        {
+            auto& segment = *_segments.front();
+            if (_read_in_segment < segment.filled)
+            {
+                const auto read = std::min<uint64_t>(
+                        size, segment.filled - _read_in_segment);
+                std::memcpy(
+                        buffer, segment.data.data() + _read_in_segment, read);
+                _read_in_segment += read;
+                _read_offset += read;
+                if (_read_in_segment == segment.size)
+                {
+                    _segments.pop_front();
+                    _read_in_segment = 0;
+                    _cond.notify_all();
+                }
+                return read;
+            }
+        }
+
+        if (!_error.empty())
+            throw HttpError(_error);
+        if (_aborted)
+            throw HttpError("下载已被取消");
+        _cond.wait();
+    }
+}
+
+void MultiSourceHttp::abort()
+{
+    _aborted = true;
+    if (_single)
+    {
+        _single->abort();
+        return;
+    }
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _stopping = true;
+        for (const auto& source : _sources)
+            source->http->abort();
+    }
+    _cond.notify_all();
+}
+
+void MultiSourceHttp::close()
+{
+    if (_single)
+    {
+        _single->close();
+        _single = nullptr;
+        return;
+    }
+
+    {
+        ScopeLock _(_cond.get_mutex());
+        _stopping = true;
+        for (const auto& source : _sources)
+            source->http->abort();
+    }
+    _cond.notify_all();
+    for (const auto& thread : _threads)
+        thread->join();
+    _threads.clear();
+
+    for (const auto& source : _sources)
+        source->http->close();
+    _sources.clear();
+    _segments.clear();
+    _started = false;
+}
+
+int MultiSourceHttp::get_status()
+{
+    return _single ? _single->get_status() : _status;
+}
+
+int64_t MultiSourceHttp::get_length()
+{
+    return _single ? _single->get_length() : _end - _start_offset;
+}
+
+void MultiSourceHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _request_headers.emplace_back(name, value);
+}
+
+void MultiSourceHttp::set_max_connections(unsigned connections)
+{
+    {
+        ScopeLock _(_cond.get_mutex());
+        if (connections == _max_connections)
+            return;
+        _max_connections = connections;
+    }
+    _cond.notify_all();
+}
+
+std::string MultiSourceHttp::get_response_header(const std::string& name)
+{
+    if (_single)
+        return _single->get_response_header(name);
+    if (strcasecmp(name.c_str(), "ETag") == 0)
+        return _etag;
+    if (strcasecmp(name.c_str(), "Last-Modified") == 0)
+        return _last_modified;
+    return {};
+}
+
+MultiSourceHttp::operator bool() const
+{
+    return _single ? static_cast<bool>(*_single) : _started;
+}
+
+std::vector<std::pair<std::string, uint64_t>> MultiSourceHttp::source_stats()
+        const
+{
+    ScopeLock _(_cond.get_mutex());
+    std::vector<std::pair<std::string, uint64_t>> stats;
+    for (const auto& source : _sources)
+        stats.emplace_back(source->url, source->received);
+    return stats;
+}
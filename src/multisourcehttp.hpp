@@ -0,0 +1,176 @@
+#pragma once
+
+#include "http.hpp"
+#include "thread.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+// url with its origin replaced by mirror, mirror may have a path prefix
+std::string pkgi_mirror_url(const std::string& url, const std::string& mirror);
+
+// Fetches one file from several equivalent sources at once: the url given to
+// start() and the same path on every mirror.
+//
+// Every source is first probed with a small ranged read at the start offset.
+// Sources that fail, report another length or return other bytes than the
+// first source that answered are dropped. The rest of the file is then split
+// in SEGMENT_SIZE segments that one thread per source fetches with ranged
+// requests, at most SEGMENTS_AHEAD segments per source ahead of the reader,
+// and read() hands them out in order.
+//
+// A source is dropped after MAX_SOURCE_ERRORS failures or a length that does
+// not match, and stops taking segments when it is SLOW_SOURCE_RATIO times
+// slower than the fastest source. A source with nothing left to take splits
+// the segment of such a slow source and fetches its end. A mirror that serves
+// wrong bytes past the probe is only caught by the checks of the caller, like
+// the pkg digest.
+//
+// Headers added before start() are sent with every request of every source,
+// except the conditional ones (If-*): they carry a validator of the source
+// the last response came from, the only one they are sent to. That source is
+// probed first, and when it answers a ranged request with the whole file the
+// response is passed on as it is, for the caller to see the file changed.
+//
+// set_max_connections() caps the sources that fetch at once, the first one
+// and then the fastest, the others wait until it is raised.
+//
+// Every source holds a connection while it fetches. When spare_connections
+// is given, only as many sources as it returns once they are probed fetch,
+// the first one and then the fastest, so that mirrors don't wait for
+// connections other users of the pool hold. A source that waits too long for
+// a connection anyway gives its segment back without it counting as a
+// failure.
+//
+// Without mirrors, and for HEAD requests, requests go to a single Http.
+class MultiSourceHttp : public Http
+{
+public:
+    using HttpFactory = std::function<std::unique_ptr<Http>()>;
+    using SpareConnections = std::function<size_t()>;
+
+    static constexpr uint64_t PROBE_SIZE = 16 * 1024;
+    static constexpr uint64_t SEGMENT_SIZE = 2 * 1024 * 1024;
+    static constexpr size_t SEGMENTS_AHEAD = 2;
+    static constexpr unsigned MAX_SOURCE_ERRORS = 3;
+    static constexpr double SLOW_SOURCE_RATIO = 4;
+
+    MultiSourceHttp(
+            HttpFactory make_http,
+            std::vector<std::string> mirrors,
+            SpareConnections spare_connections = {});
+    ~MultiSourceHttp();
+
+    void start(
+            const std::string& url,
+            uint64_t offset,
+            bool head = false) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+    void close() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+    void set_max_connections(unsigned connections) override;
+
+    explicit operator bool() const override;
+
+    // bytes received from each source of the last request, for benchmarks
+    std::vector<std::pair<std::string, uint64_t>> source_stats() const;
+
+private:
+    using Headers = std::vector<std::pair<std::string, std::string>>;
+
+    struct Source
+    {
+        // 0 for the url given to start(), then the mirrors
+        size_t index;
+        std::string url;
+        std::unique_ptr<Http> http;
+        // sent again with every request
+        Headers headers;
+        // offset the response of http continues at, 0 when it is closed
+        uint64_t stream_offset = 0;
+        // bytes per second, averaged over the segments
+        double throughput = 0;
+        uint64_t received = 0;
+        unsigned errors = 0;
+        bool dropped = false;
+        // waited for max_connections since throughput was measured
+        bool parked = false;
+    };
+
+    // Only the bytes of data past filled are written outside of the lock, by
+    // the owner of the segment.
+    struct Segment
+    {
+        uint64_t offset;
+        // shrinks when another source takes over the end of the segment
+        size_t size;
+        std::vector<uint8_t> data;
+        size_t filled = 0;
+        Source* owner = nullptr;
+    };
+
+    HttpFactory _make_http;
+    std::vector<std::string> _mirrors;
+    SpareConnections _spare_connections;
+    Headers _request_headers;
+
+    std::unique_ptr<Http> _single;
+
+    using ScopeLock = std::lock_guard<Mutex>;
+
+    mutable Cond _cond;
+    std::vector<std::unique_ptr<Source>> _sources;
+    // segments from the read position on, the reader is in the first one.
+    // The owner of a segment holds it too, it may still be writing after the
+    // reader is done with it.
+    std::deque<std::shared_ptr<Segment>> _segments;
+    uint64_t _start_offset = 0;
+    uint64_t _end = 0;
+    uint64_t _next_segment = 0;
+    uint64_t _read_offset = 0;
+    size_t _read_in_segment = 0;
+    int _status = 0;
+    std::string _etag;
+    std::string _last_modified;
+    // index of the source _etag and _last_modified come from
+    size_t _reference = 0;
+    std::string _error;
+    unsigned _max_connections = 0;
+    unsigned _running = 0;
+    bool _started = false;
+    bool _stopping = false;
+    std::atomic<bool> _aborted{false};
+    std::vector<std::unique_ptr<Thread>> _threads;
+
+    // false when the source answered with the whole file instead of the
+    // range
+    bool probe(Source& source, uint64_t offset, std::vector<uint8_t>& bytes);
+    void start_source(Source& source, uint64_t offset);
+    // sorts the sources by throughput and drops the slowest ones past the
+    // connections left in the pool
+    void limit_sources();
+    void run(Source& source);
+    std::shared_ptr<Segment> claim(Source& source);
+    std::shared_ptr<Segment> steal(Source& source);
+    void fetch(Source& source, Segment& segment);
+    bool fetched_all() const;
+    bool is_slow(const Source& source) const;
+    // past the sources max_connections lets fetch
+    bool is_parked(const Source& source) const;
+    size_t active_sources() const;
+};
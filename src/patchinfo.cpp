@@ -2,6 +2,10 @@
 
 #include "sha256.hpp"
 
+#include <charconv>
+
+#include <cstring>
+
 namespace
 {
 constexpr uint8_t HMAC_KEY[32] = {
@@ -10,7 +14,177 @@ constexpr uint8_t HMAC_KEY[32] = {
         0x5D, 0x2B, 0x4A, 0xBD, 0x99, 0x54, 0x50, 0x35, 0x51, 0x14,
 };
 
-std::string get_link_for_title(const std::string& titleid)
+bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+}
+
+void PatchInfoScanner::feed(const uint8_t* data, size_t size)
+{
+    const auto* const end = data + size;
+    for (const auto* p = data; p != end; ++p)
+    {
+        const auto c = static_cast<char>(*p);
+        switch (_state)
+        {
+        case State::Text:
+            // most of the document is skipped here and in SkipTag, jump over
+            // it instead of going through the switch for every byte
+            p = static_cast<const uint8_t*>(std::memchr(p, '<', end - p));
+            if (!p)
+                return;
+            _name.clear();
+            _state = State::TagName;
+            break;
+        case State::TagName:
+            if (is_space(c) || c == '>' || c == '/')
+            {
+                start_element();
+                if (_element == Element::Other)
+                    _state = c == '>' ? State::Text : State::SkipTag;
+                else
+                    _state = c == '>' ? State::Text : State::Tag;
+            }
+            else
+                _name.push(c);
+            break;
+        case State::Tag:
+            if (c == '>')
+                _state = State::Text;
+            else if (!is_space(c) && c != '/')
+            {
+                _name.clear();
+                _name.push(c);
+                _state = State::AttrName;
+            }
+            break;
+        case State::AttrName:
+            if (c == '=')
+                _state = State::AfterEquals;
+            else if (is_space(c))
+                _state = State::AfterAttrName;
+            else if (c == '>')
+                _state = State::Text;
+            else
+                _name.push(c);
+            break;
+        case State::AfterAttrName:
+            if (c == '=')
+                _state = State::AfterEquals;
+            else if (c == '>')
+                _state = State::Text;
+            else if (!is_space(c))
+            {
+                // attribute without a value
+                _name.clear();
+                _name.push(c);
+                _state = State::AttrName;
+            }
+            break;
+        case State::AfterEquals:
+            if (c == '"' || c == '\'')
+            {
+                _quote = c;
+                _value.clear();
+                _state = State::Value;
+            }
+            else if (c == '>')
+                _state = State::Text;
+            break;
+        case State::Value:
+        {
+            const auto* quote =
+                    static_cast<const uint8_t*>(std::memchr(p, _quote, end - p));
+            _value.append(
+                    reinterpret_cast<const char*>(p), (quote ? quote : end) - p);
+            if (!quote)
+                return;
+            p = quote;
+            end_attribute();
+            _state = State::Tag;
+            break;
+        }
+        case State::SkipTag:
+            // '>' may appear in quoted values of tags we don't care about
+            if (_quote != 0)
+            {
+                p = static_cast<const uint8_t*>(std::memchr(p, _quote, end - p));
+                if (!p)
+                    return;
+                _quote = 0;
+            }
+            else if (c == '"' || c == '\'')
+                _quote = c;
+            else if (c == '>')
+                _state = State::Text;
+            break;
+        }
+    }
+}
+
+void PatchInfoScanner::start_element()
+{
+    const auto name = _name.view();
+    if (name == "package")
+    {
+        _element = Element::Package;
+        _version.clear();
+        _psp2_system_ver.clear();
+        _url.clear();
+        _hybrid_url.clear();
+    }
+    else if (name == "hybrid_package")
+    {
+        _element = Element::HybridPackage;
+        _hybrid_url.clear();
+    }
+    else
+        _element = Element::Other;
+    _quote = 0;
+}
+
+void PatchInfoScanner::end_attribute()
+{
+    const auto name = _name.view();
+    if (_element == Element::Package)
+    {
+        if (name == "version")
+            _version.assign(_value);
+        else if (name == "psp2_system_ver")
+            _psp2_system_ver.assign(_value);
+        else if (name == "url")
+            _url.assign(_value);
+    }
+    else if (_element == Element::HybridPackage && name == "url")
+        _hybrid_url.assign(_value);
+}
+
+std::optional<PatchInfo> PatchInfoScanner::result() const
+{
+    const auto url = _hybrid_url.view().empty() ? _url.view() : _hybrid_url.view();
+    if (_version.view().empty() || url.empty())
+        return std::nullopt;
+
+    std::string fw_version;
+    const auto fw = _psp2_system_ver.view();
+    uint32_t fw_version_int = 0;
+    if (!fw.empty() &&
+        std::from_chars(fw.data(), fw.data() + fw.size(), fw_version_int).ec ==
+                std::errc())
+        fw_version = fmt::format(
+                "{:x}.{:02x}",
+                fw_version_int >> 24,
+                (fw_version_int >> 16) & 0xff);
+
+    return PatchInfo{
+            std::string(_version.view()),
+            std::move(fw_version),
+            std::string(url),
+    };
+}
+
+std::string pkgi_patch_info_url(const std::string& titleid)
 {
     uint8_t hmac[SHA256_MAC_LEN];
 
@@ -32,72 +206,30 @@ std::string get_link_for_title(const std::string& titleid)
     return link;
 }
 
-std::optional<std::vector<uint8_t>> download_data(
+std::optional<PatchInfo> pkgi_download_patch_info(
+        Http* http, const std::string& titleid)
+{
+    return pkgi_fetch_patch_info(http, pkgi_patch_info_url(titleid));
+}
+
+std::optional<PatchInfo> pkgi_fetch_patch_info(
         Http* http, const std::string& url)
 {
-    std::vector<uint8_t> data;
     http->start(url, 0);
     if (http->get_status() == 404)
         return std::nullopt;
-    size_t pos = 0;
-    while (true)
-    {
-        if (pos == data.size())
-            data.resize(pos + 4096);
-        const auto read = http->read(data.data() + pos, data.size() - pos);
-        if (read == 0)
-            break;
-        pos += read;
-    }
-    data.resize(pos);
-    return data;
-}
 
-PatchInfo get_last_patch(const std::string& xml)
-{
-    static constexpr char PackageStr[] = "<package";
-    static constexpr char HybridPackageStr[] = "<hybrid_package";
-    static constexpr char VersionStr[] = "version=\"";
-    static constexpr char UrlStr[] = "url=\"";
-    static constexpr char Psp2SystemVerStr[] = "psp2_system_ver=\"";
-
-    const auto last_package = xml.rfind(PackageStr);
-    const auto last_hybrid_package = xml.find(HybridPackageStr, last_package);
-    const auto version =
-            xml.find(VersionStr, last_package) + sizeof(VersionStr) - 1;
-    const auto version_end = xml.find('"', version);
-    const auto fw_version = xml.find(Psp2SystemVerStr, last_package) +
-                            sizeof(Psp2SystemVerStr) - 1;
-    const auto fw_version_end = xml.find('"', fw_version);
-    const auto package_of_interest = last_hybrid_package == std::string::npos
-                                             ? last_package
-                                             : last_hybrid_package;
-    const auto url = xml.find(UrlStr, package_of_interest) + sizeof(UrlStr) - 1;
-    const auto url_end = xml.find('"', url);
-
-    const auto fw_version_int =
-            std::stoi(xml.substr(fw_version, fw_version_end - fw_version));
+    PatchInfoScanner scanner;
+    uint8_t buffer[4096];
+    while (const auto read = http->read(buffer, sizeof(buffer)))
+        scanner.feed(buffer, read);
 
-    return PatchInfo{
-            xml.substr(version, version_end - version),
-            fmt::format(
-                    "{:x}.{:02x}",
-                    fw_version_int >> 24,
-                    (fw_version_int >> 16) & 0xff),
-            xml.substr(url, url_end - url),
-    };
-}
+    return scanner.result();
 }
 
-std::optional<PatchInfo> pkgi_download_patch_info(
-        Http* http, const std::string& titleid)
+bool pkgi_is_newer_version(
+        const std::string& installed, const std::string& available)
 {
-    const auto info_link = get_link_for_title(titleid);
-    const auto xml = download_data(http, info_link);
-    if (!xml || xml->empty())
-        return std::nullopt;
-    const auto patch_info =
-            get_last_patch(std::string(xml->begin(), xml->end()));
-
-    return patch_info;
+    // versions are always written as two 2-digit numbers, "01.05"
+    return !available.empty() && available > installed;
 }
@@ -2,8 +2,12 @@
 
 #include "http.hpp"
 
+#include <algorithm>
 #include <optional>
 #include <string>
+#include <string_view>
+
+#include <cstdint>
 
 struct PatchInfo
 {
@@ -12,5 +16,105 @@ struct PatchInfo
     std::string url;
 };
 
+// Finds the last <package> of a -ver.xml as the document is fed to it, chunk
+// by chunk, without keeping the document around. Only the attributes of the
+// current package are stored, in fixed buffers. When the package has a
+// <hybrid_package> child, its url is used instead of the package's one.
+class PatchInfoScanner
+{
+public:
+    void feed(const uint8_t* data, size_t size);
+
+    // nullopt when no package with a version and an url was seen
+    std::optional<PatchInfo> result() const;
+
+private:
+    enum class State
+    {
+        Text,
+        TagName,
+        Tag,
+        AttrName,
+        AfterAttrName,
+        AfterEquals,
+        Value,
+        SkipTag,
+    };
+
+    enum class Element
+    {
+        Other,
+        Package,
+        HybridPackage,
+    };
+
+    template <size_t N>
+    struct Field
+    {
+        char data[N];
+        size_t size = 0;
+        bool truncated = false;
+
+        void clear()
+        {
+            size = 0;
+            truncated = false;
+        }
+        void push(char c)
+        {
+            if (size < N)
+                data[size++] = c;
+            else
+                truncated = true;
+        }
+        void append(const char* s, size_t len)
+        {
+            const auto n = std::min(N - size, len);
+            std::copy(s, s + n, data + size);
+            size += n;
+            truncated = truncated || n != len;
+        }
+        template <size_t M>
+        void assign(const Field<M>& other)
+        {
+            size = std::min(N, other.size);
+            truncated = other.truncated || other.size > N;
+            std::copy(other.data, other.data + size, data);
+        }
+        // a cut value is as good as a missing one
+        std::string_view view() const
+        {
+            return truncated ? std::string_view() : std::string_view(data, size);
+        }
+    };
+
+    static constexpr size_t MAX_NAME = 32;
+    static constexpr size_t MAX_VALUE = 1024;
+
+    State _state = State::Text;
+    Element _element = Element::Other;
+    char _quote = 0;
+
+    // name of the current tag, then of the current attribute
+    Field<MAX_NAME> _name;
+    Field<MAX_VALUE> _value;
+
+    Field<MAX_NAME> _version;
+    Field<MAX_NAME> _psp2_system_ver;
+    Field<MAX_VALUE> _url;
+    Field<MAX_VALUE> _hybrid_url;
+
+    void start_element();
+    void end_attribute();
+};
+
+// -ver.xml document that lists the patches of a title
+std::string pkgi_patch_info_url(const std::string& titleid);
+
 std::optional<PatchInfo> pkgi_download_patch_info(
         Http* http, const std::string& titleid);
+std::optional<PatchInfo> pkgi_fetch_patch_info(
+        Http* http, const std::string& url);
+
+bool pkgi_is_newer_version(
+        const std::string& installed, const std::string& available);
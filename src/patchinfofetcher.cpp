@@ -1,68 +1,54 @@
 #include "patchinfofetcher.hpp"
 
-#include "vitahttp.hpp"
+#include "cachinghttp.hpp"
 
 #include <mutex>
 
-PatchInfoFetcher::PatchInfoFetcher(std::string title_id)
-    : _mutex("patch_info_fetcher_mutex")
-    , _title_id(std::move(title_id))
-    , _thread("patch_info_fetcher", [this] { do_request(); })
+PatchInfoFetcher::PatchInfoFetcher(
+        FetchService& service, std::string title_id, int priority)
+    : _job(service.fetch<Job>("patchinfo:" + title_id, priority, [&] {
+        return std::make_shared<Job>(title_id);
+    }))
 {
 }
 
-PatchInfoFetcher::~PatchInfoFetcher()
+PatchInfoFetcher::Status PatchInfoFetcher::get_status()
 {
-    Http* http;
-    {
-        std::lock_guard<Mutex> lock(_mutex);
-        _abort = true;
-        http = _http.get();
-    }
-    if (http)
-        http->abort();
-    _thread.join();
+    std::lock_guard<Mutex> lock(_job->mutex);
+    return _job->status;
 }
 
-PatchInfoFetcher::Status PatchInfoFetcher::get_status()
+std::optional<PatchInfo> PatchInfoFetcher::get_patch_info()
 {
-    std::lock_guard<Mutex> lock(_mutex);
-    return _status;
+    std::lock_guard<Mutex> lock(_job->mutex);
+    return _job->patch_info;
 }
 
-std::optional<PatchInfo> PatchInfoFetcher::get_patch_info()
+PatchInfoFetcher::Job::Job(std::string title_id)
+    : mutex("patch_info_fetcher_mutex"), _title_id(std::move(title_id))
+{
+}
+
+std::unique_ptr<Http> PatchInfoFetcher::Job::wrap_http(
+        std::unique_ptr<Http> http)
 {
-    std::lock_guard<Mutex> lock(_mutex);
-    return _patch_info;
+    return std::make_unique<CachingHttp>(
+            std::move(http), pkgi_http_cache_path());
 }
 
-void PatchInfoFetcher::do_request()
+void PatchInfoFetcher::Job::run(Http* http)
 {
     try
     {
-        {
-            std::lock_guard<Mutex> lock(_mutex);
-            if (_abort)
-                return;
-            _http = std::make_unique<VitaHttp>();
-        }
-        const auto patch_info =
-                pkgi_download_patch_info(_http.get(), _title_id);
-        {
-            std::lock_guard<Mutex> lock(_mutex);
-            if (!patch_info)
-                _status = Status::NoUpdate;
-            else
-                _status = Status::Found;
-            _patch_info = patch_info;
-            _http = nullptr;
-        }
+        const auto result = pkgi_download_patch_info(http, _title_id);
+        std::lock_guard<Mutex> lock(mutex);
+        status = result ? Status::Found : Status::NoUpdate;
+        patch_info = result;
     }
     catch (const std::exception& e)
     {
         LOGF("Failed to fetch patch info: {}", e.what());
-        std::lock_guard<Mutex> lock(_mutex);
-        _status = Status::Error;
-        _http = nullptr;
+        std::lock_guard<Mutex> lock(mutex);
+        status = Status::Error;
     }
 }
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "http.hpp"
+#include "fetchservice.hpp"
 #include "patchinfo.hpp"
 #include "thread.hpp"
 
@@ -17,23 +17,31 @@ public:
         Error,
     };
 
-    PatchInfoFetcher(std::string title_id);
-    ~PatchInfoFetcher();
+    PatchInfoFetcher(
+            FetchService& service,
+            std::string title_id,
+            int priority = FetchService::PriorityHigh);
 
     Status get_status();
     std::optional<PatchInfo> get_patch_info();
 
 private:
-    Mutex _mutex;
+    class Job : public FetchJob
+    {
+    public:
+        Job(std::string title_id);
 
-    std::string _title_id;
+        Mutex mutex;
+        Status status{Status::Fetching};
+        std::optional<PatchInfo> patch_info;
 
-    bool _abort{false};
-    Status _status{Status::Fetching};
-    std::unique_ptr<Http> _http;
-    std::optional<PatchInfo> _patch_info;
+    protected:
+        void run(Http* http) override;
+        std::unique_ptr<Http> wrap_http(std::unique_ptr<Http> http) override;
 
-    Thread _thread;
+    private:
+        std::string _title_id;
+    };
 
-    void do_request();
+    FetchHandle<Job> _job;
 };
@@ -5,6 +5,8 @@ extern "C"
 #include "style.h"
 }
 #include "bgdl.hpp"
+#include "cachinghttp.hpp"
+#include "catalogdb.hpp"
 #include "comppackdb.hpp"
 #include "config.hpp"
 #include "db.hpp"
@@ -14,9 +16,14 @@ extern "C"
 #include "gameview.hpp"
 #include "file.hpp"
 #include "imgui.hpp"
+#include "inflatinghttp.hpp"
 #include "install.hpp"
 #include "menu.hpp"
+#include "queuejournal.hpp"
+#include "searchkey.hpp"
+#include "uievents.hpp"
 #include "update.hpp"
+#include "updatesview.hpp"
 #include "utils.hpp"
 #include "vitahttp.hpp"
 #include "zrif.hpp"
@@ -26,6 +33,9 @@ extern "C"
 
 #include <fmt/format.h>
 
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
 #include <memory>
 #include <set>
 
@@ -34,6 +44,17 @@ extern "C"
 
 namespace
 {
+// seconds a list size probe is trusted before asking the server again
+constexpr uint32_t LIST_PROBE_TTL = 5 * 60;
+// threads fetching patch info and covers, one per connection the VitaHttp
+// pool budgets for them, so that they don't eat into the ones of the
+// downloads
+constexpr size_t FETCH_WORKERS = VitaHttp::FETCH_CONNECTIONS;
+#ifdef PKGI_ENABLE_LOCK_STATS
+// milliseconds between two dumps of the lock stats to the log
+constexpr uint32_t LOCK_STATS_INTERVAL = 60 * 1000;
+#endif
+
 typedef enum
 {
     StateError,
@@ -59,8 +80,9 @@ int bottom_y;
 char search_text[256];
 char error_state[256];
 
-// used for multiple things actually
-Mutex refresh_mutex("refresh_mutex");
+// filled by the workers, drained by the main loop
+UiEventQueue ui_events;
+// only touched by the main loop
 std::string current_action;
 std::unique_ptr<TitleDatabase> db;
 std::unique_ptr<CompPackDatabase> comppack_db_games;
@@ -70,8 +92,8 @@ std::set<std::string> installed_games;
 std::set<std::string> installed_themes;
 
 std::unique_ptr<GameView> gameview;
+std::unique_ptr<UpdatesView> updatesview;
 bool need_refresh = true;
-std::string content_to_refresh;
 
 void pkgi_reload();
 
@@ -178,6 +200,8 @@ std::string const& pkgi_get_url_from_mode(Mode mode)
             fmt::format("未知模式: {}", static_cast<int>(mode)));
 }
 
+// Only downloads the lists and stages them, the main loop swaps them in and
+// reloads the view when it handles RefreshFinished
 void pkgi_refresh_thread(void)
 {
     LOG("starting update");
@@ -192,60 +216,61 @@ void pkgi_refresh_thread(void)
             auto const url = pkgi_get_url_from_mode(mode);
             if (url.empty())
                 continue;
-            {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 {} [{}/{}]",
-                        pkgi_mode_to_string(mode),
-                        i + 1,
-                        mode_count);
-            }
-            auto const http = std::make_unique<VitaHttp>();
+            ui_events.post(
+                    UiEvent::RefreshStage,
+                    "",
+                    fmt::format(
+                            "正在刷新 {} [{}/{}]",
+                            pkgi_mode_to_string(mode),
+                            i + 1,
+                            mode_count));
+            // the size probe of an unchanged list is answered by the cache,
+            // the lists themselves are too big to be cached. They are
+            // inflated below the cache so that it only sees plain bytes.
+            auto const http = std::make_unique<CachingHttp>(
+                    std::make_unique<InflatingHttp>(
+                            std::make_unique<VitaHttp>()),
+                    pkgi_http_cache_path(),
+                    LIST_PROBE_TTL);
             db->update(mode, http.get(), url);
         }
         int plugin_present = pkgi_is_module_present("ref00d") || 
             pkgi_is_module_present("0syscall6");
         if (!config.comppack_url.empty() && !plugin_present)
         {
+            ui_events.post(
+                    UiEvent::RefreshStage,
+                    "",
+                    fmt::format(
+                            "正在刷新 游戏本体兼容包 [{}/{}]",
+                            ModeCount + 2 - 1,
+                            ModeCount + 2));
             {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 游戏本体兼容包 [{}/{}]",
-                        ModeCount + 2 - 1,
-                        ModeCount + 2);
-            }
-            {
-                auto const http = std::make_unique<VitaHttp>();
+                auto const http = std::make_unique<InflatingHttp>(
+                        std::make_unique<VitaHttp>());
                 comppack_db_games->update(
                         http.get(), config.comppack_url + "entries.txt");
             }
+            ui_events.post(
+                    UiEvent::RefreshStage,
+                    "",
+                    fmt::format(
+                            "正在刷新 游戏更新兼容包 [{}/{}]",
+                            ModeCount + 2,
+                            ModeCount + 2));
             {
-                std::lock_guard<Mutex> lock(refresh_mutex);
-                current_action = fmt::format(
-                        "正在刷新 游戏更新兼容包 [{}/{}]",
-                        ModeCount + 2,
-                        ModeCount + 2);
-            }
-            {
-                auto const http = std::make_unique<VitaHttp>();
+                auto const http = std::make_unique<InflatingHttp>(
+                        std::make_unique<VitaHttp>());
                 comppack_db_updates->update(
                         http.get(), config.comppack_url + "entries_patch.txt");
             }
         }
-        first_item = 0;
-        selected_item = 0;
-        configure_db(db.get(), NULL, &config);
+        ui_events.post(UiEvent::RefreshFinished, "");
     }
     catch (const std::exception& e)
     {
-        snprintf(
-                error_state,
-                sizeof(error_state),
-                "无法获取列表: %s",
-                e.what());
-        pkgi_dialog_error(error_state);
+        ui_events.post(UiEvent::RefreshFinished, "", e.what());
     }
-    state = StateMain;
 }
 
 const char* pkgi_get_mode_partition()
@@ -314,7 +339,8 @@ void pkgi_refresh_list()
     pkgi_start_thread("refresh_thread", &pkgi_refresh_thread);
 }
 
-void pkgi_do_main(Downloader& downloader, pkgi_input* input)
+void pkgi_do_main(
+        Downloader& downloader, FetchService& fetch_service, pkgi_input* input)
 {
     int col_titleid = 0;
     int col_region = col_titleid + pkgi_text_width("PCSE00000") +
@@ -325,6 +351,8 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input)
                    PKGI_MAIN_COLUMN_PADDING;
 
     uint32_t db_count = db->count();
+    // the queue is looked up for every row, from one snapshot
+    const auto queue = downloader.snapshot();
 
     if (input)
     {
@@ -425,38 +453,38 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input)
             case ModeDemos:
                 if (pkgi_is_installed(titleid))
                     item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(Game, item->content))
+                else if (queue->contains(Game, item->content))
                     item->presence = PresenceInstalling;
                 break;
             case ModePsmGames:
                 if (pkgi_psm_is_installed(pkgi_get_mode_partition(), titleid))
                     item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PsmGame, item->content))
+                else if (queue->contains(PsmGame, item->content))
                     item->presence = PresenceInstalling;
                 break;
             case ModePspDlcs:
                 if (pkgi_psp_is_installed(
                             pkgi_get_mode_partition(), config.install_psp_game_path.c_str(), config.install_psp_iso_path.c_str(), item->content.c_str()))
                     item->presence = PresenceGamePresent;
-                else if (downloader.is_in_queue(PspGame, item->content))
+                else if (queue->contains(PspGame, item->content))
                     item->presence = PresenceInstalling;
                 break;
             case ModePspGames:
                 if (pkgi_psp_is_installed(
                             pkgi_get_mode_partition(), config.install_psp_game_path.c_str(), config.install_psp_iso_path.c_str(), item->content.c_str()))
                     item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PspGame, item->content))
+                else if (queue->contains(PspGame, item->content))
                     item->presence = PresenceInstalling;
                 break;
             case ModePsxGames:
                 if (pkgi_psx_is_installed(
                             pkgi_get_mode_partition(), config.install_psp_psx_path.c_str(), item->content.c_str()))
                     item->presence = PresenceInstalled;
-                else if (downloader.is_in_queue(PsxGame, item->content))
+                else if (queue->contains(PsxGame, item->content))
                     item->presence = PresenceInstalling;
                 break;
             case ModeDlcs:
-                if (downloader.is_in_queue(Dlc, item->content))
+                if (queue->contains(Dlc, item->content))
                     item->presence = PresenceInstalling;
                 else if (pkgi_dlc_is_installed(item->partition.c_str(), item->content.c_str()))
                     item->presence = PresenceInstalled;
@@ -620,6 +648,7 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input)
             gameview = std::make_unique<GameView>(
                     &config,
                     &downloader,
+                    &fetch_service,
                     item,
                     comppack_db_games->get(item->titleid),
                     comppack_db_updates->get(item->titleid));
@@ -629,7 +658,7 @@ void pkgi_do_main(Downloader& downloader, pkgi_input* input)
         }
         else
         {
-            if (downloader.is_in_queue(mode_to_type(mode), item->content))
+            if (queue->contains(mode_to_type(mode), item->content))
             {
                 downloader.remove_from_queue(mode_to_type(mode), item->content);
                 item->presence = PresenceUnknown;
@@ -762,6 +791,9 @@ uint64_t get_speed(const uint64_t download_offset)
     if (progress_time < 1000)
         return last_progress_speed;
 
+    // a download ended, its bytes are no longer counted
+    if (download_offset < last_progress_offset)
+        last_progress_offset = download_offset;
     const uint64_t progress_data = download_offset - last_progress_offset;
     last_progress_speed = progress_data * 1000 / progress_time;
     last_progress_offset = download_offset;
@@ -777,12 +809,18 @@ void pkgi_do_tail(Downloader& downloader)
     pkgi_draw_rect(
             0, bottom_y, VITA_WIDTH, PKGI_MAIN_HLINE_HEIGHT, PKGI_COLOR_HLINE);
 
-    const auto current_download = downloader.get_current_download();
+    const auto queue = downloader.snapshot();
+    const auto current_download =
+            queue->active.empty() ? nullptr : &queue->active.front();
 
-    uint64_t download_offset;
-    uint64_t download_size;
-    std::tie(download_offset, download_size) =
-            downloader.get_current_download_progress();
+    // the bar and the speed are those of all the running downloads
+    uint64_t download_offset = 0;
+    uint64_t download_size = 0;
+    for (const auto& active : queue->active)
+    {
+        download_offset += active.progress->offset;
+        download_size += active.progress->size;
+    }
     // avoid divide by 0
     if (download_size == 0)
         download_size = 1;
@@ -806,15 +844,29 @@ void pkgi_do_tail(Downloader& downloader)
         else
             sspeed = fmt::format("{} B/s", speed);
 
+        // the other running downloads are only counted
+        const auto others =
+                queue->active.size() > 1
+                        ? fmt::format(" +{}", queue->active.size() - 1)
+                        : std::string();
+
         pkgi_snprintf(
                 text,
                 sizeof(text),
-                "正在下载 %s: %s (%s, %d%%)",
-                type_to_string(current_download->type).c_str(),
-                current_download->name.c_str(),
+                "正在下载 %s: %s%s (%s, %d%%)",
+                type_to_string(current_download->item.type).c_str(),
+                current_download->item.name.c_str(),
+                others.c_str(),
                 sspeed.c_str(),
                 static_cast<int>(download_offset * 100 / download_size));
     }
+    else if (!queue->installing.empty())
+        pkgi_snprintf(
+                text,
+                sizeof(text),
+                "正在安装 %s: %s",
+                type_to_string(queue->installing.front().type).c_str(),
+                queue->installing.front().name.c_str());
     else
         pkgi_snprintf(text, sizeof(text), "暂无下载");
 
@@ -855,7 +907,7 @@ void pkgi_do_tail(Downloader& downloader)
     int right = rightw + PKGI_MAIN_TEXT_PADDING;
 
     std::string bottom_text;
-    if (gameview || pkgi_dialog_is_open()) {
+    if (gameview || updatesview || pkgi_dialog_is_open()) {
         bottom_text = fmt::format(
                 "{} 选择 {} 关闭",
                 pkgi_get_ok_str(),
@@ -896,6 +948,53 @@ void pkgi_do_tail(Downloader& downloader)
     pkgi_clip_remove();
 }
 
+void pkgi_handle_event(const UiEvent& event)
+{
+    switch (event.kind)
+    {
+    case UiEvent::DownloadFinished:
+        if (!event.content.empty())
+        {
+            const auto item = db->get_by_content(event.content.c_str());
+            if (item)
+                item->presence = PresenceUnknown;
+            else
+                LOGF("couldn't find {} for refresh", event.content);
+        }
+        need_refresh = true;
+        break;
+    case UiEvent::DownloadFailed:
+        pkgi_dialog_error(("下载失败: " + event.text).c_str());
+        break;
+    case UiEvent::RefreshStage:
+        current_action = event.text;
+        break;
+    case UiEvent::RefreshFinished:
+        first_item = 0;
+        selected_item = 0;
+        try
+        {
+            db->apply_update();
+        }
+        catch (const std::exception& e)
+        {
+            LOGF("error applying the refresh: {}", e.what());
+        }
+        configure_db(db.get(), NULL, &config);
+        if (!event.text.empty())
+        {
+            snprintf(
+                    error_state,
+                    sizeof(error_state),
+                    "无法获取列表: %s",
+                    event.text.c_str());
+            pkgi_dialog_error(error_state);
+        }
+        state = StateMain;
+        break;
+    }
+}
+
 void pkgi_do_error(void)
 {
     pkgi_draw_text(
@@ -951,12 +1050,33 @@ void pkgi_open_db()
     {
         first_item = 0;
         selected_item = 0;
-        db = std::make_unique<TitleDatabase>(pkgi_get_config_folder());
-
-        comppack_db_games = std::make_unique<CompPackDatabase>(
-                std::string(pkgi_get_config_folder()) + "/comppack.db");
-        comppack_db_updates = std::make_unique<CompPackDatabase>(
-                std::string(pkgi_get_config_folder()) + "/comppack_updates.db");
+        const auto search_flags =
+                config.search_fold_kana ? SearchKeyFoldKana : 0;
+        if (config.sqlite_catalog)
+        {
+            db = std::make_unique<CatalogTitleDatabase>(
+                    pkgi_get_config_folder(), search_flags);
+
+            const auto catalog = fmt::format(
+                    "{}/{}",
+                    pkgi_get_config_folder(),
+                    CatalogTitleDatabase::FILE_NAME);
+            comppack_db_games = std::make_unique<CompPackDatabase>(
+                    catalog, "comppack_games");
+            comppack_db_updates = std::make_unique<CompPackDatabase>(
+                    catalog, "comppack_updates");
+        }
+        else
+        {
+            db = std::make_unique<TsvTitleDatabase>(
+                    pkgi_get_config_folder(), search_flags);
+
+            comppack_db_games = std::make_unique<CompPackDatabase>(
+                    std::string(pkgi_get_config_folder()) + "/comppack.db");
+            comppack_db_updates = std::make_unique<CompPackDatabase>(
+                    std::string(pkgi_get_config_folder()) +
+                    "/comppack_updates.db");
+        }
     }
     catch (const std::exception& e)
     {
@@ -1018,7 +1138,8 @@ void pkgi_start_download(Downloader& downloader, const DbItem& item)
                         config.install_psp_game_path,
                         config.install_psp_iso_path,
                         config.install_psp_psx_path,
-                        ""});
+                        "",
+                        static_cast<uint64_t>(std::max<int64_t>(item.size, 0))});
         }
         else
         {
@@ -1044,20 +1165,35 @@ int main()
                     "PKGj需要在Henkaku设置中启用不安全自制软件!");
 
         Downloader downloader;
+        // the downloader may still post while it stops
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            ui_events.close();
+        };
+        FetchService fetch_service(FETCH_WORKERS, [] {
+            return std::make_unique<VitaHttp>();
+        });
+        // its fetches must be released before the service goes away
+        BOOST_SCOPE_EXIT_ALL(&)
+        {
+            gameview = nullptr;
+            updatesview = nullptr;
+        };
 
         downloader.refresh = [](const std::string& content) {
-            std::lock_guard<Mutex> lock(refresh_mutex);
-            content_to_refresh = content;
-            need_refresh = true;
+            ui_events.post(UiEvent::DownloadFinished, content);
         };
         downloader.error = [](const std::string& error) {
-            // FIXME this runs on the wrong thread
-            pkgi_dialog_error(("下载失败: " + error).c_str());
+            ui_events.post(UiEvent::DownloadFailed, "", error);
         };
 
         LOG("started");
 
         config = pkgi_load_config();
+        downloader.pkg_mirrors = config.pkg_mirrors;
+        downloader.set_slots(std::max(config.download_slots, 0));
+        // the queue of the last run, its packages resume where they stopped
+        downloader.restore(std::make_unique<QueueJournal>());
         pkgi_dialog_init();
 
         font_height = pkgi_text_height("M");
@@ -1103,6 +1239,10 @@ int main()
 
         init_imgui();
 
+#ifdef PKGI_ENABLE_LOCK_STATS
+        auto last_lock_stats = pkgi_time_msec();
+#endif
+
         pkgi_input input;
         while (pkgi_update(&input))
         {
@@ -1111,7 +1251,7 @@ int main()
             io.DisplaySize.x = VITA_WIDTH;
             io.DisplaySize.y = VITA_HEIGHT;
 
-            if (gameview || pkgi_dialog_is_open())
+            if (gameview || updatesview || pkgi_dialog_is_open())
             {
                 if (input.pressed & PKGI_BUTTON_UP)
                     io.NavInputs[ImGuiNavInput_DpadUp] = 1.0f;
@@ -1125,26 +1265,18 @@ int main()
                     io.NavInputs[ImGuiNavInput_Activate] = 1.0f;
                 if (input.pressed & pkgi_cancel_button() && gameview)
                     gameview->close();
+                else if (input.pressed & pkgi_cancel_button() && updatesview)
+                    updatesview->close();
 
                 input.active = 0;
                 input.pressed = 0;
             }
 
+            ui_events.drain(pkgi_handle_event);
+
             if (need_refresh)
             {
-                std::lock_guard<Mutex> lock(refresh_mutex);
                 pkgi_refresh_installed_packages();
-                if (!content_to_refresh.empty())
-                {
-                    const auto item =
-                            db->get_by_content(content_to_refresh.c_str());
-                    if (item)
-                        item->presence = PresenceUnknown;
-                    else
-                        LOGF("couldn't find {} for refresh",
-                             content_to_refresh);
-                    content_to_refresh.clear();
-                }
                 if (gameview)
                     gameview->refresh();
                 need_refresh = false;
@@ -1168,6 +1300,7 @@ int main()
             case StateMain:
                 pkgi_do_main(
                         downloader,
+                        fetch_service,
                         pkgi_dialog_is_open() || pkgi_menu_is_open() ? NULL
                                                                      : &input);
                 break;
@@ -1181,6 +1314,12 @@ int main()
                 if (gameview->is_closed())
                     gameview = nullptr;
             }
+            else if (updatesview)
+            {
+                updatesview->render();
+                if (updatesview->is_closed())
+                    updatesview = nullptr;
+            }
 
             if (pkgi_dialog_is_open())
             {
@@ -1245,6 +1384,12 @@ int main()
                     case MenuResultRefresh:
                         pkgi_refresh_list();
                         break;
+                    case MenuResultCheckUpdates:
+                        updatesview = std::make_unique<UpdatesView>(
+                                &fetch_service,
+                                config.install_psv_location,
+                                installed_games);
+                        break;
                     case MenuResultShowGames:
                         pkgi_set_mode(ModeGames);
                         break;
@@ -1279,6 +1424,14 @@ int main()
             pkgi_imgui_render(ImGui::GetDrawData());
 
             pkgi_swap();
+
+#ifdef PKGI_ENABLE_LOCK_STATS
+            if (pkgi_time_msec() - last_lock_stats >= LOCK_STATS_INTERVAL)
+            {
+                LockStats::dump();
+                last_lock_stats = pkgi_time_msec();
+            }
+#endif
         }
     }
     catch (const std::exception& e)
@@ -1298,6 +1451,9 @@ int main()
         pkgi_end();
     }
 
+#ifdef PKGI_ENABLE_LOCK_STATS
+    LockStats::dump();
+#endif
     LOG("finished");
     pkgi_end();
 }
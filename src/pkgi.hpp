@@ -70,6 +70,8 @@ const char* pkgi_get_config_folder(void);
 int pkgi_is_incomplete(const char* partition, const char* titleid);
 
 uint32_t pkgi_time_msec();
+// incremented every time the system resumes from suspend
+uint32_t pkgi_resume_count();
 
 typedef void pkgi_thread_entry(void);
 void pkgi_start_thread(const char* name, pkgi_thread_entry* start);
@@ -0,0 +1,311 @@
+#include "queuejournal.hpp"
+
+#include "file.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <cereal/archives/binary.hpp>
+
+#include <algorithm>
+#include <sstream>
+
+#include <cstring>
+
+namespace
+{
+enum Kind : uint8_t
+{
+    KindAdd,
+    KindRemove,
+    KindComplete,
+};
+
+// size and checksum of the payload
+constexpr size_t RECORD_HEADER_SIZE = 8;
+
+// FNV-1a, enough to find a record torn by a crash
+uint32_t checksum(const uint8_t* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void save_bytes(
+        cereal::BinaryOutputArchive& oarchive, const void* data, size_t size)
+{
+    oarchive(static_cast<uint32_t>(size));
+    oarchive.saveBinary(data, size);
+}
+
+void save_string(cereal::BinaryOutputArchive& oarchive, const std::string& str)
+{
+    save_bytes(oarchive, str.data(), str.size());
+}
+
+std::string load_string(cereal::BinaryInputArchive& iarchive)
+{
+    uint32_t size;
+    iarchive(size);
+    std::string str(size, '\0');
+    iarchive.loadBinary(&str[0], size);
+    return str;
+}
+
+std::vector<uint8_t> load_bytes(cereal::BinaryInputArchive& iarchive)
+{
+    uint32_t size;
+    iarchive(size);
+    std::vector<uint8_t> bytes(size);
+    iarchive.loadBinary(bytes.data(), size);
+    return bytes;
+}
+
+std::vector<uint8_t> to_bytes(const std::ostringstream& ss)
+{
+    const auto str = ss.str();
+    return std::vector<uint8_t>(str.begin(), str.end());
+}
+
+std::vector<uint8_t> encode_add(const DownloadItem& item)
+{
+    std::ostringstream ss;
+    {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(static_cast<uint8_t>(KindAdd));
+        oarchive(static_cast<uint8_t>(item.type));
+        save_string(oarchive, item.name);
+        save_string(oarchive, item.content);
+        save_string(oarchive, item.url);
+        save_bytes(oarchive, item.rif.data(), item.rif.size());
+        save_bytes(oarchive, item.digest.data(), item.digest.size());
+        oarchive(static_cast<uint8_t>(item.save_as_iso));
+        save_string(oarchive, item.partition);
+        save_string(oarchive, item.game_path);
+        save_string(oarchive, item.iso_path);
+        save_string(oarchive, item.psx_path);
+        save_string(oarchive, item.version);
+        oarchive(item.size);
+    }
+    return to_bytes(ss);
+}
+
+std::vector<uint8_t> encode_erase(
+        Kind kind, Type type, const std::string& content)
+{
+    std::ostringstream ss;
+    {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(static_cast<uint8_t>(kind));
+        oarchive(static_cast<uint8_t>(type));
+        save_string(oarchive, content);
+    }
+    return to_bytes(ss);
+}
+
+void frame(std::vector<uint8_t>& out, const std::vector<uint8_t>& payload)
+{
+    const uint32_t header[2] = {
+            static_cast<uint32_t>(payload.size()),
+            checksum(payload.data(), payload.size())};
+    const auto begin = reinterpret_cast<const uint8_t*>(header);
+    out.insert(out.end(), begin, begin + sizeof(header));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+}
+
+std::string pkgi_queue_journal_path()
+{
+    return fmt::format("{}/queue.journal", pkgi_get_config_folder());
+}
+
+QueueJournal::QueueJournal(std::string path) : _path(std::move(path))
+{
+}
+
+QueueJournal::~QueueJournal()
+{
+    close();
+}
+
+std::vector<DownloadItem> QueueJournal::load()
+{
+    close();
+    _items.clear();
+    _records = 0;
+    try
+    {
+        // a compaction was cut between the removal of the file and the rename
+        // of the new one
+        auto path = _path;
+        if (!pkgi_file_exists(path) && pkgi_file_exists(path + ".tmp"))
+            path += ".tmp";
+        if (pkgi_file_exists(path))
+            replay(pkgi_load(path));
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to load download queue journal: {}", e.what());
+    }
+    LOGF("download queue journal: {} records, {} items queued",
+         _records,
+         _items.size());
+    // also cuts a torn record, appending after it would lose the next ones
+    compact();
+    return _items;
+}
+
+void QueueJournal::replay(const std::vector<uint8_t>& data)
+{
+    if (data.empty())
+        return;
+    if (data[0] != FILE_VERSION)
+        throw formatEx<std::runtime_error>(
+                "unsupported download queue journal version {}", data[0]);
+
+    size_t pos = 1;
+    while (pos < data.size())
+    {
+        uint32_t header[2];
+        if (data.size() - pos < sizeof(header))
+        {
+            LOGF("download queue journal: torn record header at {}", pos);
+            return;
+        }
+        std::memcpy(header, data.data() + pos, sizeof(header));
+        const auto payload = data.data() + pos + RECORD_HEADER_SIZE;
+        if (data.size() - pos - RECORD_HEADER_SIZE < header[0] ||
+            checksum(payload, header[0]) != header[1])
+        {
+            LOGF("download queue journal: torn record at {}", pos);
+            return;
+        }
+        pos += RECORD_HEADER_SIZE + header[0];
+
+        std::istringstream ss(std::string(payload, payload + header[0]));
+        cereal::BinaryInputArchive iarchive(ss);
+        uint8_t kind;
+        uint8_t type;
+        iarchive(kind, type);
+        if (kind == KindAdd)
+        {
+            DownloadItem item;
+            item.type = static_cast<Type>(type);
+            item.name = load_string(iarchive);
+            item.content = load_string(iarchive);
+            item.url = load_string(iarchive);
+            item.rif = load_bytes(iarchive);
+            item.digest = load_bytes(iarchive);
+            uint8_t save_as_iso;
+            iarchive(save_as_iso);
+            item.save_as_iso = save_as_iso;
+            item.partition = load_string(iarchive);
+            item.game_path = load_string(iarchive);
+            item.iso_path = load_string(iarchive);
+            item.psx_path = load_string(iarchive);
+            item.version = load_string(iarchive);
+            iarchive(item.size);
+            _items.push_back(std::move(item));
+        }
+        else if (kind == KindRemove || kind == KindComplete)
+            erase(static_cast<Type>(type), load_string(iarchive));
+        else
+            throw formatEx<std::runtime_error>(
+                    "unknown download queue journal record {}", kind);
+        ++_records;
+    }
+}
+
+void QueueJournal::added(const DownloadItem& item)
+{
+    _items.push_back(item);
+    append(encode_add(item));
+}
+
+void QueueJournal::removed(Type type, const std::string& content)
+{
+    erase(type, content);
+    append(encode_erase(KindRemove, type, content));
+}
+
+void QueueJournal::completed(Type type, const std::string& content)
+{
+    erase(type, content);
+    append(encode_erase(KindComplete, type, content));
+}
+
+void QueueJournal::erase(Type type, const std::string& content)
+{
+    _items.erase(
+            std::remove_if(
+                    _items.begin(),
+                    _items.end(),
+                    [&](const auto& item) {
+                        return item.type == type && item.content == content;
+                    }),
+            _items.end());
+}
+
+void QueueJournal::append(const std::vector<uint8_t>& payload)
+{
+    if (!_file)
+        return;
+
+    std::vector<uint8_t> record;
+    frame(record, payload);
+    try
+    {
+        // a single write, a crash leaves at most this record torn
+        if (pkgi_write(_file, record.data(), record.size()) !=
+            static_cast<int>(record.size()))
+            throw std::runtime_error("short write");
+        ++_records;
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to write download queue journal: {}", e.what());
+        return;
+    }
+
+    if (_records > _items.size() + COMPACT_RECORDS)
+        compact();
+}
+
+void QueueJournal::close()
+{
+    if (_file)
+    {
+        pkgi_close(_file);
+        _file = nullptr;
+    }
+}
+
+void QueueJournal::compact()
+{
+    close();
+    try
+    {
+        std::vector<uint8_t> data{FILE_VERSION};
+        for (const auto& item : _items)
+            frame(data, encode_add(item));
+
+        const auto tmp_path = _path + ".tmp";
+        pkgi_save(tmp_path, data.data(), data.size());
+        pkgi_rename(tmp_path, _path);
+        _records = _items.size();
+
+        _file = pkgi_append(_path.c_str());
+        if (!_file)
+            throw formatEx<std::runtime_error>("can't open {}", _path);
+    }
+    catch (const std::exception& e)
+    {
+        LOGF("failed to compact download queue journal: {}", e.what());
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "downloader.hpp"
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+std::string pkgi_queue_journal_path();
+
+// The download queue on disk, so that it survives a restart or a crash.
+// Every change is appended to the file as one record, load() replays them.
+// A record carries its size and a checksum, a record torn by a crash ends
+// the replay and is dropped.
+//
+// On load and once more than COMPACT_RECORDS records are dead, the file is
+// rewritten next to it with only the queued items and renamed over it.
+//
+// Not thread safe, the Downloader calls it with its mutex held. Failing to
+// write is only logged, the downloads go on.
+class QueueJournal
+{
+public:
+    static constexpr uint8_t FILE_VERSION = 1;
+    static constexpr size_t COMPACT_RECORDS = 64;
+
+    explicit QueueJournal(std::string path = pkgi_queue_journal_path());
+    ~QueueJournal();
+
+    QueueJournal(const QueueJournal&) = delete;
+    QueueJournal& operator=(const QueueJournal&) = delete;
+
+    // the queued items, in the order they were added, and opens the file for
+    // the next records
+    std::vector<DownloadItem> load();
+
+    void added(const DownloadItem& item);
+    // the user removed the item or it failed
+    void removed(Type type, const std::string& content);
+    // the item was downloaded and installed
+    void completed(Type type, const std::string& content);
+
+    // records in the file
+    size_t records() const
+    {
+        return _records;
+    }
+
+private:
+    std::string _path;
+    void* _file = nullptr;
+    // what the records in the file leave queued
+    std::vector<DownloadItem> _items;
+    size_t _records = 0;
+
+    void replay(const std::vector<uint8_t>& data);
+    void erase(Type type, const std::string& content);
+    void append(const std::vector<uint8_t>& payload);
+    void close();
+    // rewrites the file with _items
+    void compact();
+};
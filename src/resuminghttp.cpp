@@ -0,0 +1,183 @@
+#include "resuminghttp.hpp"
+
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+
+namespace
+{
+std::atomic<unsigned> g_reconnections{0};
+
+constexpr uint32_t BACKOFF_SLICE_MS = 100;
+}
+
+ResumingHttp::ResumingHttp(
+        std::unique_ptr<Http> http, std::function<bool()> is_canceled)
+    : _http(std::move(http)), _is_canceled(std::move(is_canceled))
+{
+}
+
+unsigned ResumingHttp::reconnections()
+{
+    return g_reconnections;
+}
+
+void ResumingHttp::start(const std::string& url, uint64_t offset, bool head)
+{
+    _url = url;
+    _offset = offset;
+    _end = 0;
+    _validator.clear();
+    _retries = 0;
+    _aborted = false;
+    _http->start(url, offset, head);
+}
+
+int64_t ResumingHttp::read(uint8_t* buffer, uint64_t size)
+{
+    while (true)
+    {
+        try
+        {
+            const auto read = _http->read(buffer, size);
+            if (read > 0 || size == 0 || _offset >= _end)
+            {
+                _offset += read;
+                if (read > 0)
+                    _retries = 0;
+                return read;
+            }
+            LOGF("http connection closed at {} of {}", _offset, _end);
+        }
+        catch (const HttpError& e)
+        {
+            if (_end == 0 || _aborted || canceled())
+                throw;
+            LOGF("http read failed at {} of {}: {}", _offset, _end, e.what());
+        }
+
+        reconnect();
+    }
+}
+
+void ResumingHttp::reconnect()
+{
+    while (true)
+    {
+        if (_retries == MAX_RETRIES)
+            throw formatEx<HttpError>(
+                    "重试 {} 次后仍无法恢复连接", MAX_RETRIES);
+        _http->close();
+        backoff();
+
+        ++g_reconnections;
+        LOGF("resuming {} @ {}, attempt {}", _url, _offset, _retries);
+        int status;
+        try
+        {
+            if (!_validator.empty())
+                _http->add_request_header("If-Range", _validator);
+            _http->start(_url, _offset);
+            status = _http->get_status();
+        }
+        catch (const HttpError& e)
+        {
+            LOGF("reconnection failed: {}", e.what());
+            continue;
+        }
+
+        // a 200 to a ranged request means the server ignored the range or
+        // If-Range did not match, the file changed under us
+        if (_offset != 0 && status == 200)
+            throw HttpError("服务器上的文件已更改, 无法继续下载");
+        if (status != (_offset == 0 ? 200 : 206))
+        {
+            LOGF("reconnection failed with status {}", status);
+            continue;
+        }
+
+        const auto length = _http->get_length();
+        if (length <= 0 || _offset + length != _end)
+            throw formatEx<HttpError>(
+                    "服务器上的文件大小已更改: {} != {}",
+                    _offset + length,
+                    _end);
+        return;
+    }
+}
+
+void ResumingHttp::backoff()
+{
+    const auto delay =
+            std::min(MAX_BACKOFF_MS, MIN_BACKOFF_MS << std::min(_retries, 16u));
+    ++_retries;
+    // slept in slices to not delay a cancellation
+    for (uint32_t slept = 0; slept < delay; slept += BACKOFF_SLICE_MS)
+    {
+        if (_aborted || canceled())
+            throw HttpError("下载已被取消");
+        pkgi_sleep(BACKOFF_SLICE_MS);
+    }
+}
+
+bool ResumingHttp::canceled() const
+{
+    return _is_canceled && _is_canceled();
+}
+
+void ResumingHttp::abort()
+{
+    _aborted = true;
+    _http->abort();
+}
+
+void ResumingHttp::close()
+{
+    _end = 0;
+    _http->close();
+}
+
+int ResumingHttp::get_status()
+{
+    return _http->get_status();
+}
+
+int64_t ResumingHttp::get_length()
+{
+    const auto length = _http->get_length();
+    // only a response with a known length can be resumed, and only a strong
+    // ETag guarantees that the bytes are the same
+    if (length > 0 && _end == 0)
+    {
+        _end = _offset + length;
+        _validator = _http->get_response_header("ETag");
+        if (_validator.compare(0, 2, "W/") == 0)
+            _validator.clear();
+        if (_validator.empty())
+            _validator = _http->get_response_header("Last-Modified");
+    }
+    return length;
+}
+
+void ResumingHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _http->add_request_header(name, value);
+}
+
+std::string ResumingHttp::get_response_header(const std::string& name)
+{
+    return _http->get_response_header(name);
+}
+
+void ResumingHttp::set_max_connections(unsigned connections)
+{
+    _http->set_max_connections(connections);
+}
+
+ResumingHttp::operator bool() const
+{
+    return static_cast<bool>(*_http);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <cstdint>
+
+// Reconnects the wrapped Http when a response breaks before its end. Once the
+// caller asked for the length of a response, a read that fails or ends early
+// reopens the url with a Range at the exact offset reached, guarded by an
+// If-Range on the ETag or Last-Modified of the first response. Attempts are
+// spaced with a capped exponential backoff and given up after MAX_RETRIES
+// failures in a row.
+class ResumingHttp : public Http
+{
+public:
+    static constexpr unsigned MAX_RETRIES = 8;
+    static constexpr uint32_t MIN_BACKOFF_MS = 500;
+    static constexpr uint32_t MAX_BACKOFF_MS = 16 * 1000;
+
+    // is_canceled is polled while waiting between attempts
+    ResumingHttp(
+            std::unique_ptr<Http> http,
+            std::function<bool()> is_canceled = nullptr);
+
+    void start(const std::string& url, uint64_t offset, bool head = false) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+    void close() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+    void set_max_connections(unsigned connections) override;
+
+    explicit operator bool() const override;
+
+    // number of reconnections over all instances
+    static unsigned reconnections();
+
+private:
+    std::unique_ptr<Http> _http;
+    std::function<bool()> _is_canceled;
+
+    std::string _url;
+    uint64_t _offset = 0;
+    // offset of the end of the response, 0 while it can't be resumed
+    uint64_t _end = 0;
+    std::string _validator;
+    unsigned _retries = 0;
+    std::atomic<bool> _aborted{false};
+
+    bool canceled() const;
+    void backoff();
+    void reconnect();
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Indices written by different threads are kept on separate cache lines. The
+// Cortex-A9 of the Vita has 32 byte lines, most hosts 64.
+constexpr size_t RING_CACHE_LINE = 64;
+
+// Wait policies of the rings: how a side waits for an element or for room.
+// wait() returns once ready() is true, notify() is called after every change
+// that may make it true.
+
+// Retries with a yield, for hand-offs between threads that are both busy. A
+// waiting thread never sleeps and keeps using its core.
+class SpinWait
+{
+public:
+    template <typename Ready>
+    void wait(Ready&& ready)
+    {
+        while (!ready())
+            Thread::yield();
+    }
+
+    void notify()
+    {
+    }
+};
+
+// Spins a little, yields a few times so that the other side gets to run when
+// both share a core, then sleeps on a Cond. notify() only takes the lock when
+// a thread sleeps, the hand-off stays lock free while both sides keep up.
+class BlockingWait
+{
+public:
+    static constexpr int SPINS = 64;
+    static constexpr int YIELDS = 8;
+
+    BlockingWait() : _cond("ring_wait_cond")
+    {
+    }
+
+    template <typename Ready>
+    void wait(Ready&& ready)
+    {
+        for (int i = 0; i < SPINS; ++i)
+        {
+            if (ready())
+                return;
+            if (i >= SPINS - YIELDS)
+                Thread::yield();
+        }
+
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        ++_sleepers;
+        while (!ready())
+            _cond.wait();
+        --_sleepers;
+    }
+
+    void notify()
+    {
+        // orders the change made by the caller before the read of _sleepers,
+        // a sleeper increments it before it checks ready()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+        {
+            std::lock_guard<Mutex> _(_cond.get_mutex());
+        }
+        _cond.notify_all();
+    }
+
+private:
+    Cond _cond;
+    std::atomic<unsigned> _sleepers{0};
+};
+
+namespace ring_detail
+{
+inline size_t round_up_pow2(size_t n)
+{
+    size_t size = 1;
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+}
+
+// Bounded queue between one producer and one consumer. Each side keeps a copy
+// of the index of the other and only reads the shared one when the copy says
+// the ring is full or empty.
+//
+// After close(), push() fails and pop() fails once the ring is empty.
+template <typename T, typename Wait = BlockingWait>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+        : _mask(ring_detail::round_up_pow2(capacity) - 1), _slots(_mask + 1)
+    {
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+
+    // value is only moved from on success
+    bool try_push(T& value)
+    {
+        const auto tail = _producer.tail;
+        if (tail - _producer.head_copy == capacity())
+        {
+            _producer.head_copy = _head.load(std::memory_order_acquire);
+            if (tail - _producer.head_copy == capacity())
+                return false;
+        }
+        _slots[tail & _mask] = std::move(value);
+        _producer.tail = tail + 1;
+        _tail.store(tail + 1, std::memory_order_release);
+        _not_empty.notify();
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        const auto head = _consumer.head;
+        if (head == _consumer.tail_copy)
+        {
+            _consumer.tail_copy = _tail.load(std::memory_order_acquire);
+            if (head == _consumer.tail_copy)
+                return false;
+        }
+        value = std::move(_slots[head & _mask]);
+        _consumer.head = head + 1;
+        _head.store(head + 1, std::memory_order_release);
+        _not_full.notify();
+        return true;
+    }
+
+    // waits for room, false when the ring was closed
+    bool push(T value)
+    {
+        while (!try_push(value))
+        {
+            if (closed())
+                return false;
+            _not_full.wait([&] {
+                const auto head = _head.load(std::memory_order_acquire);
+                return closed() || _producer.tail - head < capacity();
+            });
+        }
+        return true;
+    }
+
+    // waits for an element, false when the ring is closed and empty
+    bool pop(T& value)
+    {
+        while (!try_pop(value))
+        {
+            // the producer may have pushed right before closing
+            if (closed())
+                return try_pop(value);
+            _not_empty.wait([&] {
+                const auto tail = _tail.load(std::memory_order_acquire);
+                return closed() || _consumer.head != tail;
+            });
+        }
+        return true;
+    }
+
+    // called by either side, wakes up the other
+    void close()
+    {
+        _closed.store(true, std::memory_order_release);
+        _not_empty.notify();
+        _not_full.notify();
+    }
+
+    bool closed() const
+    {
+        return _closed.load(std::memory_order_acquire);
+    }
+
+private:
+    const size_t _mask;
+    std::vector<T> _slots;
+
+    alignas(RING_CACHE_LINE) std::atomic<size_t> _head{0};
+    alignas(RING_CACHE_LINE) std::atomic<size_t> _tail{0};
+
+    // only touched by the producer
+    struct alignas(RING_CACHE_LINE)
+    {
+        size_t tail = 0;
+        size_t head_copy = 0;
+    } _producer;
+
+    // only touched by the consumer
+    struct alignas(RING_CACHE_LINE)
+    {
+        size_t head = 0;
+        size_t tail_copy = 0;
+    } _consumer;
+
+    alignas(RING_CACHE_LINE) std::atomic<bool> _closed{false};
+    Wait _not_empty;
+    Wait _not_full;
+};
+
+// Bounded queue from several producers to one consumer. Producers reserve a
+// slot by moving the tail forward, every slot has a sequence number that says
+// whether it holds an element of the current turn.
+template <typename T, typename Wait = BlockingWait>
+class MpscRing
+{
+public:
+    explicit MpscRing(size_t capacity)
+        : _mask(ring_detail::round_up_pow2(capacity) - 1)
+        , _slots(new Slot[_mask + 1])
+    {
+        for (size_t i = 0; i <= _mask; ++i)
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+
+    // value is only moved from on success
+    bool try_push(T& value)
+    {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        while (true)
+        {
+            auto& slot = _slots[tail & _mask];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(sequence) -
+                              static_cast<intptr_t>(tail);
+            if (diff == 0)
+            {
+                if (_tail.compare_exchange_weak(
+                            tail, tail + 1, std::memory_order_relaxed))
+                {
+                    slot.value = std::move(value);
+                    slot.sequence.store(tail + 1, std::memory_order_release);
+                    _not_empty.notify();
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                tail = _tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T& value)
+    {
+        auto& slot = _slots[_head & _mask];
+        if (slot.sequence.load(std::memory_order_acquire) != _head + 1)
+            return false;
+        value = std::move(slot.value);
+        slot.sequence.store(_head + _mask + 1, std::memory_order_release);
+        ++_head;
+        _not_full.notify();
+        return true;
+    }
+
+    // waits for room, false when the ring was closed
+    bool push(T value)
+    {
+        while (!try_push(value))
+        {
+            if (closed())
+                return false;
+            _not_full.wait([&] { return closed() || has_room(); });
+        }
+        return true;
+    }
+
+    // waits for an element, false when the ring is closed and empty
+    bool pop(T& value)
+    {
+        while (!try_pop(value))
+        {
+            if (closed())
+                return try_pop(value);
+            _not_empty.wait([&] {
+                return closed() ||
+                       _slots[_head & _mask].sequence.load(
+                               std::memory_order_acquire) == _head + 1;
+            });
+        }
+        return true;
+    }
+
+    // producers still pushing may get their element in after the close
+    void close()
+    {
+        _closed.store(true, std::memory_order_release);
+        _not_empty.notify();
+        _not_full.notify();
+    }
+
+    bool closed() const
+    {
+        return _closed.load(std::memory_order_acquire);
+    }
+
+private:
+    struct alignas(RING_CACHE_LINE) Slot
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Slot[]> _slots;
+
+    alignas(RING_CACHE_LINE) std::atomic<size_t> _tail{0};
+    // only touched by the consumer
+    alignas(RING_CACHE_LINE) size_t _head = 0;
+
+    alignas(RING_CACHE_LINE) std::atomic<bool> _closed{false};
+    Wait _not_empty;
+    Wait _not_full;
+
+    bool has_room() const
+    {
+        const auto tail = _tail.load(std::memory_order_relaxed);
+        return _slots[tail & _mask].sequence.load(std::memory_order_acquire) ==
+               tail;
+    }
+};
+
+// A fixed set of buffers that go around between a producer and a consumer:
+// the producer fills a free buffer and sends it, the consumer receives it and
+// releases it when done. Only the descriptors go through the rings, the
+// buffers are allocated once and keep their capacity.
+template <typename Wait = BlockingWait>
+class BufferPipe
+{
+public:
+    struct Buffer
+    {
+        std::vector<uint8_t> data;
+        // bytes of data in use
+        size_t size = 0;
+    };
+
+    BufferPipe(size_t buffers, size_t buffer_size)
+        : _buffers(buffers), _free(buffers), _full(buffers)
+    {
+        for (auto& buffer : _buffers)
+        {
+            buffer.data.resize(buffer_size);
+            Buffer* free = &buffer;
+            _free.try_push(free);
+        }
+    }
+
+    // for the producer, nullptr once the consumer stopped
+    Buffer* acquire()
+    {
+        Buffer* buffer = nullptr;
+        if (!_free.pop(buffer))
+            return nullptr;
+        return buffer;
+    }
+
+    // false when the consumer stopped
+    bool send(Buffer* buffer)
+    {
+        return _full.push(buffer);
+    }
+
+    // for the consumer, nullptr at the end of the stream
+    Buffer* receive()
+    {
+        Buffer* buffer = nullptr;
+        if (!_full.pop(buffer))
+            return nullptr;
+        return buffer;
+    }
+
+    void release(Buffer* buffer)
+    {
+        _free.push(buffer);
+    }
+
+    // the producer is done, receive() returns the buffers already sent
+    void finish()
+    {
+        _full.close();
+    }
+
+    // the consumer gives up, acquire() and send() fail from now on
+    void cancel()
+    {
+        _free.close();
+        _full.close();
+    }
+
+private:
+    std::vector<Buffer> _buffers;
+    SpscRing<Buffer*, Wait> _free;
+    SpscRing<Buffer*, Wait> _full;
+};
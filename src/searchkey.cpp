@@ -0,0 +1,189 @@
+#include "searchkey.hpp"
+
+namespace
+{
+// U+FF66 to U+FF9D
+const char16_t halfwidth_katakana[] = {
+        0x30F2, 0x30A1, 0x30A3, 0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5,
+        0x30E7, 0x30C3, 0x30FC, 0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA,
+        0x30AB, 0x30AD, 0x30AF, 0x30B1, 0x30B3, 0x30B5, 0x30B7, 0x30B9,
+        0x30BB, 0x30BD, 0x30BF, 0x30C1, 0x30C4, 0x30C6, 0x30C8, 0x30CA,
+        0x30CB, 0x30CC, 0x30CD, 0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8,
+        0x30DB, 0x30DE, 0x30DF, 0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6,
+        0x30E8, 0x30E9, 0x30EA, 0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3,
+};
+
+// base letters of U+00C0 to U+00FF, 0 when the character is kept as is
+const char latin1_base[] =
+        "aaaaaaaceeeeiiiidnooooo\0ouuuuyts"
+        "aaaaaaaceeeeiiiidnooooo\0ouuuuyty";
+
+// base letters of U+0100 to U+017F
+const char latin_ext_a_base[] =
+        "aaaaaaccccccccddddeeeeeeeeeegggg"
+        "gggghhhhiiiiiiiiiiiijjkkklllllll"
+        "lllnnnnnnnnnoooooooorrrrrrssssss"
+        "ssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+bool is_kana(char32_t c)
+{
+    return (c >= 0x3041 && c <= 0x3096) || (c >= 0x30A1 && c <= 0x30FA);
+}
+
+// offset from a kana to its voiced form (dakuten), 0 if it has none
+int voiced_offset(char32_t c)
+{
+    if (c >= 0x3041 && c <= 0x3096)
+        c += 0x60;
+    if (c == 0x30A6)
+        return 0x30F4 - 0x30A6;
+    if ((c >= 0x30AB && c <= 0x30C2 && (c - 0x30AB) % 2 == 0) ||
+        c == 0x30C4 || c == 0x30C6 || c == 0x30C8)
+        return 1;
+    if (c >= 0x30CF && c <= 0x30DB && (c - 0x30CF) % 3 == 0)
+        return 1;
+    return 0;
+}
+
+// offset from a kana to its semi-voiced form (handakuten), 0 if it has none
+int semi_voiced_offset(char32_t c)
+{
+    if (c >= 0x3041 && c <= 0x3096)
+        c += 0x60;
+    if (c >= 0x30CF && c <= 0x30DB && (c - 0x30CF) % 3 == 0)
+        return 2;
+    return 0;
+}
+
+char32_t decode(const uint8_t*& ptr)
+{
+    const uint8_t c = *ptr++;
+    if (c < 0x80)
+        return c;
+
+    int extra;
+    char32_t cp;
+    if ((c & 0xE0) == 0xC0)
+    {
+        extra = 1;
+        cp = c & 0x1F;
+    }
+    else if ((c & 0xF0) == 0xE0)
+    {
+        extra = 2;
+        cp = c & 0x0F;
+    }
+    else if ((c & 0xF8) == 0xF0)
+    {
+        extra = 3;
+        cp = c & 0x07;
+    }
+    else
+        return 0xFFFD;
+
+    for (int i = 0; i < extra; ++i)
+    {
+        if ((*ptr & 0xC0) != 0x80)
+            return 0xFFFD;
+        cp = (cp << 6) | (*ptr++ & 0x3F);
+    }
+    return cp;
+}
+
+void encode(std::string& out, char32_t cp)
+{
+    if (cp < 0x80)
+        out.push_back(static_cast<char>(cp));
+    else if (cp < 0x800)
+    {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000)
+    {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+char32_t fold(char32_t c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+    if (c < 0x80)
+        return c;
+    // full-width ASCII
+    if (c >= 0xFF01 && c <= 0xFF5E)
+        return fold(c - 0xFEE0);
+    if (c == 0x3000)
+        return ' ';
+    if (c >= 0xFF66 && c <= 0xFF9D)
+        return halfwidth_katakana[c - 0xFF66];
+    if (c == 0xFF65)
+        return 0x30FB;
+    if (c >= 0xC0 && c <= 0xFF && latin1_base[c - 0xC0])
+        return latin1_base[c - 0xC0];
+    if (c >= 0x100 && c <= 0x17F)
+        return latin_ext_a_base[c - 0x100];
+    // Greek and Cyrillic capitals
+    if ((c >= 0x391 && c <= 0x3A9) || (c >= 0x410 && c <= 0x42F))
+        return c + 0x20;
+    if (c >= 0x400 && c <= 0x40F)
+        return c + 0x50;
+    return c;
+}
+}
+
+std::string pkgi_search_key(const char* text, uint32_t flags)
+{
+    std::string out;
+    char32_t pending = 0;
+
+    const auto flush = [&] {
+        if (!pending)
+            return;
+        if ((flags & SearchKeyFoldKana) && pending >= 0x30A1 &&
+            pending <= 0x30F6)
+            pending -= 0x60;
+        encode(out, pending);
+        pending = 0;
+    };
+
+    auto ptr = reinterpret_cast<const uint8_t*>(text);
+    while (*ptr)
+    {
+        const auto c = fold(decode(ptr));
+
+        // half-width and combining voiced sound marks
+        if (c == 0xFF9E || c == 0x3099 || c == 0x309B)
+        {
+            if (is_kana(pending) && voiced_offset(pending))
+            {
+                pending += voiced_offset(pending);
+                continue;
+            }
+        }
+        else if (c == 0xFF9F || c == 0x309A || c == 0x309C)
+        {
+            if (is_kana(pending) && semi_voiced_offset(pending))
+            {
+                pending += semi_voiced_offset(pending);
+                continue;
+            }
+        }
+
+        flush();
+        pending = c;
+    }
+    flush();
+
+    return out;
+}
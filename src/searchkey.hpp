@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+
+enum SearchKeyFlags
+{
+    // map katakana to hiragana so that either script matches the other
+    SearchKeyFoldKana = 0x01,
+};
+
+// Builds the key used to match titles against a search query. Full-width
+// ASCII and half-width katakana are folded to their canonical width, voiced
+// marks are composed, Latin, Greek and Cyrillic letters are lowercased and
+// Latin accents are stripped. Both the titles and the query must go through
+// this function with the same flags.
+std::string pkgi_search_key(const char* text, uint32_t flags);
@@ -101,9 +101,12 @@ bool pkgi_file_exists(const std::string& path)
     return stat(path.c_str(), &s) == 0;
 }
 
-int64_t pkgi_get_size(const char*)
+int64_t pkgi_get_size(const char* path)
 {
-    return 0;
+    struct stat s;
+    if (stat(path, &s) != 0)
+        return -1;
+    return s.st_size;
 }
 
 void pkgi_rename(const std::string& from, const std::string& to)
@@ -323,6 +326,24 @@ void* pkgi_openrw(const char* path)
     return (void*)(intptr_t)fd;
 }
 
+void* pkgi_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    return (void*)(intptr_t)fd;
+}
+
+void* pkgi_append(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+        return NULL;
+
+    return (void*)(intptr_t)fd;
+}
+
 int64_t pkgi_seek(void* f, uint64_t offset)
 {
     return lseek((intptr_t)f, offset, SEEK_SET);
@@ -351,3 +372,18 @@ uint32_t pkgi_time_msec()
 {
     return time(NULL) * 1000;
 }
+
+void pkgi_sleep(uint32_t msec)
+{
+    usleep(msec * 1000);
+}
+
+uint32_t pkgi_resume_count()
+{
+    return 0;
+}
+
+const char* pkgi_get_config_folder(void)
+{
+    return ".";
+}
@@ -0,0 +1,550 @@
+#include "sockethttp.hpp"
+
+#include "connectionpool.hpp"
+#include "log.hpp"
+#include "pkgi.hpp"
+
+#include <fmt/format.h>
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PKGI_USER_AGENT "pkgj_cli"
+
+namespace
+{
+constexpr auto SOCKET_TIMEOUT_SEC = 30;
+constexpr size_t MAX_ACTIVE_CONNECTIONS = 16;
+constexpr size_t MAX_IDLE_CONNECTIONS = 8;
+// a request waiting this long for a connection fails and is retried
+constexpr uint32_t ACQUIRE_TIMEOUT_MS = 60 * 1000;
+
+struct PoolSync
+{
+    std::mutex mutex;
+    std::condition_variable_any cond;
+
+    void lock()
+    {
+        mutex.lock();
+    }
+    void unlock()
+    {
+        mutex.unlock();
+    }
+    void wait_for(uint32_t timeout_ms)
+    {
+        cond.wait_for(mutex, std::chrono::milliseconds(timeout_ms));
+    }
+    void notify_one()
+    {
+        cond.notify_one();
+    }
+};
+
+// sockets kept alive, by origin
+ConnectionPool<int, PoolSync> g_pool(
+        MAX_ACTIVE_CONNECTIONS, MAX_IDLE_CONNECTIONS, ACQUIRE_TIMEOUT_MS);
+
+struct Url
+{
+    std::string host;
+    std::string port;
+    std::string path;
+};
+
+Url parse_url(const std::string& url)
+{
+    static const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0)
+        throw HttpError(fmt::format("不支持的链接: {}", url));
+
+    const auto rest = url.substr(scheme.size());
+    const auto slash = rest.find('/');
+    const auto authority = rest.substr(0, slash);
+
+    Url result;
+    result.path = slash == std::string::npos ? "/" : rest.substr(slash);
+    const auto colon = authority.rfind(':');
+    if (colon == std::string::npos)
+    {
+        result.host = authority;
+        result.port = "80";
+    }
+    else
+    {
+        result.host = authority.substr(0, colon);
+        result.port = authority.substr(colon + 1);
+    }
+    if (result.host.empty())
+        throw HttpError(fmt::format("不支持的链接: {}", url));
+    return result;
+}
+
+bool header_is(const std::string& line, const char* name, std::string* value)
+{
+    const auto len = strlen(name);
+    if (line.size() <= len || line[len] != ':' ||
+        strncasecmp(line.c_str(), name, len) != 0)
+        return false;
+    auto start = len + 1;
+    while (start < line.size() && (line[start] == ' ' || line[start] == '\t'))
+        ++start;
+    *value = line.substr(start);
+    return true;
+}
+
+bool contains_token(const std::string& value, const char* token)
+{
+    return strcasestr(value.c_str(), token) != nullptr;
+}
+
+// a Content-Length or a chunk size, which may be followed by extensions
+int64_t parse_length(const std::string& value, int base)
+{
+    const auto begin = value.c_str();
+    char* end;
+    errno = 0;
+    const auto length = std::strtoll(begin, &end, base);
+    const bool parsed = end != begin && errno != ERANGE && length >= 0;
+    while (*end == ' ' || *end == '\t')
+        ++end;
+    if (!parsed || (*end != '\0' && *end != ';'))
+        throw HttpError(fmt::format("无效的HTTP长度: {}", value));
+    return length;
+}
+}
+
+SocketHttp::~SocketHttp()
+{
+    close();
+}
+
+unsigned SocketHttp::reused_connections()
+{
+    return g_pool.reused();
+}
+
+size_t SocketHttp::spare_connections()
+{
+    return g_pool.spare();
+}
+
+void SocketHttp::connect(const std::string& host, const std::string& port)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses;
+    const auto err =
+            getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (err != 0)
+        throw formatEx<HttpError>(
+                "发送请求失败: {}\n{}", host, gai_strerror(err));
+    BOOST_SCOPE_EXIT_ALL(&)
+    {
+        freeaddrinfo(addresses);
+    };
+
+    int last_errno = 0;
+    for (auto address = addresses; address; address = address->ai_next)
+    {
+        const int fd = socket(
+                address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0)
+        {
+            last_errno = errno;
+            continue;
+        }
+
+        timeval timeout{SOCKET_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            _fd = fd;
+            return;
+        }
+        last_errno = errno;
+        ::close(fd);
+    }
+
+    throw formatEx<HttpError>(
+            "发送请求失败: {}:{}\n{}", host, port, strerror(last_errno));
+}
+
+bool SocketHttp::send_request(const std::string& request)
+{
+    size_t sent = 0;
+    while (sent < request.size())
+    {
+        const auto ret = ::send(
+                _fd,
+                request.data() + sent,
+                request.size() - sent,
+                MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        sent += ret;
+    }
+    return true;
+}
+
+size_t SocketHttp::fill()
+{
+    _buffer.resize(RECV_BUFFER_SIZE);
+    _buffer_pos = 0;
+    for (;;)
+    {
+        const auto ret = ::recv(_fd, &_buffer[0], _buffer.size(), 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+        {
+            _buffer.clear();
+            throw HttpError(fmt::format("下载错误: {}", strerror(errno)));
+        }
+        _buffer.resize(ret);
+        return ret;
+    }
+}
+
+std::string SocketHttp::read_line()
+{
+    std::string line;
+    for (;;)
+    {
+        if (_buffer_pos == _buffer.size() && fill() == 0)
+            throw HttpError("HTTP连接意外断开");
+
+        const auto begin = _buffer.begin() + _buffer_pos;
+        const auto eol = std::find(begin, _buffer.end(), '\n');
+        line.append(begin, eol);
+        if (eol == _buffer.end())
+        {
+            _buffer_pos = _buffer.size();
+            continue;
+        }
+        _buffer_pos = eol - _buffer.begin() + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        return line;
+    }
+}
+
+size_t SocketHttp::read_raw(uint8_t* buffer, size_t size)
+{
+    if (_buffer_pos < _buffer.size())
+    {
+        const auto count = std::min(size, _buffer.size() - _buffer_pos);
+        memcpy(buffer, _buffer.data() + _buffer_pos, count);
+        _buffer_pos += count;
+        return count;
+    }
+
+    // nothing buffered, receive directly in the caller's buffer
+    for (;;)
+    {
+        const auto ret = ::recv(_fd, buffer, size, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throw HttpError(fmt::format("下载错误: {}", strerror(errno)));
+        return ret;
+    }
+}
+
+bool SocketHttp::read_headers()
+{
+    // a kept alive connection closed by the server fails here, before any
+    // byte of the response
+    try
+    {
+        if (fill() == 0)
+            return false;
+    }
+    catch (const HttpError&)
+    {
+        if (_reused)
+            return false;
+        throw;
+    }
+
+    const auto status_line = read_line();
+    int minor = 0;
+    if (sscanf(status_line.c_str(), "HTTP/1.%d %d", &minor, &_status) != 2)
+        throw HttpError(fmt::format("无效的HTTP响应: {}", status_line));
+    _keep_alive = minor >= 1;
+
+    for (;;)
+    {
+        const auto line = read_line();
+        if (line.empty())
+            break;
+        _response_headers.push_back(line);
+
+        std::string value;
+        if (header_is(line, "Content-Length", &value))
+            _content_length = parse_length(value, 10);
+        else if (header_is(line, "Transfer-Encoding", &value))
+            _chunked = contains_token(value, "chunked");
+        else if (header_is(line, "Connection", &value))
+        {
+            if (contains_token(value, "close"))
+                _keep_alive = false;
+            else if (contains_token(value, "keep-alive"))
+                _keep_alive = true;
+        }
+    }
+
+    if (_chunked)
+        _content_length = -1;
+    _remaining = _content_length;
+    _body_done = _head || _status == 204 || _status == 304 ||
+                 _content_length == 0;
+    return true;
+}
+
+void SocketHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _request_headers += fmt::format("{}: {}\r\n", name, value);
+}
+
+std::string SocketHttp::get_response_header(const std::string& name)
+{
+    std::string value;
+    for (const auto& line : _response_headers)
+        if (header_is(line, name.c_str(), &value))
+            return value;
+    return {};
+}
+
+void SocketHttp::start(const std::string& url, uint64_t offset, bool head)
+{
+    if (_fd >= 0)
+        throw HttpError("HTTP连接已启动");
+
+    LOGF("starting http {} request for {}", head ? "HEAD" : "GET", url);
+
+    std::string extra_headers;
+    extra_headers.swap(_request_headers);
+
+    const auto parsed = parse_url(url);
+    const auto host = parsed.host + ":" + parsed.port;
+    _origin = pkgi_http_origin(url);
+
+    auto request = fmt::format(
+            "{} {} HTTP/1.1\r\n"
+            "Host: {}\r\n"
+            "User-Agent: " PKGI_USER_AGENT "\r\n"
+            "Connection: keep-alive\r\n",
+            head ? "HEAD" : "GET",
+            parsed.path,
+            parsed.port == "80" ? parsed.host : host);
+    if (offset != 0 && !head)
+        request += fmt::format("Range: bytes={}-\r\n", offset);
+    request += extra_headers;
+    request += "\r\n";
+
+    _head = head;
+    auto idle = g_pool.acquire(_origin);
+    try
+    {
+        start_on_slot(request, parsed.host, parsed.port, idle);
+    }
+    catch (...)
+    {
+        if (_fd >= 0)
+            ::close(_fd);
+        _fd = -1;
+        g_pool.release(_origin, std::nullopt);
+        throw;
+    }
+}
+
+void SocketHttp::start_on_slot(
+        const std::string& request,
+        const std::string& host,
+        const std::string& port,
+        std::optional<int> idle)
+{
+    for (int attempt = 0;; ++attempt)
+    {
+        _status = 0;
+        _status_checked = false;
+        _keep_alive = false;
+        _chunked = false;
+        _content_length = -1;
+        _remaining = 0;
+        _chunk_remaining = -1;
+        _body_done = false;
+        _buffer.clear();
+        _buffer_pos = 0;
+        _response_headers.clear();
+
+        _fd = attempt == 0 && idle ? *idle : -1;
+        _reused = _fd >= 0;
+        if (!_reused)
+            connect(host, port);
+
+        if (send_request(request) && read_headers())
+            break;
+
+        ::close(_fd);
+        _fd = -1;
+        if (!_reused)
+            throw HttpError("网络错误: 连接被关闭");
+        LOG("kept alive connection was closed, reconnecting");
+    }
+}
+
+int64_t SocketHttp::read(uint8_t* buffer, uint64_t size)
+{
+    check_status();
+
+    if (_body_done || size == 0)
+        return 0;
+
+    if (_chunked)
+    {
+        if (_chunk_remaining <= 0)
+        {
+            // CRLF that ends the previous chunk
+            if (_chunk_remaining == 0)
+                read_line();
+            const auto header = read_line();
+            _chunk_remaining = parse_length(header, 16);
+            if (_chunk_remaining == 0)
+            {
+                // skip trailers
+                while (!read_line().empty())
+                    ;
+                _body_done = true;
+                return 0;
+            }
+        }
+
+        const auto read = read_raw(
+                buffer, std::min<uint64_t>(size, _chunk_remaining));
+        if (read == 0)
+            throw HttpError("HTTP连接意外断开");
+        _chunk_remaining -= read;
+        return read;
+    }
+
+    if (_content_length >= 0)
+    {
+        const auto read =
+                read_raw(buffer, std::min<uint64_t>(size, _remaining));
+        if (read == 0)
+            throw HttpError("HTTP连接意外断开");
+        _remaining -= read;
+        if (_remaining == 0)
+            _body_done = true;
+        return read;
+    }
+
+    // the body ends with the connection
+    const auto read = read_raw(buffer, size);
+    if (read == 0)
+    {
+        _body_done = true;
+        _keep_alive = false;
+    }
+    return read;
+}
+
+void SocketHttp::abort()
+{
+    if (_fd >= 0)
+    {
+        _keep_alive = false;
+        shutdown(_fd, SHUT_RDWR);
+    }
+}
+
+void SocketHttp::release()
+{
+    // the connection can only be reused once the whole response was read
+    const bool reusable =
+            _body_done && _keep_alive && _buffer_pos == _buffer.size();
+    if (!reusable)
+        ::close(_fd);
+    const auto evicted = g_pool.release(
+            _origin, reusable ? std::optional<int>(_fd) : std::nullopt);
+    if (evicted)
+        ::close(*evicted);
+    _fd = -1;
+}
+
+void SocketHttp::close()
+{
+    if (_fd >= 0)
+    {
+        LOG("http close");
+        release();
+    }
+}
+
+int SocketHttp::get_status()
+{
+    return _status;
+}
+
+int64_t SocketHttp::get_length()
+{
+    check_status();
+
+    if (_content_length < 0)
+    {
+        LOG("http response has no content length (or chunked "
+            "encoding)");
+        return 0;
+    }
+
+    LOGF("http response length = {}", _content_length);
+    return _content_length;
+}
+
+void SocketHttp::check_status()
+{
+    if (_status_checked)
+        return;
+    _status_checked = true;
+
+    LOGF("http status code = {}", _status);
+
+    if (_status == 404)
+        throw HttpError(fmt::format(
+                "未找到列表, 建议删除 {} 后重试", pkgi_get_config_folder()));
+    if (_status != 200 && _status != 206)
+        throw HttpError(fmt::format("HTTP状态异常: {}", _status));
+}
+
+SocketHttp::operator bool() const
+{
+    return _fd >= 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "http.hpp"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Plain HTTP/1.1 over POSIX sockets for the host build. Connections are kept
+// alive in a ConnectionPool and reused by later requests to the same origin.
+class SocketHttp : public Http
+{
+public:
+    ~SocketHttp();
+
+    void start(const std::string& url, uint64_t offset, bool head = false) override;
+    int64_t read(uint8_t* buffer, uint64_t size) override;
+    void abort() override;
+    void close() override;
+
+    int get_status() override;
+    int64_t get_length() override;
+
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
+    explicit operator bool() const override;
+
+    // number of requests that got a kept alive connection, for benchmarks
+    static unsigned reused_connections();
+    // slots of the pool nobody holds or waits for
+    static size_t spare_connections();
+
+private:
+    static constexpr auto RECV_BUFFER_SIZE = 16 * 1024;
+
+    int _fd = -1;
+    std::string _origin;
+    bool _reused = false;
+
+    int _status = 0;
+    bool _status_checked = false;
+    bool _head = false;
+    bool _keep_alive = false;
+    bool _chunked = false;
+    // -1 when the body ends when the connection is closed
+    int64_t _content_length = -1;
+    int64_t _remaining = 0;
+    // bytes left in the current chunk, -1 before the first chunk header
+    int64_t _chunk_remaining = -1;
+    bool _body_done = false;
+
+    std::string _buffer;
+    size_t _buffer_pos = 0;
+
+    std::string _request_headers;
+    std::vector<std::string> _response_headers;
+
+    void start_on_slot(
+            const std::string& request,
+            const std::string& host,
+            const std::string& port,
+            std::optional<int> idle);
+    void connect(const std::string& host, const std::string& port);
+    bool send_request(const std::string& request);
+    bool read_headers();
+    size_t fill();
+    std::string read_line();
+    size_t read_raw(uint8_t* buffer, size_t size);
+    void check_status();
+    void release();
+};
@@ -34,3 +34,13 @@ struct SqliteClose
 };
 
 using SqlitePtr = std::unique_ptr<sqlite3, SqliteClose>;
+
+struct SqliteFinalize
+{
+    void operator()(sqlite3_stmt* s)
+    {
+        sqlite3_finalize(s);
+    }
+};
+
+using SqliteStmtPtr = std::unique_ptr<sqlite3_stmt, SqliteFinalize>;
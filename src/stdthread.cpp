@@ -0,0 +1,111 @@
+#include "thread.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <pthread.h>
+
+struct Mutex::Native
+{
+    std::mutex mutex;
+};
+
+struct Cond::Native
+{
+    std::condition_variable cond;
+};
+
+struct Thread::Native
+{
+    std::thread thread;
+};
+
+Mutex::Mutex(const std::string& name)
+    : _probe(name), _native(std::make_unique<Native>())
+{
+}
+
+Mutex::~Mutex() = default;
+
+void Mutex::lock_native()
+{
+    _native->mutex.lock();
+}
+
+bool Mutex::try_lock_native()
+{
+    return _native->mutex.try_lock();
+}
+
+void Mutex::unlock_native()
+{
+    _native->mutex.unlock();
+}
+
+Cond::Cond(const std::string& name)
+    : _mutex(name + "_mutex"), _native(std::make_unique<Native>())
+{
+}
+
+Cond::~Cond() = default;
+
+void Cond::notify_one()
+{
+    _native->cond.notify_one();
+}
+
+void Cond::notify_all()
+{
+    _native->cond.notify_all();
+}
+
+void Cond::wait_native()
+{
+    // the caller keeps owning the mutex
+    std::unique_lock<std::mutex> lock(_mutex._native->mutex, std::adopt_lock);
+    _native->cond.wait(lock);
+    lock.release();
+}
+
+bool Cond::wait_for_native(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(_mutex._native->mutex, std::adopt_lock);
+    const auto status = _native->cond.wait_for(
+            lock, std::chrono::milliseconds(timeout_ms));
+    lock.release();
+    return status == std::cv_status::no_timeout;
+}
+
+Thread::Thread(const std::string& name, EntryPoint entry, int, uint32_t)
+    : _native(std::make_unique<Native>())
+{
+    _native->thread = std::thread(
+            [name, entry = std::move(entry)] {
+                // at most 15 characters on Linux
+                pthread_setname_np(
+                        pthread_self(), name.substr(0, 15).c_str());
+                run_entry_point(entry);
+            });
+}
+
+Thread::~Thread()
+{
+    // like the Vita, a thread that was not joined is not waited for
+    if (_native->thread.joinable())
+    {
+        LOG("thread deleted while running");
+        _native->thread.detach();
+    }
+}
+
+void Thread::yield()
+{
+    std::this_thread::yield();
+}
+
+void Thread::join()
+{
+    _native->thread.join();
+}
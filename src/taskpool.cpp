@@ -0,0 +1,157 @@
+#include "taskpool.hpp"
+
+#include <fmt/format.h>
+
+#include <mutex>
+
+void TaskHandle::join()
+{
+    if (!_state)
+        return;
+    _pool->wait(*_state);
+    if (_state->error)
+        std::rethrow_exception(_state->error);
+}
+
+bool TaskHandle::is_done() const
+{
+    return !_state || _state->done;
+}
+
+TaskPool::Worker::Worker(size_t index)
+    : mutex(fmt::format("task_pool_mutex_{}", index))
+{
+}
+
+TaskPool::TaskPool(size_t workers) : _cond("task_pool_cond")
+{
+    for (size_t i = 0; i < workers; ++i)
+        _workers.push_back(std::make_unique<Worker>(i));
+    for (size_t i = 0; i < workers; ++i)
+        _threads.push_back(std::make_unique<Thread>(
+                fmt::format("task_pool_{}", i), [this, i] { run(i); }));
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        _dying = true;
+    }
+    _cond.notify_all();
+    for (const auto& thread : _threads)
+        thread->join();
+}
+
+TaskHandle TaskPool::submit(Task task, int priority)
+{
+    auto state = std::make_shared<TaskHandle::State>();
+    auto& worker = *_workers[_next_worker++ % _workers.size()];
+    {
+        std::lock_guard<Mutex> _(worker.mutex);
+        worker.queues[priority].push_back(Entry{std::move(task), state});
+    }
+    ++_pending;
+
+    {
+        // taken so that a worker can't miss the task between its check of
+        // _pending and its wait
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+    }
+    if (_joiners != 0)
+        _cond.notify_all();
+    else
+        _cond.notify_one();
+    return TaskHandle(this, std::move(state));
+}
+
+bool TaskPool::pop(size_t index, bool is_worker, Entry& entry)
+{
+    if (_pending == 0)
+        return false;
+
+    for (int priority = PRIORITIES - 1; priority >= 0; --priority)
+        for (size_t i = 0; i < _workers.size(); ++i)
+        {
+            auto& worker = *_workers[(index + i) % _workers.size()];
+            std::lock_guard<Mutex> _(worker.mutex);
+            auto& queue = worker.queues[priority];
+            if (queue.empty())
+                continue;
+            entry = std::move(queue.front());
+            queue.pop_front();
+            --_pending;
+            if (i != 0 || !is_worker)
+                ++_steals;
+            return true;
+        }
+    return false;
+}
+
+void TaskPool::execute(Entry& entry)
+{
+    try
+    {
+        entry.task();
+    }
+    catch (...)
+    {
+        entry.state->error = std::current_exception();
+    }
+    entry.state->done = true;
+
+    if (_joiners != 0)
+    {
+        {
+            std::lock_guard<Mutex> _(_cond.get_mutex());
+        }
+        _cond.notify_all();
+    }
+}
+
+bool TaskPool::run_one(size_t index, bool is_worker)
+{
+    Entry entry;
+    if (!pop(index, is_worker, entry))
+        return false;
+    execute(entry);
+    return true;
+}
+
+void TaskPool::run(size_t index)
+{
+    while (true)
+    {
+        if (run_one(index, true))
+            continue;
+
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        while (!_dying && _pending == 0)
+            _cond.wait();
+        if (_dying && _pending == 0)
+            return;
+    }
+}
+
+void TaskPool::wait(const TaskHandle::State& state)
+{
+    // the thread that waits helps, it would sleep otherwise
+    const auto index = _next_worker++ % _workers.size();
+    while (!state.done)
+    {
+        if (run_one(index, false))
+            continue;
+
+        std::lock_guard<Mutex> _(_cond.get_mutex());
+        ++_joiners;
+        while (!state.done && _pending == 0)
+            _cond.wait();
+        --_joiners;
+    }
+}
+
+TaskPool& pkgi_task_pool()
+{
+    static TaskPool pool;
+    return pool;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "thread.hpp"
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <cstddef>
+
+class TaskPool;
+
+// Waits for a task submitted to a TaskPool. Destroying a handle does not
+// wait, the task still runs.
+class TaskHandle
+{
+public:
+    TaskHandle() = default;
+
+    // rethrows the exception of the task. Queued tasks are run while
+    // waiting, so a task can wait for the tasks it submitted.
+    void join();
+
+    bool is_done() const;
+
+    explicit operator bool() const
+    {
+        return static_cast<bool>(_state);
+    }
+
+private:
+    friend class TaskPool;
+
+    struct State
+    {
+        std::atomic<bool> done{false};
+        std::exception_ptr error;
+    };
+
+    TaskHandle(TaskPool* pool, std::shared_ptr<State> state)
+        : _pool(pool), _state(std::move(state))
+    {
+    }
+
+    TaskPool* _pool = nullptr;
+    std::shared_ptr<State> _state;
+};
+
+// A fixed set of workers for short CPU bound work, like decompressing blocks
+// or hashing. Every worker has its own queue per priority and submitted tasks
+// are spread over them. A worker runs the oldest task of the highest priority
+// it finds, from its own queues first, then taken from the other workers.
+// A thread that joins a task runs queued tasks meanwhile.
+//
+// Tasks should not block on the network or on a lock held for long, every
+// blocked task takes a worker away from the others.
+class TaskPool
+{
+public:
+    static constexpr int PriorityLow = 0;
+    static constexpr int PriorityNormal = 1;
+    static constexpr int PriorityHigh = 2;
+
+    // the Vita leaves three cores to applications
+    static constexpr size_t DEFAULT_WORKERS = 3;
+
+    using Task = std::function<void()>;
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool(TaskPool&&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+    TaskPool& operator=(TaskPool&&) = delete;
+
+    TaskPool(size_t workers = DEFAULT_WORKERS);
+    // runs the tasks that are still queued before returning
+    ~TaskPool();
+
+    TaskHandle submit(Task task, int priority = PriorityNormal);
+
+    size_t workers() const
+    {
+        return _workers.size();
+    }
+
+    // tasks taken from the queue of another worker or by a joining thread,
+    // for benchmarks
+    uint64_t steals() const
+    {
+        return _steals;
+    }
+
+private:
+    friend class TaskHandle;
+
+    static constexpr int PRIORITIES = PriorityHigh + 1;
+
+    struct Entry
+    {
+        Task task;
+        std::shared_ptr<TaskHandle::State> state;
+    };
+
+    struct Worker
+    {
+        Worker(size_t index);
+
+        Mutex mutex;
+        std::deque<Entry> queues[PRIORITIES];
+    };
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::unique_ptr<Thread>> _threads;
+
+    // queued tasks, sleeping workers wait on _cond for it to go up
+    std::atomic<size_t> _pending{0};
+    std::atomic<size_t> _next_worker{0};
+    std::atomic<uint64_t> _steals{0};
+    // threads waiting in join() for a task to be done
+    std::atomic<size_t> _joiners{0};
+    // notified when a task is queued or done
+    Cond _cond;
+    bool _dying = false;
+
+    void run(size_t index);
+    bool run_one(size_t index, bool is_worker);
+    bool pop(size_t index, bool is_worker, Entry& entry);
+    void execute(Entry& entry);
+    void wait(const TaskHandle::State& state);
+};
+
+// shared by the whole application
+TaskPool& pkgi_task_pool();
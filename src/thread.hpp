@@ -1,14 +1,21 @@
 #pragma once
 
+#include "lockstats.hpp"
 #include "pkgi.hpp"
 
-#include <psp2/kernel/threadmgr.h>
-
 #include <functional>
 #include <memory>
-#include <stdexcept>
 #include <string>
 
+#include <cstdint>
+
+// Mutex, Cond and Thread are implemented by vitathread.cpp with the kernel
+// primitives of the Vita, and by stdthread.cpp with the standard library on
+// the host.
+//
+// Built with PKGI_ENABLE_LOCK_STATS, they record how long each of them is
+// waited for and held in the LockStats of their name.
+
 class ScopeProcessLock
 {
 public:
@@ -20,11 +27,30 @@ public:
     ScopeProcessLock()
     {
         pkgi_lock_process();
+#ifdef PKGI_ENABLE_LOCK_STATS
+        // shared by its holders, it is never waited for
+        _locked_at = LockStats::now_us();
+        stats().acquired(false, 0);
+#endif
     }
     ~ScopeProcessLock()
     {
+#ifdef PKGI_ENABLE_LOCK_STATS
+        stats().released(LockStats::now_us() - _locked_at);
+#endif
         pkgi_unlock_process();
     }
+
+#ifdef PKGI_ENABLE_LOCK_STATS
+private:
+    uint64_t _locked_at;
+
+    static LockStats& stats()
+    {
+        static auto& stats = LockStats::get("process_lock");
+        return stats;
+    }
+#endif
 };
 
 class Mutex
@@ -35,62 +61,40 @@ public:
     Mutex& operator=(const Mutex&) = delete;
     Mutex& operator=(Mutex&&) = delete;
 
-    Mutex(const std::string& name)
-    {
-        // I don't know what this 2 is
-        const auto res =
-                sceKernelCreateLwMutex(&_mutex, name.c_str(), 0, 0, nullptr);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("create mutex failed error=0x%08x", res);
-        }
-    }
-
-    ~Mutex()
-    {
-        const auto res = sceKernelDeleteLwMutex(&_mutex);
-        if (res < 0)
-        {
-            // TODO assert
-            LOG("delete mutex failed error=0x%08x", res);
-        }
-    }
+    Mutex(const std::string& name);
+    ~Mutex();
 
     void lock()
     {
-        const auto res = sceKernelLockLwMutex(&_mutex, 1, nullptr);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("lock failed error=0x%08x", res);
-        }
+        _probe.lock(
+                [this] { return try_lock_native(); },
+                [this] { lock_native(); });
     }
 
     bool try_lock()
     {
-        // I don't know how to handle errors
-        // const auto res = sceKernelTryLockLwMutex(&_mutex);
-        // if (res < 0)
-        //{
-        //    // TODO throw
-        //    LOG("lock failed error=0x%08x", res);
-        //}
-        throw std::runtime_error("try_lock not implemented");
+        if (!try_lock_native())
+            return false;
+        _probe.locked();
+        return true;
     }
 
     void unlock()
     {
-        const auto res = sceKernelUnlockLwMutex(&_mutex, 1);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("unlock failed error=0x%08x", res);
-        }
+        _probe.unlocking();
+        unlock_native();
     }
 
 private:
-    SceKernelLwMutexWork _mutex;
+    struct Native;
+
+    LockProbe _probe;
+    std::unique_ptr<Native> _native;
+
+    // implemented by the backends
+    void lock_native();
+    bool try_lock_native();
+    void unlock_native();
 
     friend class Cond;
 };
@@ -103,45 +107,27 @@ public:
     Cond& operator=(const Cond&) = delete;
     Cond& operator=(Cond&&) = delete;
 
-    Cond(const std::string& name) : _mutex(name + "_mutex")
-    {
-        const auto res = sceKernelCreateLwCond(
-                &_cond, name.c_str(), 0, &_mutex._mutex, nullptr);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("create cond failed error=0x%08x", res);
-        }
-    }
+    Cond(const std::string& name);
+    ~Cond();
 
-    ~Cond()
-    {
-        const auto res = sceKernelDeleteLwCond(&_cond);
-        if (res < 0)
-        {
-            // TODO assert
-            LOG("delete cond failed error=0x%08x", res);
-        }
-    }
+    void notify_one();
+    void notify_all();
 
-    void notify_one()
+    // the mutex must be held, it is held again when these return
+    void wait()
     {
-        const auto res = sceKernelSignalLwCond(&_cond);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("cond signal failed error=0x%08x", res);
-        }
+        const auto start = _mutex._probe.cond_wait_begin();
+        wait_native();
+        _mutex._probe.cond_wait_end(start);
     }
 
-    void wait()
+    // false when timeout_ms passed without a notification
+    bool wait_for(uint32_t timeout_ms)
     {
-        const auto res = sceKernelWaitLwCond(&_cond, nullptr);
-        if (res < 0)
-        {
-            // TODO throw
-            LOG("wait cond failed error=0x%08x", res);
-        }
+        const auto start = _mutex._probe.cond_wait_begin();
+        const auto notified = wait_for_native(timeout_ms);
+        _mutex._probe.cond_wait_end(start);
+        return notified;
     }
 
     Mutex& get_mutex()
@@ -150,8 +136,13 @@ public:
     }
 
 private:
+    struct Native;
+
     Mutex _mutex;
-    SceKernelLwCondWork _cond;
+    std::unique_ptr<Native> _native;
+
+    void wait_native();
+    bool wait_for_native(uint32_t timeout_ms);
 };
 
 class Thread
@@ -159,61 +150,33 @@ class Thread
 public:
     using EntryPoint = std::function<void()>;
 
+    // priority and stack size are those of the Vita kernel, a lower priority
+    // runs first. The host leaves both to the system.
+    static constexpr int DEFAULT_PRIORITY = 0xb0;
+    static constexpr uint32_t DEFAULT_STACK_SIZE = 0x8000;
+
     Thread(const Thread&) = delete;
     Thread(Thread&&) = delete;
     Thread& operator=(const Thread&) = delete;
     Thread& operator=(Thread&&) = delete;
 
-    Thread(const std::string& name, EntryPoint entry)
-    {
-        _tid = sceKernelCreateThread(
-                name.c_str(), &entry_point, 0xb0, 0x8000, 0, 0, nullptr);
-        if (_tid < 0)
-        {
-            // TODO throw
-            LOG("create thread failed error=0x%08x", _tid);
-        }
-        auto entryp = new EntryPoint(std::move(entry));
-        const auto res = sceKernelStartThread(_tid, sizeof(entryp), &entryp);
-        if (res < 0)
-        {
-            delete entryp;
-            // TODO throw
-            LOG("start thread failed error=0x%08x", res);
-        }
-    }
-
-    ~Thread()
-    {
-        const auto res = sceKernelDeleteThread(_tid);
-        if (res < 0)
-        {
-            // TODO assert
-            LOG("thread delete failed error=0x%08x", res);
-        }
-    }
+    Thread(const std::string& name,
+           EntryPoint entry,
+           int priority = DEFAULT_PRIORITY,
+           uint32_t stack_size = DEFAULT_STACK_SIZE);
+    ~Thread();
 
-    void join()
-    {
-        int stat;
-        const auto res = sceKernelWaitThreadEnd(_tid, &stat, nullptr);
-        if (res < 0)
-        {
-            // TODO assert
-            LOG("thread join failed error=0x%08x", res);
-        }
-    }
+    void join();
 
-private:
-    SceUID _tid;
+    // lets the other threads ready to run go first
+    static void yield();
 
-    static int entry_point(SceSize, void* argp)
+    // runs entry and logs what it throws, for the backends
+    static void run_entry_point(const EntryPoint& entry)
     {
         try
         {
-            auto entryp = std::unique_ptr<EntryPoint>(
-                    *static_cast<EntryPoint**>(argp));
-            (*entryp)();
+            entry();
             LOG("thread successfully terminated");
         }
         catch (const std::exception& e)
@@ -224,6 +187,9 @@ private:
         {
             LOG("got unknown exception from thread");
         }
-        return 0;
     }
+
+private:
+    struct Native;
+    std::unique_ptr<Native> _native;
 };
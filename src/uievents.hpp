@@ -0,0 +1,69 @@
+#pragma once
+
+#include "ringbuffer.hpp"
+
+#include <string>
+
+// Something a worker thread has to tell the UI
+struct UiEvent
+{
+    enum Kind
+    {
+        // a download ended, content is the item to refresh, empty for a
+        // compatibility pack
+        DownloadFinished,
+        // text is why the download failed
+        DownloadFailed,
+        // text is what the refresh thread does now
+        RefreshStage,
+        // the lists are downloaded, text is the error if it failed
+        RefreshFinished,
+    };
+
+    Kind kind = DownloadFinished;
+    std::string content;
+    std::string text;
+};
+
+// Events from the workers to the main loop. Workers post without taking any
+// lock of the UI, the main loop drains the queue once per frame and is the
+// only one to touch the UI state.
+class UiEventQueue
+{
+public:
+    // a frame sees a few events at most
+    static constexpr size_t CAPACITY = 64;
+
+    UiEventQueue() : _ring(CAPACITY)
+    {
+    }
+
+    // from any thread. Waits when the UI is CAPACITY events behind, drops the
+    // event once the queue is closed.
+    void post(UiEvent::Kind kind, std::string content, std::string text = "")
+    {
+        UiEvent event;
+        event.kind = kind;
+        event.content = std::move(content);
+        event.text = std::move(text);
+        _ring.push(std::move(event));
+    }
+
+    // on the UI thread, handles the events posted so far
+    template <typename Handle>
+    void drain(Handle&& handle)
+    {
+        UiEvent event;
+        while (_ring.try_pop(event))
+            handle(event);
+    }
+
+    // once the main loop stopped draining, so that workers don't wait for it
+    void close()
+    {
+        _ring.close();
+    }
+
+private:
+    MpscRing<UiEvent> _ring;
+};
@@ -1,3 +1,4 @@
+#include "cachinghttp.hpp"
 #include "dialog.hpp"
 #include "file.hpp"
 #include "pkgi.hpp"
@@ -10,6 +11,9 @@
 #define PKGJ_UPDATE_URL "https://raw.githubusercontent.com/dragonflylee/pkgj/last"
 #define PKGJ_UPDATE_URL_VERSION PKGJ_UPDATE_URL "/version"
 
+// seconds between two checks of the version file
+#define PKGJ_UPDATE_CHECK_INTERVAL (6 * 60 * 60)
+
 namespace
 {
 std::string version;
@@ -81,7 +85,10 @@ void update_thread()
 
         LOGF("checking latest pkgi version at {}", PKGJ_UPDATE_URL_VERSION);
 
-        VitaHttp http;
+        CachingHttp http(
+                std::make_unique<VitaHttp>(),
+                pkgi_http_cache_path(),
+                PKGJ_UPDATE_CHECK_INTERVAL);
         http.start(PKGJ_UPDATE_URL_VERSION, 0);
         std::vector<uint8_t> last_versionb(10);
         last_versionb.resize(
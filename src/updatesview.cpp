@@ -0,0 +1,119 @@
+#include "updatesview.hpp"
+
+#include "imgui.hpp"
+#include "install.hpp"
+
+#include <fmt/format.h>
+
+extern "C"
+{
+#include "style.h"
+}
+
+namespace
+{
+constexpr unsigned UpdatesViewWidth = VITA_WIDTH * 0.8;
+constexpr unsigned UpdatesViewHeight = VITA_HEIGHT * 0.8;
+
+const auto Green = ImVec4(0.0f, 1.0f, 0.0f, 1.0f);
+}
+
+UpdatesView::UpdatesView(
+        FetchService* fetch_service,
+        const std::string& partition,
+        const std::set<std::string>& titleids)
+    : _partition(partition)
+{
+    LOGF("checking updates of {} games", titleids.size());
+    _titles.reserve(titleids.size());
+    for (const auto& titleid : titleids)
+        _titles.push_back(Title{
+                titleid,
+                PatchInfoFetcher(
+                        *fetch_service, titleid, FetchService::PriorityLow)});
+}
+
+void UpdatesView::poll()
+{
+    for (auto& title : _titles)
+    {
+        if (title.checked)
+            continue;
+
+        const auto status = title.fetcher.get_status();
+        if (status == PatchInfoFetcher::Status::Fetching)
+            continue;
+
+        title.checked = true;
+        ++_checked;
+        if (status == PatchInfoFetcher::Status::Error)
+        {
+            ++_failed;
+            continue;
+        }
+        if (status != PatchInfoFetcher::Status::Found)
+            continue;
+
+        const auto patch = title.fetcher.get_patch_info();
+        title.installed_version =
+                pkgi_get_game_version(_partition, title.titleid);
+        if (patch && pkgi_is_newer_version(
+                             title.installed_version, patch->version))
+            title.patch = patch;
+    }
+}
+
+void UpdatesView::render()
+{
+    poll();
+
+    ImGui::SetNextWindowPos(
+            ImVec2((VITA_WIDTH - UpdatesViewWidth) / 2,
+                   (VITA_HEIGHT - UpdatesViewHeight) / 2));
+    ImGui::SetNextWindowSize(ImVec2(UpdatesViewWidth, UpdatesViewHeight), 0);
+
+    ImGui::Begin(
+            fmt::format("检查游戏更新 ({}/{})###updatesview",
+                        _checked,
+                        _titles.size())
+                    .c_str(),
+            nullptr,
+            ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoMove |
+                    ImGuiWindowFlags_NoCollapse |
+                    ImGuiWindowFlags_NoSavedSettings);
+
+    if (_checked < _titles.size())
+        ImGui::Text(fmt::format(
+                            "正在检查已安装的游戏... {}/{}",
+                            _checked,
+                            _titles.size())
+                            .c_str());
+    else if (_failed)
+        ImGui::Text(fmt::format("检查完成, {} 个游戏检查失败", _failed)
+                            .c_str());
+    else
+        ImGui::Text("检查完成");
+
+    ImGui::Text(" ");
+
+    size_t available = 0;
+    for (const auto& title : _titles)
+    {
+        if (!title.patch)
+            continue;
+        ++available;
+        ImGui::TextColored(
+                Green,
+                fmt::format(
+                        "{}  {} -> {}  (需要固件 {})",
+                        title.titleid,
+                        title.installed_version,
+                        title.patch->version,
+                        title.patch->fw_version)
+                        .c_str());
+    }
+    if (available == 0 && _checked == _titles.size())
+        ImGui::Text("没有可用的游戏更新");
+
+    ImGui::End();
+}
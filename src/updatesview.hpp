@@ -0,0 +1,52 @@
+#pragma once
+
+#include "fetchservice.hpp"
+#include "patchinfofetcher.hpp"
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Checks every installed game for a newer patch and lists the ones that have
+// one. The checks run at low priority on the FetchService, opening a game
+// still gets its own patch info first.
+class UpdatesView
+{
+public:
+    UpdatesView(
+            FetchService* fetch_service,
+            const std::string& partition,
+            const std::set<std::string>& titleids);
+
+    void render();
+
+    bool is_closed() const
+    {
+        return _closed;
+    }
+
+    void close()
+    {
+        _closed = true;
+    }
+
+private:
+    struct Title
+    {
+        std::string titleid;
+        PatchInfoFetcher fetcher;
+        bool checked{false};
+        // only read once a patch was found
+        std::string installed_version;
+        std::optional<PatchInfo> patch;
+    };
+
+    std::string _partition;
+    std::vector<Title> _titles;
+    size_t _checked{0};
+    size_t _failed{0};
+
+    bool _closed{false};
+
+    void poll();
+};
@@ -55,6 +55,7 @@ static vita2d_font* g_font;
 
 static SceKernelLwMutexWork g_dialog_lock;
 static volatile int g_power_lock;
+static volatile uint32_t g_resume_count;
 
 static int g_ok_button;
 static int g_cancel_button;
@@ -255,10 +256,34 @@ int pkgi_cancel_button(void)
     return g_cancel_button;
 }
 
+static int pkgi_power_callback(
+        int notifyId, int notifyCount, int powerInfo, void* common)
+{
+    PKGI_UNUSED(notifyId);
+    PKGI_UNUSED(notifyCount);
+    PKGI_UNUSED(common);
+    if (powerInfo & SCE_POWER_CB_RESUME_COMPLETE)
+        __atomic_add_fetch(&g_resume_count, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+uint32_t pkgi_resume_count()
+{
+    return __atomic_load_n(&g_resume_count, __ATOMIC_SEQ_CST);
+}
+
 static int pkgi_power_thread(SceSize args, void* argp)
 {
     PKGI_UNUSED(args);
     PKGI_UNUSED(argp);
+
+    // callbacks are delivered to the thread that created them while it waits
+    // in a *CB function
+    SceUID cb = sceKernelCreateCallback(
+            "power_callback", 0, &pkgi_power_callback, NULL);
+    if (cb < 0 || scePowerRegisterCallback(cb) < 0)
+        LOG("failed to register power callback");
+
     for (;;)
     {
         int lock;
@@ -268,7 +293,7 @@ static int pkgi_power_thread(SceSize args, void* argp)
             sceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
         }
 
-        sceKernelDelayThread(10 * 1000 * 1000);
+        sceKernelDelayThreadCB(10 * 1000 * 1000);
     }
     return 0;
 }
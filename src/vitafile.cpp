@@ -125,6 +125,20 @@ void* pkgi_openrw(const char* path)
     return (void*)(intptr_t)fd;
 }
 
+void* pkgi_open(const char* path)
+{
+    LOG("sceIoOpen open on %s", path);
+    SceUID fd = sceIoOpen(path, SCE_O_RDONLY, 0777);
+    if (fd < 0)
+    {
+        LOG("cannot open %s, err=0x%08x", path, fd);
+        return NULL;
+    }
+    LOG("sceIoOpen returned fd=%d", fd);
+
+    return (void*)(intptr_t)fd;
+}
+
 void* pkgi_append(const char* path)
 {
     LOG("sceIoOpen append on %s", path);
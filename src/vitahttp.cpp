@@ -5,24 +5,81 @@
 #include <psp2/net/net.h>
 #include <psp2/net/netctl.h>
 
+#include "connectionpool.hpp"
+#include "thread.hpp"
+
 #include <fmt/format.h>
 
 #include <boost/scope_exit.hpp>
 
 #define PKGI_USER_AGENT "libhttp/3.65 (PS Vita)"
 
-struct pkgi_http
+namespace
 {
-    int used;
+constexpr size_t MAX_IDLE_CONNECTIONS = 4;
+// a request waiting this long for a connection fails and is retried
+constexpr uint32_t ACQUIRE_TIMEOUT_MS = 60 * 1000;
+// a stalled read fails after this long instead of hanging the download
+constexpr unsigned RECV_TIMEOUT_US = 30 * 1000 * 1000;
 
+struct VitaConnection
+{
     int tmpl;
     int conn;
-    int req;
 };
 
-namespace
+struct PoolSync
 {
-static pkgi_http g_http[4];
+    Cond cond{"http_pool_cond"};
+
+    void lock()
+    {
+        cond.get_mutex().lock();
+    }
+    void unlock()
+    {
+        cond.get_mutex().unlock();
+    }
+    void wait_for(uint32_t timeout_ms)
+    {
+        cond.wait_for(timeout_ms);
+    }
+    void notify_one()
+    {
+        cond.notify_one();
+    }
+};
+
+ConnectionPool<VitaConnection, PoolSync> g_pool(
+        VitaHttp::MAX_CONNECTIONS, MAX_IDLE_CONNECTIONS, ACQUIRE_TIMEOUT_MS);
+
+void delete_connection(const VitaConnection& connection)
+{
+    sceHttpDeleteConnection(connection.conn);
+    sceHttpDeleteTemplate(connection.tmpl);
+}
+
+std::string send_error_message(int err)
+{
+    switch (static_cast<uint32_t>(err))
+    {
+        case 0x80431063:
+            return "网络错误";
+        case 0x80431068:
+            return "网络超时";
+        case 0x80431082:
+            return "请求被阻塞";
+        case 0x80436007:
+            return fmt::format(
+                    "主机不存在, 建议删除 {} 后重试", pkgi_get_config_folder());
+        case 0x80431084:
+            return "代理错误";
+        case 0x80431075:
+            return "SSL错误";
+        default:
+            return "";
+    }
+}
 }
 
 VitaHttp::~VitaHttp()
@@ -30,81 +87,123 @@ VitaHttp::~VitaHttp()
     close();
 }
 
+size_t VitaHttp::spare_connections()
+{
+    return g_pool.spare();
+}
+
 void VitaHttp::close()
 {
-    if (_http)
+    if (_req >= 0)
     {
         LOG("http close");
-        sceHttpDeleteRequest(_http->req);
-        sceHttpDeleteConnection(_http->conn);
-        sceHttpDeleteTemplate(_http->tmpl);
-        _http->used = 0;
-        _http = nullptr;
+        sceHttpDeleteRequest(_req);
+        _req = -1;
     }
+    if (_conn < 0)
+        return;
+
+    std::optional<VitaConnection> connection;
+    if (_reusable)
+        connection = VitaConnection{_tmpl, _conn};
+    else
+        delete_connection(VitaConnection{_tmpl, _conn});
+    _tmpl = _conn = -1;
+    _reusable = false;
+
+    const auto evicted = g_pool.release(_origin, connection);
+    if (evicted)
+        delete_connection(*evicted);
 }
 
 void VitaHttp::start(const std::string& url, uint64_t offset, bool head)
 {
-    if (_http)
+    if (_conn >= 0)
         throw HttpError("HTTP连接已启动");
 
-    LOG("http get");
+    LOGF("starting http {} request for {}", head ? "HEAD" : "GET", url);
 
-    pkgi_http* http = NULL;
-    for (size_t i = 0; i < 4; i++)
+    BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (g_http[i].used == 0)
-        {
-            http = g_http + i;
-            break;
-        }
-    }
-
-    if (!http)
-        throw HttpError("内部错误: 同时发起的连接过多");
+        _request_headers.clear();
+    };
 
-    int tmpl = -1;
-    int conn = -1;
-    int req = -1;
+    _origin = pkgi_http_origin(url);
+    _status_checked = false;
+    _reusable = false;
+    _remaining = -1;
 
-    LOGF("starting http GET request for {}", url);
+    auto idle = g_pool.acquire(_origin);
+    if (idle)
+    {
+        _tmpl = idle->tmpl;
+        _conn = idle->conn;
+        // the server may have closed a kept alive connection in the
+        // meantime, retry once on a fresh one
+        const auto err = send_request(url, offset, head);
+        if (err >= 0)
+            return;
+        LOGF("kept alive connection failed: {:#08x}, reconnecting",
+             static_cast<uint32_t>(err));
+        if (_req >= 0)
+            sceHttpDeleteRequest(_req);
+        _req = -1;
+        delete_connection(*idle);
+        _tmpl = _conn = -1;
+    }
 
+    int tmpl;
     if ((tmpl = sceHttpCreateTemplate(
                  PKGI_USER_AGENT, SCE_HTTP_VERSION_1_1, SCE_TRUE)) < 0)
+    {
+        g_pool.release(_origin, std::nullopt);
         throw HttpError(fmt::format(
                 "创建模板失败: {:#08x}",
                 static_cast<uint32_t>(tmpl)));
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        if (tmpl > 0)
-            sceHttpDeleteTemplate(tmpl);
-    };
-    // sceHttpSetRecvTimeOut(tmpl, 10 * 1000 * 1000);
+    }
+    sceHttpSetRecvTimeOut(tmpl, RECV_TIMEOUT_US);
 
-    if ((conn = sceHttpCreateConnectionWithURL(tmpl, url.c_str(), SCE_FALSE)) <
+    int conn;
+    if ((conn = sceHttpCreateConnectionWithURL(tmpl, url.c_str(), SCE_TRUE)) <
         0)
+    {
+        sceHttpDeleteTemplate(tmpl);
+        g_pool.release(_origin, std::nullopt);
         throw HttpError(fmt::format(
                 "创建与链接的连接失败: {:#08x}",
                 static_cast<uint32_t>(conn)));
-    BOOST_SCOPE_EXIT_ALL(&)
-    {
-        if (conn > 0)
-            sceHttpDeleteConnection(conn);
-    };
+    }
+    // from here on close() gives the slot back
+    _tmpl = tmpl;
+    _conn = conn;
 
-    if ((req = sceHttpCreateRequestWithURL(
-                 conn,
+    const auto err = send_request(url, offset, head);
+    if (err >= 0)
+        return;
+
+    close();
+    if (err == -1)
+        throw HttpError("创建链接的请求失败");
+    throw formatEx<HttpError>(
+            "发送请求失败: {:#08x}\n{}",
+            static_cast<uint32_t>(err),
+            send_error_message(err));
+}
+
+// Returns a negative error code if the request could not be sent on the
+// current connection
+int VitaHttp::send_request(const std::string& url, uint64_t offset, bool head)
+{
+    if ((_req = sceHttpCreateRequestWithURL(
+                 _conn,
                  head ? SCE_HTTP_METHOD_HEAD : SCE_HTTP_METHOD_GET,
                  url.c_str(),
                  0)) < 0)
-        throw HttpError(fmt::format(
-                "创建链接的请求失败: {:#08x}",
-                static_cast<uint32_t>(req)));
-    BOOST_SCOPE_EXIT_ALL(&)
     {
-        if (req > 0)
-            sceHttpDeleteRequest(req);
-    };
+        LOGF("create request failed: {:#08x}", static_cast<uint32_t>(_req));
+        _req = -1;
+        return -1;
+    }
 
     int err;
 
@@ -113,70 +212,55 @@ void VitaHttp::start(const std::string& url, uint64_t offset, bool head)
         char range[64];
         pkgi_snprintf(range, sizeof(range), "bytes=%llu-", offset);
         if ((err = sceHttpAddRequestHeader(
-                     req, "Range", range, SCE_HTTP_HEADER_ADD)) < 0)
+                     _req, "Range", range, SCE_HTTP_HEADER_ADD)) < 0)
             throw HttpError(fmt::format(
                     "添加请求文件头失败: {:#08x}",
                     static_cast<uint32_t>(err)));
     }
 
-    if ((err = sceHttpSendRequest(req, NULL, 0)) < 0)
-    {
-        std::string err_msg;
-        switch (static_cast<uint32_t>(err))
-        {
-            case 0x80431063:
-                err_msg = "网络错误";
-                break;
-            case 0x80431068:
-                err_msg = "网络超时";
-                break;
-            case 0x80431082:
-                err_msg = "请求被阻塞";
-                break;
-            case 0x80436007:
-                err_msg = fmt::format("主机不存在, 建议删除 {} 后重试", pkgi_get_config_folder());
-                break;
-            case 0x80431084:
-                err_msg = "代理错误";
-                break;
-            case 0x80431075:
-                err_msg = "SSL错误";
-                break;
-            default:
-                err_msg = "";
-        }
-
-        throw formatEx<HttpError>("发送请求失败: {:#08x}\n{}",
-            static_cast<uint32_t>(err),
-            err_msg);
-    }
+    for (const auto& header : _request_headers)
+        if ((err = sceHttpAddRequestHeader(
+                     _req,
+                     header.first.c_str(),
+                     header.second.c_str(),
+                     SCE_HTTP_HEADER_ADD)) < 0)
+            throw HttpError(fmt::format(
+                    "添加请求文件头失败: {:#08x}",
+                    static_cast<uint32_t>(err)));
 
-    http->used = 1;
-    http->tmpl = tmpl;
-    http->conn = conn;
-    http->req = req;
-    tmpl = conn = req = -1;
+    if ((err = sceHttpSendRequest(_req, NULL, 0)) < 0)
+        return err;
 
-    _http = http;
+    // a HEAD response has no body to read before the next request
+    _reusable = head;
+    return 0;
 }
 
 int64_t VitaHttp::read(uint8_t* buffer, uint64_t size)
 {
     check_status();
 
-    int read = sceHttpReadData(_http->req, buffer, size);
+    int read = sceHttpReadData(_req, buffer, size);
     if (read < 0)
+    {
+        _reusable = false;
         throw HttpError(fmt::format(
                 "下载错误 {:#08x}",
                 static_cast<uint32_t>(static_cast<int32_t>(read))));
+    }
+    // the connection can only be reused once the whole response was read
+    if (_remaining > 0)
+        _remaining -= read;
+    _reusable = (read == 0 && size != 0) || _remaining == 0;
     return read;
 }
 
 void VitaHttp::abort()
 {
-    if (_http)
+    if (_req >= 0)
     {
-        const auto err = sceHttpAbortRequest(_http->req);
+        _reusable = false;
+        const auto err = sceHttpAbortRequest(_req);
         if (err)
             LOGF("abort() failed: {:#08x}", static_cast<uint32_t>(err));
     }
@@ -188,7 +272,7 @@ int64_t VitaHttp::get_length()
 
     int res;
     uint64_t content_length;
-    res = sceHttpGetResponseContentLength(_http->req, &content_length);
+    res = sceHttpGetResponseContentLength(_req, &content_length);
     if (res < 0)
         throw HttpError(fmt::format(
                 "获取响应内容长度失败: {:#08x}",
@@ -205,11 +289,32 @@ int64_t VitaHttp::get_length()
     return content_length;
 }
 
+void VitaHttp::add_request_header(
+        const std::string& name, const std::string& value)
+{
+    _request_headers.emplace_back(name, value);
+}
+
+std::string VitaHttp::get_response_header(const std::string& name)
+{
+    char* headers;
+    unsigned int headers_size;
+    if (sceHttpGetAllResponseHeaders(_req, &headers, &headers_size) < 0)
+        return {};
+
+    const char* value;
+    unsigned int value_size;
+    if (sceHttpParseResponseHeader(
+                headers, headers_size, name.c_str(), &value, &value_size) < 0)
+        return {};
+    return std::string(value, value_size);
+}
+
 int VitaHttp::get_status()
 {
     int res;
     int status;
-    if ((res = sceHttpGetStatusCode(_http->req, &status)) < 0)
+    if ((res = sceHttpGetStatusCode(_req, &status)) < 0)
         throw HttpError(fmt::format(
                 "获取状态代码失败: {:#08x}",
                 static_cast<uint32_t>(res)));
@@ -231,9 +336,13 @@ void VitaHttp::check_status()
         throw HttpError(fmt::format("未找到列表, 建议删除 {} 后重试", pkgi_get_config_folder()));
     if (status != 200 && status != 206)
         throw HttpError(fmt::format("HTTP状态异常: {}", status));
+
+    uint64_t content_length;
+    if (sceHttpGetResponseContentLength(_req, &content_length) == 0)
+        _remaining = content_length;
 }
 
 VitaHttp::operator bool() const
 {
-    return _http;
+    return _req >= 0;
 }
@@ -3,8 +3,12 @@
 #include "http.hpp"
 #include "pkgi.hpp"
 
-struct pkgi_http;
+#include <string>
+#include <utility>
+#include <vector>
 
+// Connections are kept alive and shared through a ConnectionPool, a request
+// waits for a free connection instead of failing when too many are in use.
 class VitaHttp : public Http
 {
 public:
@@ -18,11 +22,34 @@ public:
     int get_status() override;
     int64_t get_length() override;
 
+    void add_request_header(
+            const std::string& name, const std::string& value) override;
+    std::string get_response_header(const std::string& name) override;
+
     explicit operator bool() const override;
 
+    // The pool has a slot for each fetch worker, the refresh thread, the
+    // prefetch thread and every download. A download only takes more for its
+    // mirrors when spare_connections() says they are free.
+    static constexpr size_t FETCH_CONNECTIONS = 2;
+    static constexpr size_t DOWNLOAD_CONNECTIONS = 4;
+    static constexpr size_t MAX_CONNECTIONS =
+            FETCH_CONNECTIONS + 2 + DOWNLOAD_CONNECTIONS;
+
+    static size_t spare_connections();
+
 private:
-    pkgi_http* _http = nullptr;
+    std::string _origin;
+    int _tmpl = -1;
+    int _conn = -1;
+    int _req = -1;
+    // the connection can be given back to the pool for the next request
+    bool _reusable = false;
+    // body bytes left to read, -1 when unknown
+    int64_t _remaining = -1;
+    std::vector<std::pair<std::string, std::string>> _request_headers;
     bool _status_checked = false;
 
+    int send_request(const std::string& url, uint64_t offset, bool head);
     void check_status();
 };
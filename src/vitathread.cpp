@@ -0,0 +1,201 @@
+#include "thread.hpp"
+
+#include <psp2/kernel/error.h>
+#include <psp2/kernel/threadmgr.h>
+
+struct Mutex::Native
+{
+    SceKernelLwMutexWork mutex;
+};
+
+struct Cond::Native
+{
+    SceKernelLwCondWork cond;
+};
+
+struct Thread::Native
+{
+    SceUID tid;
+};
+
+Mutex::Mutex(const std::string& name)
+    : _probe(name), _native(std::make_unique<Native>())
+{
+    // I don't know what this 2 is
+    const auto res = sceKernelCreateLwMutex(
+            &_native->mutex, name.c_str(), 0, 0, nullptr);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("create mutex failed error=0x%08x", res);
+    }
+}
+
+Mutex::~Mutex()
+{
+    const auto res = sceKernelDeleteLwMutex(&_native->mutex);
+    if (res < 0)
+    {
+        // TODO assert
+        LOG("delete mutex failed error=0x%08x", res);
+    }
+}
+
+void Mutex::lock_native()
+{
+    const auto res = sceKernelLockLwMutex(&_native->mutex, 1, nullptr);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("lock failed error=0x%08x", res);
+    }
+}
+
+bool Mutex::try_lock_native()
+{
+    // fails with SCE_KERNEL_ERROR_LW_MUTEX_FAILED_TO_OWN when the mutex is
+    // held, other errors can't be told apart from it
+    return sceKernelTryLockLwMutex(&_native->mutex, 1) >= 0;
+}
+
+void Mutex::unlock_native()
+{
+    const auto res = sceKernelUnlockLwMutex(&_native->mutex, 1);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("unlock failed error=0x%08x", res);
+    }
+}
+
+Cond::Cond(const std::string& name)
+    : _mutex(name + "_mutex"), _native(std::make_unique<Native>())
+{
+    const auto res = sceKernelCreateLwCond(
+            &_native->cond,
+            name.c_str(),
+            0,
+            &_mutex._native->mutex,
+            nullptr);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("create cond failed error=0x%08x", res);
+    }
+}
+
+Cond::~Cond()
+{
+    const auto res = sceKernelDeleteLwCond(&_native->cond);
+    if (res < 0)
+    {
+        // TODO assert
+        LOG("delete cond failed error=0x%08x", res);
+    }
+}
+
+void Cond::notify_one()
+{
+    const auto res = sceKernelSignalLwCond(&_native->cond);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("cond signal failed error=0x%08x", res);
+    }
+}
+
+void Cond::notify_all()
+{
+    const auto res = sceKernelBroadcastLwCond(&_native->cond);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("cond broadcast failed error=0x%08x", res);
+    }
+}
+
+void Cond::wait_native()
+{
+    const auto res = sceKernelWaitLwCond(&_native->cond, nullptr);
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("wait cond failed error=0x%08x", res);
+    }
+}
+
+bool Cond::wait_for_native(uint32_t timeout_ms)
+{
+    unsigned int timeout_us = timeout_ms * 1000;
+    const auto res = sceKernelWaitLwCond(&_native->cond, &timeout_us);
+    if (res == (int)SCE_KERNEL_ERROR_WAIT_TIMEOUT)
+        return false;
+    if (res < 0)
+    {
+        // TODO throw
+        LOG("wait cond failed error=0x%08x", res);
+    }
+    return true;
+}
+
+namespace
+{
+int entry_point(SceSize, void* argp)
+{
+    auto entryp = std::unique_ptr<Thread::EntryPoint>(
+            *static_cast<Thread::EntryPoint**>(argp));
+    Thread::run_entry_point(*entryp);
+    return 0;
+}
+}
+
+Thread::Thread(
+        const std::string& name,
+        EntryPoint entry,
+        int priority,
+        uint32_t stack_size)
+    : _native(std::make_unique<Native>())
+{
+    _native->tid = sceKernelCreateThread(
+            name.c_str(), &entry_point, priority, stack_size, 0, 0, nullptr);
+    if (_native->tid < 0)
+    {
+        // TODO throw
+        LOG("create thread failed error=0x%08x", _native->tid);
+    }
+    auto entryp = new EntryPoint(std::move(entry));
+    const auto res =
+            sceKernelStartThread(_native->tid, sizeof(entryp), &entryp);
+    if (res < 0)
+    {
+        delete entryp;
+        // TODO throw
+        LOG("start thread failed error=0x%08x", res);
+    }
+}
+
+Thread::~Thread()
+{
+    const auto res = sceKernelDeleteThread(_native->tid);
+    if (res < 0)
+    {
+        // TODO assert
+        LOG("thread delete failed error=0x%08x", res);
+    }
+}
+
+void Thread::yield()
+{
+    sceKernelDelayThread(0);
+}
+
+void Thread::join()
+{
+    int stat;
+    const auto res = sceKernelWaitThreadEnd(_native->tid, &stat, nullptr);
+    if (res < 0)
+    {
+        // TODO assert
+        LOG("thread join failed error=0x%08x", res);
+    }
+}